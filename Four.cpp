@@ -3,8 +3,13 @@
 #include "nav.h"
 #include "math.h"
 #include "gfx.h"
+#include "meshopt.h"
+#include "geocodec.h"
+#include "gltf.h"
 #include "iothread.h"
 #include "uvhttp.h"
+#include "metrics.h"
+#include "streaming.h"
 
 using namespace v8; 
 
@@ -133,10 +138,10 @@ namespace js {
 			void update() {
 				Handle<TypedArray> dataObj = handle()->Get(NavNew("data")).As<TypedArray>();
 				size_t dataLen = dataObj->ByteLength();
-				data()->_data.resize(dataLen);
+				uint8_t *dest = data()->allocate(dataLen);
 				uint8_t *dataBuf = (uint8_t*)dataObj->Buffer()->BaseAddress();
 				dataBuf += dataObj->ByteOffset();
-				memcpy(&data()->_data[0], dataBuf, dataLen);
+				memcpy(dest, dataBuf, dataLen);
 				data()->_itemSize = handle()->Get(NavNew("itemSize"))->Int32Value();
 				if (dataObj->IsFloat32Array()) {
 					data()->_itemType = gfx::BufferType::Float;
@@ -156,6 +161,36 @@ namespace js {
 				data()->_needsUpdate = true;
 			}
 
+			// Whether script handed us the array, as opposed to a loader
+			//   filling the native side only.
+			bool hasScriptData() {
+				return handle()->Get(NavNew("data"))->IsTypedArray();
+			}
+
+			// Replaces the script's array with a copy of the native bytes,
+			//   for when native code rewrites an attribute script created.
+			void syncToScript() {
+				gfx::BufferAttribute *attrib = data();
+				size_t len = attrib->byteLength();
+				Handle<ArrayBuffer> buf = ArrayBuffer::New(gIsolate, len);
+				if (len > 0) {
+					memcpy(buf->BaseAddress(), attrib->bytes(), len);
+				}
+				size_t count = len / gfx::bufferTypeSize(attrib->_itemType);
+				Handle<TypedArray> arr;
+				switch (attrib->_itemType) {
+				case gfx::BufferType::Byte: arr = Int8Array::New(buf, 0, count); break;
+				case gfx::BufferType::UnsignedByte: arr = Uint8Array::New(buf, 0, count); break;
+				case gfx::BufferType::Short: arr = Int16Array::New(buf, 0, count); break;
+				case gfx::BufferType::UnsignedShort: arr = Uint16Array::New(buf, 0, count); break;
+				case gfx::BufferType::Int: arr = Int32Array::New(buf, 0, count); break;
+				case gfx::BufferType::UnsignedInt: arr = Uint32Array::New(buf, 0, count); break;
+				default: arr = Float32Array::New(buf, 0, count); break;
+				}
+				handle()->Set(NavNew("data"), arr);
+				handle()->Set(NavNew("itemSize"), NavNew(attrib->_itemSize));
+			}
+
 			NavWatcher updateWatch;
 
 		};
@@ -342,6 +377,9 @@ namespace js {
 
 		};
 
+		class BufferGeometry;
+		void _optimizeGeometry(BufferGeometry *geometry);
+
 		class BufferGeometry : public NavObject<gfx::BufferGeometry> {
 		public:
 			NAV_CLASS_WRAPPER(gfx::BufferGeometry)
@@ -353,7 +391,18 @@ namespace js {
 			void constructor(const v8::FunctionCallbackInfo<v8::Value>& args) {
 				printf("^BufferGeometry\n");
 
-				
+				_staticBind.Bind(args.This(), "static", &data()->_static, std::bind(&BufferGeometry::staticChanged, this));
+			}
+			BoolBinder _staticBind;
+
+			// Marking geometry static opts it into the offline optimisation
+			//   pipeline.  Script-created arrays are replaced with the
+			//   optimised data once it lands.
+			void staticChanged() {
+				if (!data()->_static) {
+					return;
+				}
+				_optimizeGeometry(this);
 			}
 
 			void setAttribute(const v8::FunctionCallbackInfo<v8::Value>& args) {
@@ -363,16 +412,204 @@ namespace js {
 				}
 
 				String::Utf8Value name(args[0]);
-				BufferAttribute* attribute = NavUnwrap<BufferAttribute>(args[1]);
+				attach(*name, args[1].As<Object>());
+			}
 
-				auto existingI = data()->_attributes.emplace(std::string(*name), attribute->data());
-				if (!existingI.second) {
-					existingI.first->second = attribute->data();
+			// Keeps the attribute's wrapper alive alongside the native
+			//   pointer, so native code can reach it again later.
+			void attach(const std::string& name, Handle<Object> attribObj) {
+				data()->_attributes[name] = NavUnwrap<BufferAttribute>(attribObj)->data();
+				_attributeObjs[name] = PersistentHandleWrapper<Object>(gIsolate, attribObj);
+			}
+
+			// The wrapper attached under name, or nullptr for attributes
+			//   native code set directly.
+			BufferAttribute* attached(const std::string& name) {
+				auto foundI = _attributeObjs.find(name);
+				if (foundI == _attributeObjs.end()) {
+					return nullptr;
 				}
+				return NavUnwrap<BufferAttribute>(foundI->second.Extract());
 			}
 
+			std::unordered_map<std::string, PersistentHandleWrapper<Object>> _attributeObjs;
+
 		};
 
+		// Snapshots a geometry's attributes on the main thread, runs the
+		//   meshopt pipeline on the CPU pool and writes the result back.
+		class GeometryOptimizeRequest : public iothread::WorkerRequest {
+		public:
+			GeometryOptimizeRequest(BufferGeometry *owner)
+				: _owner(gIsolate, owner->handle()), _positionStream((size_t)-1), _index(nullptr), _indexVersion(0), _valid(true) {
+				gfx::BufferGeometry *geometry = owner->data();
+				_index = geometry->index();
+				gfx::BufferAttribute *position = geometry->attribute("position");
+				if (!position || position->_itemType != gfx::BufferType::Float || position->_itemSize < 3) {
+					_valid = false;
+					return;
+				}
+				_geom.vertexCount = position->count();
+
+				for (auto& i : geometry->_attributes) {
+					gfx::BufferAttribute *attrib = i.second;
+					if (attrib == _index) {
+						continue;
+					}
+					if (attrib->count() != _geom.vertexCount) {
+						_valid = false;
+						return;
+					}
+					if (attrib == position) {
+						_positionStream = _geom.streams.size();
+					}
+					meshopt::Stream stream;
+					stream.stride = attrib->_itemSize * gfx::bufferTypeSize(attrib->_itemType);
+					stream.data = attrib->packed();
+					_geom.streams.push_back(std::move(stream));
+					_Target target;
+					target.name = i.first;
+					target.attrib = attrib;
+					target.version = attrib->_version;
+					_targets.push_back(target);
+				}
+
+				if (_index) {
+					_indexVersion = _index->_version;
+					std::vector<uint8_t> indexData = _index->packed();
+					size_t count = _index->count();
+					_geom.indices.resize(count);
+					for (size_t i = 0; i < count; ++i) {
+						if (_index->_itemType == gfx::BufferType::UnsignedByte) {
+							_geom.indices[i] = indexData[i];
+						} else if (_index->_itemType == gfx::BufferType::UnsignedShort) {
+							_geom.indices[i] = ((const uint16_t*)&indexData[0])[i];
+						} else {
+							_geom.indices[i] = ((const uint32_t*)&indexData[0])[i];
+						}
+						if (_geom.indices[i] >= _geom.vertexCount) {
+							_valid = false;
+							return;
+						}
+					}
+				}
+			}
+
+			bool valid() const {
+				return _valid;
+			}
+
+		private:
+			void execute() override {
+				auto cached = meshopt::gCache.find(_geom);
+				if (cached) {
+					_geom = *cached;
+				} else {
+					meshopt::Geometry input = _geom;
+					meshopt::optimize(_geom, _positionStream);
+					meshopt::gCache.insert(input, std::make_shared<meshopt::Geometry>(_geom));
+				}
+				iothread::complete(this);
+			}
+
+			// Nothing is applied if any attribute was rewritten, replaced,
+			//   added or removed while we were working on the snapshot.
+			bool _stale(gfx::BufferGeometry *geometry) const {
+				size_t expected = _targets.size() + (_index ? 1 : 0);
+				if (geometry->_attributes.size() != expected || geometry->index() != _index) {
+					return true;
+				}
+				if (_index && _index->_version != _indexVersion) {
+					return true;
+				}
+				for (auto& i : _targets) {
+					if (geometry->attribute(i.name) != i.attrib || i.attrib->_version != i.version) {
+						return true;
+					}
+				}
+				return false;
+			}
+
+			void onComplete() override {
+				HandleScope handleScope(gIsolate);
+				BufferGeometry *owner = NavUnwrap<BufferGeometry>(_owner.Extract());
+				gfx::BufferGeometry *geometry = owner->data();
+				if (_stale(geometry)) {
+					delete this;
+					return;
+				}
+
+				// Script that kept its arrays gets the optimised ones back, so
+				//   a later needsUpdate doesn't pair old vertices with the
+				//   new index order.
+				bool scriptData = false;
+				for (size_t i = 0; i < _targets.size(); ++i) {
+					_targets[i].attrib->setData(_geom.streams[i].data);
+					_targets[i].attrib->_needsUpdate = true;
+					BufferAttribute *attribObj = owner->attached(_targets[i].name);
+					if (attribObj && attribObj->hasScriptData()) {
+						attribObj->syncToScript();
+						scriptData = true;
+					}
+				}
+
+				BufferAttribute *indexObj = owner->attached("index");
+				if (indexObj) {
+					scriptData = scriptData || indexObj->hasScriptData();
+				} else {
+					Handle<Object> obj = NavNew<BufferAttribute>();
+					owner->attach("index", obj);
+					indexObj = NavUnwrap<BufferAttribute>(obj);
+				}
+				gfx::BufferAttribute *index = indexObj->data();
+				index->_itemSize = 1;
+				if (_geom.vertexCount <= 0x10000) {
+					index->_itemType = gfx::BufferType::UnsignedShort;
+					uint16_t *out = (uint16_t*)index->allocate(_geom.indices.size() * sizeof(uint16_t));
+					for (size_t i = 0; i < _geom.indices.size(); ++i) {
+						out[i] = (uint16_t)_geom.indices[i];
+					}
+				} else {
+					index->_itemType = gfx::BufferType::UnsignedInt;
+					uint32_t *out = (uint32_t*)index->allocate(_geom.indices.size() * sizeof(uint32_t));
+					memcpy(out, &_geom.indices[0], _geom.indices.size() * sizeof(uint32_t));
+				}
+				index->_needsUpdate = true;
+				if (scriptData) {
+					indexObj->syncToScript();
+				}
+
+				delete this;
+			}
+
+			struct _Target {
+				std::string name;
+				gfx::BufferAttribute *attrib;
+				uint32_t version;
+			};
+
+			// Keeps the geometry, and through it the attributes, alive while
+			//   the work is under way.
+			PersistentHandleWrapper<Object> _owner;
+			meshopt::Geometry _geom;
+			size_t _positionStream;
+			std::vector<_Target> _targets;
+			gfx::BufferAttribute *_index;
+			uint32_t _indexVersion;
+			bool _valid;
+
+		};
+
+		void _optimizeGeometry(BufferGeometry *geometry) {
+			auto req = new GeometryOptimizeRequest(geometry);
+			if (!req->valid()) {
+				printf("BufferGeometry::staticChanged - geometry cannot be optimized\n");
+				delete req;
+				return;
+			}
+			iothread::dispatchCpu(req);
+		}
+
 		class Scene : public Object3d {
 		public:
 			NAV_CLASS_WRAPPER(gfx::Scene)
@@ -465,60 +702,932 @@ namespace js {
 				Scene *scene = NavObject::Unwrap<Scene>(args[0].As<Object>());
 				Camera *camera = NavObject::Unwrap<Camera>(args[1].As<Object>());
 				gfx::Renderer::render(scene->data(), camera->data());
+
+				// Streamed loads follow the camera of the last render.
+				gfx::Camera *view = camera->data();
+				streaming::View streamingView;
+				streamingView.viewProj = view->_projMatrix * view->_worldMatrix.inverse().matrix();
+				streamingView.eye = view->_worldMatrix.translation();
+				streamingView.focal = view->_projMatrix(1, 1);
+				streaming::manager().update(streamingView);
 			}
 		};
 
 		namespace io {
-			class UriRequest : public iothread::UriRequest {
+			// Keeps a blob alive for as long as the external ArrayBuffer
+			//   viewing it is reachable from JS.
+			struct _BlobBufferRef {
+				std::shared_ptr<uvpp::Blob> blob;
+				v8::Persistent<ArrayBuffer> handle;
+			};
+
+			void _onBlobBufferCollected(const v8::WeakCallbackData<ArrayBuffer, _BlobBufferRef>& data) {
+				_BlobBufferRef *ref = data.GetParameter();
+				gIsolate->AdjustAmountOfExternalAllocatedMemory(-(int64_t)ref->blob->size());
+				ref->handle.Reset();
+				delete ref;
+			}
+
+			Handle<ArrayBuffer> _newBlobBuffer(std::shared_ptr<uvpp::Blob> blob) {
+				Handle<ArrayBuffer> buf = ArrayBuffer::New(gIsolate, blob->data(), blob->size());
+				auto ref = new _BlobBufferRef();
+				ref->blob = blob;
+				ref->handle.Reset(gIsolate, buf);
+				ref->handle.SetWeak(ref, _onBlobBufferCollected);
+				gIsolate->AdjustAmountOfExternalAllocatedMemory((int64_t)blob->size());
+				return buf;
+			}
+
+			struct _Waiter {
+				_Waiter(bool asText, PersistentHandleWrapper<Function> callback, uint32_t ticket = 0)
+					: asText(asText), callback(callback), ticket(ticket) {
+				}
+
+				bool asText;
+				PersistentHandleWrapper<Function> callback;
+				// The id this caller was given; 0 for one-off requests.
+				uint32_t ticket;
+			};
+
+			void _callWaiter(_Waiter& waiter, int32_t errorCode, std::shared_ptr<uvpp::Blob> body) {
+				HandleScope handleScope(gIsolate);
+				Handle<Function> callback = waiter.callback.Extract();
+				Handle<Value> args[2];
+				if (errorCode == 0) {
+					args[0] = NavNull();
+					if (waiter.asText) {
+						args[1] = NavNew((const char*)body->data(), body->size());
+					} else {
+						args[1] = _newBlobBuffer(body);
+					}
+				} else {
+					args[0] = NavNew<Integer>(errorCode);
+					args[1] = NavNull();
+				}
+				callback->Call(NavGlobal(), 2, args);
+			}
+
+			// Bodies of finished loads, most recently used first, kept within
+			//   kMaxBytes and for as long as each response allows.  Each
+			//   caller gets its own ArrayBuffer over the same memory, so
+			//   buffers from load() are to be treated as read-only; V8 has no
+			//   way to enforce that.
+			class _BodyCache {
+			public:
+				static const size_t kMaxBytes = 64 * 1024 * 1024;
+				// For responses that give no lifetime of their own, and for
+				//   local files, which can change under us just the same.
+				static const uint64_t kDefaultLifetimeMs = 60 * 1000;
+
+				_BodyCache()
+					: _bytes(0) {
+				}
+
+				std::shared_ptr<uvpp::Blob> find(const std::string& uri) {
+					auto found = _index.find(uri);
+					if (found == _index.end()) {
+						return nullptr;
+					}
+					if (uv_hrtime() >= found->second->second.expiresNs) {
+						erase(uri);
+						return nullptr;
+					}
+					_lru.splice(_lru.begin(), _lru, found->second);
+					return found->second->second.body;
+				}
+
+				// Bodies over a quarter of the budget would flush everything
+				//   else for little gain.  A lifetime of 0 only drops any older
+				//   copy.
+				void insert(const std::string& uri, std::shared_ptr<uvpp::Blob> body, uint64_t lifetimeMs) {
+					erase(uri);
+					size_t size = body->size();
+					if (size > kMaxBytes / 4 || lifetimeMs == 0) {
+						return;
+					}
+					_Body cached;
+					cached.body = body;
+					cached.expiresNs = uv_hrtime() + lifetimeMs * 1000000ULL;
+					_lru.emplace_front(uri, cached);
+					_index[uri] = _lru.begin();
+					_bytes += size;
+					while (_bytes > kMaxBytes) {
+						_bytes -= _lru.back().second.body->size();
+						_index.erase(_lru.back().first);
+						_lru.pop_back();
+					}
+				}
+
+				void erase(const std::string& uri) {
+					auto found = _index.find(uri);
+					if (found != _index.end()) {
+						_bytes -= found->second->second.body->size();
+						_lru.erase(found->second);
+						_index.erase(found);
+					}
+				}
+
+				void clear() {
+					_lru.clear();
+					_index.clear();
+					_bytes = 0;
+				}
+
+			private:
+				struct _Body {
+					std::shared_ptr<uvpp::Blob> body;
+					uint64_t expiresNs;
+				};
+				typedef std::list<std::pair<std::string, _Body>> List;
+
+				List _lru;
+				std::unordered_map<std::string, List::iterator> _index;
+				size_t _bytes;
+
+			};
+			_BodyCache _bodyCache;
+
+			// One fetch per URI while it is in flight; later callers wait on
+			//   it instead of opening their own.  Each caller gets a ticket
+			//   of its own, so cancelling one leaves the others waiting.
+			struct _InFlight {
+				uint32_t id;
+				iothread::Priority priority;
+				std::vector<_Waiter> waiters;
+			};
+			std::unordered_map<std::string, _InFlight> _inFlight;
+			// Ticket to the URI it waits on.
+			std::unordered_map<uint32_t, std::string> _tickets;
+
+			// Drops one caller's callback; the fetch itself is cancelled
+			//   once nobody is left waiting on it.  False if the ticket is
+			//   unknown.
+			bool _cancelTicket(uint32_t ticket) {
+				auto found = _tickets.find(ticket);
+				if (found == _tickets.end()) {
+					return false;
+				}
+				auto inFlight = _inFlight.find(found->second);
+				_tickets.erase(found);
+				if (inFlight == _inFlight.end()) {
+					return true;
+				}
+				std::vector<_Waiter>& waiters = inFlight->second.waiters;
+				for (auto i = waiters.begin(); i != waiters.end(); ++i) {
+					if (i->ticket == ticket) {
+						waiters.erase(i);
+						break;
+					}
+				}
+				if (waiters.empty()) {
+					iothread::cancel(inFlight->second.id);
+					_inFlight.erase(inFlight);
+				}
+				return true;
+			}
+
+			// Hands a finished load to everyone waiting on it.  The entry goes
+			//   first so a callback loading the same URI again hits the cache.
+			//   id guards against a cancelled fetch finishing after a new one
+			//   for the same URI has taken its place.
+			//   lifetimeMs is how long the body may be served from memory.
+			void _finishLoad(const std::string& uri, uint32_t id, int32_t errorCode, std::shared_ptr<uvpp::Blob> body,
+				uint64_t lifetimeMs) {
+				auto found = _inFlight.find(uri);
+				if (found == _inFlight.end() || found->second.id != id) {
+					return;
+				}
+				std::vector<_Waiter> waiters;
+				waiters.swap(found->second.waiters);
+				_inFlight.erase(found);
+				for (auto& i : waiters) {
+					_tickets.erase(i.ticket);
+				}
+				if (errorCode == 0) {
+					_bodyCache.insert(uri, body, lifetimeMs);
+				} else {
+					_bodyCache.erase(uri);
+				}
+				for (auto& i : waiters) {
+					_callWaiter(i, errorCode, body);
+				}
+			}
+
+			// Completes during a later poll like any other load, so a cached
+			//   body never calls back from inside load(), and it can be
+			//   cancelled until then.  Dispatched to the CPU pool only to get
+			//   an id and a trip through the outbox.
+			class CachedLoad : public iothread::WorkerRequest {
 			public:
-				UriRequest(bool asText, const std::string& uri, PersistentHandleWrapper<Function> callback)
-					: iothread::UriRequest(uri), _isDispatched(false), _asText(asText), _callback(callback) {
+				CachedLoad(bool asText, std::shared_ptr<uvpp::Blob> body, PersistentHandleWrapper<Function> callback)
+					: _waiter(asText, callback), _body(body) {
 				}
 
 			private:
-				void _invokeCallback(uint32_t error, const char *data, size_t len) {
-					if (_isDispatched) {
+				void execute() override {
+					iothread::complete(this);
+				}
+
+				void onComplete() override {
+					if (!cancelled()) {
+						_callWaiter(_waiter, 0, _body);
+					}
+					delete this;
+				}
+
+				_Waiter _waiter;
+				std::shared_ptr<uvpp::Blob> _body;
+
+			};
+
+			// The body arrives in a buffer from the engine's allocator and is
+			//   handed to JS as an external ArrayBuffer without copying.
+			//   Plain loads report to _inFlight[uri]; uploads have their own
+			//   callback.
+			class UriRequest : public iothread::BlobRequest {
+			public:
+				UriRequest(const std::string& uri)
+					: iothread::BlobRequest(uri), _loadKey(uri) {
+				}
+
+				UriRequest(const std::string& method, const std::string& uri, const http::Headers& headers,
+					std::shared_ptr<http::BodySource> body, PersistentHandleWrapper<Function> callback)
+					: iothread::BlobRequest(uri, method, headers, body), _callback(callback) {
+				}
+
+			private:
+				void onComplete() override {
+					printf("io::UriRequest::onComplete()\n");
+					if (!cancelled()) {
+						if (!_loadKey.empty()) {
+							_finishLoad(_loadKey, id(), _errorCode, _body, _lifetimeMs());
+						} else {
+							_Waiter waiter(false, _callback);
+							_callWaiter(waiter, _errorCode, _body);
+						}
+					}
+					_body = nullptr;
+					delete this;
+				}
+
+				uint64_t _lifetimeMs() const {
+					int64_t lifetime = http::freshnessLifetime(_response);
+					if (lifetime < 0) {
+						return _BodyCache::kDefaultLifetimeMs;
+					}
+					return (uint64_t)lifetime * 1000;
+				}
+
+				std::string _loadKey;
+				PersistentHandleWrapper<Function> _callback;
+
+			};
+
+			class FileRequest : public iothread::FileRequest {
+			public:
+				FileRequest(const std::string& uri, const std::string& path)
+					: iothread::FileRequest(path), _loadKey(uri) {
+				}
+
+			private:
+				void onComplete() override {
+					printf("io::FileRequest::onComplete()\n");
+					if (!cancelled()) {
+						_finishLoad(_loadKey, id(), _errorCode, _body, _BodyCache::kDefaultLifetimeMs);
+					}
+					_body = nullptr;
+					delete this;
+				}
+
+				std::string _loadKey;
+
+			};
+
+			// Bytes [offset, offset + length) of a resource.  A server that
+			//   ignores Range sends the whole body, which is cut down here
+			//   without copying.  A 206 must start at offset and hold what its
+			//   Content-Range says, ending early only at the end of the
+			//   resource; anything else fails with UV_EPROTO.
+			class RangeRequest : public iothread::BlobRequest {
+			public:
+				RangeRequest(const std::string& uri, uint64_t offset, uint64_t length, PersistentHandleWrapper<Function> callback)
+					: iothread::BlobRequest(uri, "GET", _rangeHeaders(offset, length)), _offset(offset), _length(length), _callback(callback) {
+				}
+
+			private:
+				static http::Headers _rangeHeaders(uint64_t offset, uint64_t length) {
+					char range[64];
+					snprintf(range, sizeof(range), "bytes=%llu-%llu", (unsigned long long)offset, (unsigned long long)(offset + length - 1));
+					http::Headers headers;
+					headers.emplace_back("Range", range);
+					headers.emplace_back("Accept-Encoding", "identity");
+					return headers;
+				}
+
+				void processResponse() override {
+					iothread::BlobRequest::processResponse();
+					if (_errorCode != 0 || !_body) {
+						return;
+					}
+					if (_response.statusCode == 200) {
+						_body = std::make_shared<uvpp::SliceBlob>(_body, (size_t)_offset, (size_t)_length);
+					} else if (_response.statusCode == 206 && !_matchesRange()) {
+						_errorCode = UV_EPROTO;
+						_body = nullptr;
+					}
+				}
+
+				bool _matchesRange() const {
+					http::StringRef range = _response.header("Content-Range");
+					int64_t first, last, total;
+					if (!range.valid() || !http::parseContentRange(range, first, last, total)) {
+						return false;
+					}
+					uint64_t end = _offset + _length - 1;
+					bool shortAtEnd = total >= 0 && (uint64_t)last == (uint64_t)total - 1;
+					return (uint64_t)first == _offset && ((uint64_t)last == end || ((uint64_t)last < end && shortAtEnd)) &&
+						_body->size() == (size_t)(last - first + 1);
+				}
+
+				void onComplete() override {
+					printf("io::RangeRequest::onComplete()\n");
+					if (!cancelled()) {
+						_Waiter waiter(false, _callback);
+						_callWaiter(waiter, _errorCode, _body);
+					}
+					_body = nullptr;
+					delete this;
+				}
+
+				uint64_t _offset;
+				uint64_t _length;
+				PersistentHandleWrapper<Function> _callback;
+
+			};
+
+			// Local files are read, or mapped, whole and sliced.
+			class FileRangeRequest : public iothread::FileRequest {
+			public:
+				FileRangeRequest(const std::string& path, uint64_t offset, uint64_t length, PersistentHandleWrapper<Function> callback)
+					: iothread::FileRequest(path), _offset(offset), _length(length), _callback(callback) {
+				}
+
+			private:
+				void processResponse() override {
+					_body = std::make_shared<uvpp::SliceBlob>(_body, (size_t)_offset, (size_t)_length);
+				}
+
+				void onComplete() override {
+					printf("io::FileRangeRequest::onComplete()\n");
+					if (!cancelled()) {
+						_Waiter waiter(false, _callback);
+						_callWaiter(waiter, _errorCode, _body);
+					}
+					_body = nullptr;
+					delete this;
+				}
+
+				uint64_t _offset;
+				uint64_t _length;
+				PersistentHandleWrapper<Function> _callback;
+
+			};
+
+			// onChunk(data, offset, length) runs during poll as body bytes
+			//   arrive; offset is the chunk's position in the body.  With a
+			//   destination buffer the bytes are copied into it at offset and
+			//   data is that buffer, otherwise data is a new ArrayBuffer
+			//   holding just the chunk.  callback(err, status, length) fires
+			//   once the body is done.
+			class StreamRequest : public iothread::StreamRequest {
+			public:
+				StreamRequest(const std::string& uri, PersistentHandleWrapper<Function> onChunk, PersistentHandleWrapper<Function> callback, PersistentHandleWrapper<ArrayBuffer> buffer)
+					: iothread::StreamRequest(uri), _onChunk(onChunk), _callback(callback), _buffer(buffer),
+					_statusCode(0), _length(0), _overflow(false) {
+				}
+
+			private:
+				void _deliver() {
+					size_t offset;
+					if (!takeChunk(_chunk, offset, _statusCode)) {
 						return;
 					}
-					_isDispatched = true;
+					size_t len = _chunk.size();
+					_length = offset + len;
 
 					HandleScope handleScope(gIsolate);
-					Handle<Function> callback = _callback.Extract();
-					Handle<Value> args[2];
-					if (error == 0) {
-						args[0] = NavNull();
-						if (_asText) {
-							args[1] = NavNew(data, len);
+					Handle<Value> args[3];
+					if (!_buffer.IsEmpty()) {
+						Handle<ArrayBuffer> buf = _buffer.Extract();
+						if (_overflow || offset + len > buf->ByteLength()) {
+							_overflow = true;
+							return;
+						}
+						memcpy((uint8_t*)buf->BaseAddress() + offset, &_chunk[0], len);
+						args[0] = buf;
+					} else {
+						auto blob = std::make_shared<uvpp::HeapBlob>();
+						blob->storage().swap(_chunk);
+						args[0] = _newBlobBuffer(blob);
+					}
+					args[1] = NavNew<Number>((double)offset);
+					args[2] = NavNew<Number>((double)len);
+					_onChunk.Extract()->Call(NavGlobal(), 3, args);
+				}
+
+				void onProgress() override {
+					_deliver();
+				}
+
+				void onComplete() override {
+					printf("io::StreamRequest::onComplete()\n");
+					if (!cancelled()) {
+						_deliver();
+						HandleScope handleScope(gIsolate);
+						Handle<Function> callback = _callback.Extract();
+						Handle<Value> args[3];
+						int32_t error = _errorCode != 0 ? _errorCode : _overflow ? UV_ENOBUFS : 0;
+						if (error == 0) {
+							args[0] = NavNull();
+							args[1] = NavNew<Integer>(_statusCode != 0 ? _statusCode : _response.statusCode);
+							args[2] = NavNew<Number>((double)_length);
+						} else {
+							args[0] = NavNew<Integer>(error);
+							args[1] = NavNull();
+							args[2] = NavNull();
+						}
+						callback->Call(NavGlobal(), 3, args);
+					}
+					delete this;
+				}
+
+				PersistentHandleWrapper<Function> _onChunk;
+				PersistentHandleWrapper<Function> _callback;
+				PersistentHandleWrapper<ArrayBuffer> _buffer;
+				std::vector<uint8_t> _chunk;
+				uint32_t _statusCode;
+				size_t _length;
+				bool _overflow;
+
+			};
+
+			class WebSocketRequest;
+			// Open connections by id, for send().
+			std::unordered_map<uint32_t, WebSocketRequest*> _sockets;
+
+			// onMessage(data, binary) runs during poll for each message, in
+			//   order; data is an ArrayBuffer over the received bytes for
+			//   binary messages and a string for text.  onClose(err, code)
+			//   runs once when the connection is gone, code being the
+			//   server's close status.  Neither runs after cancel().
+			class WebSocketRequest : public iothread::WebSocketRequest {
+			public:
+				WebSocketRequest(const std::string& uri, PersistentHandleWrapper<Function> onMessage, PersistentHandleWrapper<Function> onClose)
+					: iothread::WebSocketRequest(uri), _onMessage(onMessage), _onClose(onClose) {
+				}
+
+			private:
+				// A callback may cancel the connection part way through.
+				void _deliver() {
+					if (!takeMessages(_messages)) {
+						return;
+					}
+					HandleScope handleScope(gIsolate);
+					Handle<Function> onMessage = _onMessage.Extract();
+					for (auto& i : _messages) {
+						if (_sockets.find(id()) == _sockets.end()) {
+							break;
+						}
+						Handle<Value> args[2];
+						if (i.binary) {
+							args[0] = _newBlobBuffer(i.data);
 						} else {
-							auto buf = NavNew<ArrayBuffer>(len);
-							memcpy(buf->BaseAddress(), data, len);
-							args[1] = buf;
+							args[0] = NavNew((const char*)i.data->data(), i.data->size());
+						}
+						args[1] = NavNew<Boolean>(i.binary);
+						onMessage->Call(NavGlobal(), 2, args);
+					}
+					_messages.clear();
+				}
+
+				void onProgress() override {
+					_deliver();
+				}
+
+				void onComplete() override {
+					if (!cancelled()) {
+						_deliver();
+						if (!_onClose.IsEmpty()) {
+							HandleScope handleScope(gIsolate);
+							Handle<Value> args[2];
+							if (_errorCode != 0) {
+								args[0] = NavNew<Integer>(_errorCode);
+							} else {
+								args[0] = NavNull();
+							}
+							args[1] = NavNew<Integer>(_closeCode);
+							_onClose.Extract()->Call(NavGlobal(), 2, args);
 						}
+					}
+					_sockets.erase(id());
+					delete this;
+				}
+
+				PersistentHandleWrapper<Function> _onMessage;
+				PersistentHandleWrapper<Function> _onClose;
+				std::vector<Message> _messages;
+
+			};
+
+			// file:// URIs and anything without a scheme are served from disk.
+			bool _localPath(const std::string& uri, std::string& path) {
+				std::string raw;
+				if (uri.compare(0, 7, "file://") == 0) {
+					raw = uri.substr(7);
+#ifdef _WIN32
+					// file:///C:/foo -> C:/foo
+					if (raw.size() >= 3 && raw[0] == '/' && raw[2] == ':') {
+						raw.erase(0, 1);
+					}
+#endif
+				} else if (uri.find("://") == std::string::npos) {
+					raw = uri;
+				} else {
+					return false;
+				}
+
+				path.clear();
+				for (size_t i = 0; i < raw.size(); ++i) {
+					if (raw[i] == '%' && i + 2 < raw.size() && isxdigit(raw[i + 1]) && isxdigit(raw[i + 2])) {
+						path += (char)strtol(raw.substr(i + 1, 2).c_str(), nullptr, 16);
+						i += 2;
 					} else {
-						args[0] = NavNew<Integer>(error);
+						path += raw[i];
+					}
+				}
+				return true;
+			}
+
+			// Fetches an FGEO container and decodes it on the IO thread.  The
+			//   decoded streams are moved straight into native attribute
+			//   storage, so vertex data never passes through the V8 heap.
+			class GeometryRequest : public iothread::UriRequest {
+			public:
+				GeometryRequest(const std::string& uri, PersistentHandleWrapper<Function> callback)
+					: iothread::UriRequest(uri), _decoded(false), _callback(callback) {
+				}
+
+			private:
+				static gfx::BufferType _bufferType(geocodec::ComponentType type) {
+					switch (type) {
+					case geocodec::ComponentType::Byte: return gfx::BufferType::Byte;
+					case geocodec::ComponentType::UnsignedByte: return gfx::BufferType::UnsignedByte;
+					case geocodec::ComponentType::Short: return gfx::BufferType::Short;
+					case geocodec::ComponentType::UnsignedShort: return gfx::BufferType::UnsignedShort;
+					case geocodec::ComponentType::Int: return gfx::BufferType::Int;
+					case geocodec::ComponentType::UnsignedInt: return gfx::BufferType::UnsignedInt;
+					default: return gfx::BufferType::Float;
+					}
+				}
+
+				bool processOnCpuPool() const override {
+					return true;
+				}
+
+				void processResponse() override {
+					if (!_response.body.empty()) {
+						_decoded = geocodec::decode(&_response.body[0], _response.body.size(), _geometry);
+					}
+					std::vector<uint8_t>().swap(_response.body);
+				}
+
+				Handle<Object> _newAttribute(std::vector<uint8_t>& data, int32_t itemSize, gfx::BufferType type) {
+					Handle<Object> attribObj = NavNew<BufferAttribute>();
+					BufferAttribute *attrib = NavUnwrap<BufferAttribute>(attribObj);
+					attrib->data()->setData(data);
+					attrib->data()->_itemSize = itemSize;
+					attrib->data()->_itemType = type;
+					attrib->data()->_needsUpdate = true;
+					attribObj->Set(NavNew("itemSize"), NavNew(itemSize));
+					return attribObj;
+				}
+
+				void onComplete() override {
+					printf("io::GeometryRequest::onComplete()\n");
+					if (cancelled()) {
+						delete this;
+						return;
+					}
+					HandleScope handleScope(gIsolate);
+					Handle<Function> callback = _callback.Extract();
+					Handle<Value> args[2];
+					if (_errorCode != 0 || !_decoded) {
+						args[0] = NavNew<Integer>(_errorCode != 0 ? _errorCode : UV_EINVAL);
 						args[1] = NavNull();
+					} else {
+						Handle<Object> geomObj = NavNew<BufferGeometry>();
+						BufferGeometry *geom = NavUnwrap<BufferGeometry>(geomObj);
+						for (auto& i : _geometry.attributes) {
+							geom->attach(i.name, _newAttribute(i.data, i.itemSize, _bufferType(i.type)));
+						}
+						if (!_geometry.indices.empty()) {
+							std::vector<uint8_t> indexData;
+							gfx::BufferType indexType;
+							if (_geometry.vertexCount <= 0x10000) {
+								indexType = gfx::BufferType::UnsignedShort;
+								indexData.resize(_geometry.indices.size() * sizeof(uint16_t));
+								uint16_t *out = (uint16_t*)&indexData[0];
+								for (size_t i = 0; i < _geometry.indices.size(); ++i) {
+									out[i] = (uint16_t)_geometry.indices[i];
+								}
+							} else {
+								indexType = gfx::BufferType::UnsignedInt;
+								indexData.resize(_geometry.indices.size() * sizeof(uint32_t));
+								memcpy(&indexData[0], &_geometry.indices[0], indexData.size());
+							}
+							geom->attach("index", _newAttribute(indexData, 1, indexType));
+						}
+						args[0] = NavNull();
+						args[1] = geomObj;
 					}
 					callback->Call(NavGlobal(), 2, args);
+					delete this;
 				}
-				void onComplete() override {
-					printf("io::UriRequest::onComplete()\n");
-					if (_errorCode == 0) {
-						_invokeCallback(0, (const char*)&_response.body[0], _response.body.size());
+
+				bool _decoded;
+				geocodec::Geometry _geometry;
+				PersistentHandleWrapper<Function> _callback;
+
+			};
+
+			// Loads a .glb scene.  JSON parsing and accessor validation happen on
+			//   the IO thread; attributes end up as views into the shared BIN
+			//   chunk rather than copies.
+			class GLTFRequest : public iothread::UriRequest {
+			public:
+				GLTFRequest(const std::string& uri, PersistentHandleWrapper<Function> callback, PersistentHandleWrapper<Object> material)
+					: iothread::UriRequest(uri), _parsed(false), _callback(callback), _material(material) {
+				}
+
+			private:
+				bool processOnCpuPool() const override {
+					return true;
+				}
+
+				void processResponse() override {
+					auto storage = std::make_shared<std::vector<uint8_t>>();
+					storage->swap(_response.body);
+					_parsed = gltf::parseGlb(storage, _scene);
+				}
+
+				Handle<Object> _buildGeometry(const gltf::Primitive& primitive) {
+					Handle<Object> geomObj = NavNew<BufferGeometry>();
+					BufferGeometry *geom = NavUnwrap<BufferGeometry>(geomObj);
+					std::vector<const gltf::AttributeView*> views;
+					for (auto& i : primitive.attributes) {
+						views.push_back(&i);
+					}
+					if (primitive.indexed) {
+						views.push_back(&primitive.indices);
+					}
+					for (auto view : views) {
+						Handle<Object> attribObj = NavNew<BufferAttribute>();
+						gfx::BufferAttribute *attrib = NavUnwrap<BufferAttribute>(attribObj)->data();
+						attrib->_itemSize = view->itemSize;
+						attrib->_itemType = (gfx::BufferType)view->componentType;
+						attrib->_normalized = view->normalized;
+						attrib->setView(_scene.storage, view->offset, view->length, view->stride);
+						attrib->_needsUpdate = true;
+						attribObj->Set(NavNew("itemSize"), NavNew(view->itemSize));
+						geom->attach(view->name, attribObj);
+					}
+					return geomObj;
+				}
+
+				Handle<Object> _buildNode(int32_t index, std::vector<bool>& visited) {
+					const gltf::Node& node = _scene.nodes[index];
+					visited[index] = true;
+
+					ShaderMaterial *material = nullptr;
+					if (!_material.IsEmpty()) {
+						material = NavUnwrap<ShaderMaterial>(_material.Extract());
+					}
+
+					Handle<Object> nodeObj;
+					Handle<Array> childArr = NavNew<Array>();
+					const gltf::Mesh *mesh = node.mesh >= 0 ? &_scene.meshes[node.mesh] : nullptr;
+					if (mesh && mesh->primitives.size() == 1) {
+						nodeObj = NavNew<Mesh>();
+						Mesh *meshWrap = NavUnwrap<Mesh>(nodeObj);
+						Handle<Object> geomObj = _geometryFor(node.mesh, 0);
+						meshWrap->data()->setGeometry(NavUnwrap<BufferGeometry>(geomObj)->data());
+						if (material) {
+							meshWrap->data()->setMaterial(material->data());
+						}
+						NavSetObjVal(nodeObj, "geometry", geomObj);
 					} else {
-						_invokeCallback(_errorCode, nullptr, 0);
+						nodeObj = NavNew<Object3d>();
+						if (mesh) {
+							// One child mesh per primitive, each with its own geometry.
+							for (size_t p = 0; p < mesh->primitives.size(); ++p) {
+								Handle<Object> childObj = NavNew<Mesh>();
+								Mesh *meshWrap = NavUnwrap<Mesh>(childObj);
+								Handle<Object> geomObj = _geometryFor(node.mesh, p);
+								meshWrap->data()->setGeometry(NavUnwrap<BufferGeometry>(geomObj)->data());
+								if (material) {
+									meshWrap->data()->setMaterial(material->data());
+								}
+								NavSetObjVal(childObj, "geometry", geomObj);
+								NavUnwrap<Object3d>(nodeObj)->data()->addChild(meshWrap->data());
+								childArr->Set(childArr->Length(), childObj);
+							}
+						}
 					}
+					NavSetObjVal(nodeObj, "name", NavNew(node.name.c_str()));
+
+					gfx::Object3d *obj = NavUnwrap<Object3d>(nodeObj)->data();
+					obj->_position = math::Vector3(node.translation[0], node.translation[1], node.translation[2]);
+					obj->_rotation = math::Quaternion(node.rotation[3], node.rotation[0], node.rotation[1], node.rotation[2]);
+					obj->_scale = math::Vector3(node.scale[0], node.scale[1], node.scale[2]);
+					obj->_transformNeedsUpdate = true;
+
+					for (auto& c : node.children) {
+						if (visited[c]) {
+							continue;
+						}
+						Handle<Object> childObj = _buildNode(c, visited);
+						obj->addChild(NavUnwrap<Object3d>(childObj)->data());
+						childArr->Set(childArr->Length(), childObj);
+					}
+					NavSetObjVal(nodeObj, "children", childArr);
+					return nodeObj;
 				}
 
-				void onError(int32_t code) {
-					_invokeCallback(code, nullptr, 0);
+				// glTF meshes can be instanced by several nodes; share the geometry.
+				Handle<Object> _geometryFor(int32_t mesh, size_t primitive) {
+					auto key = std::make_pair(mesh, primitive);
+					auto foundI = _geometries.find(key);
+					if (foundI != _geometries.end()) {
+						return foundI->second;
+					}
+					Handle<Object> geomObj = _buildGeometry(_scene.meshes[mesh].primitives[primitive]);
+					_geometries.emplace(key, geomObj);
+					return geomObj;
+				}
+
+				void onComplete() override {
+					printf("io::GLTFRequest::onComplete()\n");
+					if (cancelled()) {
+						delete this;
+						return;
+					}
+					HandleScope handleScope(gIsolate);
+					Handle<Function> callback = _callback.Extract();
+					Handle<Value> args[2];
+					if (_errorCode != 0 || !_parsed) {
+						args[0] = NavNew<Integer>(_errorCode != 0 ? _errorCode : UV_EINVAL);
+						args[1] = NavNull();
+					} else {
+						Handle<Object> rootObj = NavNew<Object3d>();
+						gfx::Object3d *root = NavUnwrap<Object3d>(rootObj)->data();
+						Handle<Array> childArr = NavNew<Array>();
+						std::vector<bool> visited(_scene.nodes.size(), false);
+						for (auto& r : _scene.roots) {
+							if (visited[r]) {
+								continue;
+							}
+							Handle<Object> nodeObj = _buildNode(r, visited);
+							root->addChild(NavUnwrap<Object3d>(nodeObj)->data());
+							childArr->Set(childArr->Length(), nodeObj);
+						}
+						NavSetObjVal(rootObj, "children", childArr);
+						_geometries.clear();
+						args[0] = NavNull();
+						args[1] = rootObj;
+					}
+					callback->Call(NavGlobal(), 2, args);
+					delete this;
 				}
 
-				bool _isDispatched;
-				bool _asText;
+				bool _parsed;
+				gltf::Scene _scene;
+				std::map<std::pair<int32_t, size_t>, Handle<Object>> _geometries;
 				PersistentHandleWrapper<Function> _callback;
+				PersistentHandleWrapper<Object> _material;
 
 			};
 
+			// Optional trailing priority argument; anything unrecognised
+			//   loads as Visible.
+			iothread::Priority _priorityArg(const v8::FunctionCallbackInfo<v8::Value>& args, int index) {
+				if (args.Length() > index && args[index]->IsUint32()) {
+					uint32_t priority = args[index]->Uint32Value();
+					if (priority < (uint32_t)iothread::Priority::Count) {
+						return (iothread::Priority)priority;
+					}
+				}
+				return iothread::Priority::Visible;
+			}
+
+			// Optional timeout in ms, following the priority argument.  A
+			//   load still unfinished by then fails with UV_ETIMEDOUT.
+			uint64_t _timeoutArg(const v8::FunctionCallbackInfo<v8::Value>& args, int index) {
+				if (args.Length() > index && args[index]->IsNumber()) {
+					double timeoutMs = args[index]->NumberValue();
+					if (timeoutMs > 0) {
+						return (uint64_t)timeoutMs;
+					}
+				}
+				return 0;
+			}
+
+			void loadGLTF(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 2) {
+					return;
+				}
+
+				String::Utf8Value uriStr(args[0]);
+				PersistentHandleWrapper<Function> callback(gIsolate, args[1].As<Function>());
+				PersistentHandleWrapper<Object> material;
+				if (args.Length() >= 3 && args[2]->IsObject()) {
+					material = PersistentHandleWrapper<Object>(gIsolate, args[2].As<Object>());
+				}
+
+				auto req = new GLTFRequest(*uriStr, callback, material);
+				req->setTimeout(_timeoutArg(args, 4));
+				uint32_t id = iothread::dispatch(req, _priorityArg(args, 3));
+				args.GetReturnValue().Set(id);
+			}
+
+			void loadGeometry(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 2) {
+					return;
+				}
+
+				String::Utf8Value uriStr(args[0]);
+				PersistentHandleWrapper<Function> callback(gIsolate, args[1].As<Function>());
+
+				auto req = new GeometryRequest(*uriStr, callback);
+				req->setTimeout(_timeoutArg(args, 3));
+				uint32_t id = iothread::dispatch(req, _priorityArg(args, 2));
+				args.GetReturnValue().Set(id);
+			}
+
+			// Returns the caller's ticket for cancel() and setPriority(), or
+			//   the id of the delivery if the body was cached.  fetchId, when
+			//   given, gets the id of the shared fetch, 0 if there is none.
+			uint32_t _startLoad(bool asText, const std::string& uri, PersistentHandleWrapper<Function> callback,
+				iothread::Priority priority, float rank, uint64_t timeoutMs, uint32_t *fetchId = nullptr) {
+				if (fetchId) {
+					*fetchId = 0;
+				}
+				std::shared_ptr<uvpp::Blob> cached = _bodyCache.find(uri);
+				if (cached) {
+					auto req = new CachedLoad(asText, cached, callback);
+					iothread::dispatchCpu(req);
+					return req->id();
+				}
+
+				uint32_t ticket = iothread::reserveId();
+				_tickets[ticket] = uri;
+
+				// Joining a fetch already under way; a more urgent caller
+				//   raises its priority for everyone.  The first caller's
+				//   timeout stands.
+				auto found = _inFlight.find(uri);
+				if (found != _inFlight.end()) {
+					_InFlight& inFlight = found->second;
+					inFlight.waiters.emplace_back(asText, callback, ticket);
+					if (priority < inFlight.priority) {
+						inFlight.priority = priority;
+						iothread::setPriority(inFlight.id, priority, rank);
+					}
+					if (fetchId) {
+						*fetchId = inFlight.id;
+					}
+					return ticket;
+				}
+
+				std::string path;
+				iothread::WorkerRequest *req;
+				if (_localPath(uri, path)) {
+					req = new FileRequest(uri, path);
+				} else {
+					req = new UriRequest(uri);
+				}
+				req->setTimeout(timeoutMs);
+				req->setRank(rank);
+				uint32_t id = iothread::dispatch(req, priority);
+				_InFlight& inFlight = _inFlight[uri];
+				inFlight.id = id;
+				inFlight.priority = priority;
+				inFlight.waiters.emplace_back(asText, callback, ticket);
+				if (fetchId) {
+					*fetchId = id;
+				}
+				return ticket;
+			}
+
 			void _load(bool asText, const v8::FunctionCallbackInfo<v8::Value>& args) {
 				if (args.Length() < 2) {
 					return;
@@ -526,27 +1635,402 @@ namespace js {
 
 				String::Utf8Value hostStr(args[0]);
 				PersistentHandleWrapper<Function> callback(gIsolate, args[1].As<Function>());
-
-				auto req = new UriRequest(asText, *hostStr, callback);
-				iothread::dispatch(req);
+				uint32_t id = _startLoad(asText, *hostStr, callback, _priorityArg(args, 2), 0.0f, _timeoutArg(args, 3));
+				args.GetReturnValue().Set(id);
 			}
 			
 			void load(const v8::FunctionCallbackInfo<v8::Value>& args) {
 				return _load(false, args);
 			}
 
+			// loadRange(uri, offset, length, callback[, priority][, timeoutMs])
+			void loadRange(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 4 || !args[1]->IsNumber() || !args[2]->IsNumber()) {
+					return;
+				}
+				double offset = args[1]->NumberValue();
+				double length = args[2]->NumberValue();
+				if (offset < 0 || length < 1 || offset + length > (double)SIZE_MAX) {
+					return;
+				}
+
+				String::Utf8Value uriStr(args[0]);
+				PersistentHandleWrapper<Function> callback(gIsolate, args[3].As<Function>());
+				std::string uri(*uriStr);
+				std::string path;
+				iothread::WorkerRequest *req;
+				if (_localPath(uri, path)) {
+					req = new FileRangeRequest(path, (uint64_t)offset, (uint64_t)length, callback);
+				} else {
+					req = new RangeRequest(uri, (uint64_t)offset, (uint64_t)length, callback);
+				}
+				req->setTimeout(_timeoutArg(args, 5));
+				uint32_t id = iothread::dispatch(req, _priorityArg(args, 4));
+				args.GetReturnValue().Set(id);
+			}
+
+			// (uri, data, callback[, contentType][, priority][, timeoutMs]).  data is a
+			//   string, ArrayBuffer or view; it is copied once so JS can keep
+			//   using it, and the IO thread writes that copy to the socket
+			//   directly.
+			void _upload(const char *method, const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 3) {
+					return;
+				}
+
+				String::Utf8Value uriStr(args[0]);
+				PersistentHandleWrapper<Function> callback(gIsolate, args[2].As<Function>());
+
+				auto blob = std::make_shared<uvpp::BufferBlob>();
+				bool copied;
+				if (args[1]->IsArrayBuffer()) {
+					Handle<ArrayBuffer> buf = args[1].As<ArrayBuffer>();
+					copied = blob->append(buf->BaseAddress(), buf->ByteLength());
+				} else if (args[1]->IsArrayBufferView()) {
+					Handle<ArrayBufferView> view = args[1].As<ArrayBufferView>();
+					copied = blob->append((uint8_t*)view->Buffer()->BaseAddress() + view->ByteOffset(), view->ByteLength());
+				} else {
+					String::Utf8Value dataStr(args[1]);
+					copied = blob->append(*dataStr, dataStr.length());
+				}
+				if (!copied) {
+					return;
+				}
+
+				http::Headers headers;
+				int priorityIndex = 3;
+				if (args.Length() >= 4 && args[3]->IsString()) {
+					String::Utf8Value typeStr(args[3]);
+					headers.emplace_back("Content-Type", *typeStr);
+					priorityIndex = 4;
+				}
+
+				auto body = std::make_shared<http::BlobBody>(blob);
+				auto req = new UriRequest(method, *uriStr, headers, body, callback);
+				req->setTimeout(_timeoutArg(args, priorityIndex + 1));
+				uint32_t id = iothread::dispatch(req, _priorityArg(args, priorityIndex));
+				args.GetReturnValue().Set(id);
+			}
+
+			void post(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				return _upload("POST", args);
+			}
+
+			void put(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				return _upload("PUT", args);
+			}
+
+			// loadStream(uri, onChunk, callback[, buffer][, priority][, timeoutMs])
+			void loadStream(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 3) {
+					return;
+				}
+
+				String::Utf8Value uriStr(args[0]);
+				PersistentHandleWrapper<Function> onChunk(gIsolate, args[1].As<Function>());
+				PersistentHandleWrapper<Function> callback(gIsolate, args[2].As<Function>());
+				PersistentHandleWrapper<ArrayBuffer> buffer;
+				int priorityIndex = 3;
+				if (args.Length() >= 4 && args[3]->IsArrayBuffer()) {
+					buffer = PersistentHandleWrapper<ArrayBuffer>(gIsolate, args[3].As<ArrayBuffer>());
+					priorityIndex = 4;
+				}
+
+				auto req = new StreamRequest(*uriStr, onChunk, callback, buffer);
+				req->setTimeout(_timeoutArg(args, priorityIndex + 1));
+				uint32_t id = iothread::dispatch(req, _priorityArg(args, priorityIndex));
+				args.GetReturnValue().Set(id);
+			}
+
+			// connect(uri, onMessage[, onClose]) opens a ws:// connection and
+			//   returns its id for send() and cancel().
+			void connect(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 2) {
+					return;
+				}
+
+				String::Utf8Value uriStr(args[0]);
+				PersistentHandleWrapper<Function> onMessage(gIsolate, args[1].As<Function>());
+				PersistentHandleWrapper<Function> onClose;
+				if (args.Length() >= 3 && args[2]->IsFunction()) {
+					onClose = PersistentHandleWrapper<Function>(gIsolate, args[2].As<Function>());
+				}
+
+				auto req = new WebSocketRequest(*uriStr, onMessage, onClose);
+				uint32_t id = iothread::dispatch(req, iothread::Priority::Critical);
+				_sockets[id] = req;
+				args.GetReturnValue().Set(id);
+			}
+
+			// send(id, data): an ArrayBuffer or view goes as a binary message,
+			//   anything else as text.  Messages sent before the connection
+			//   opens are held until it does.  Returns false once the
+			//   connection has closed.
+			void send(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 2 || !args[0]->IsUint32()) {
+					return;
+				}
+				auto found = _sockets.find(args[0]->Uint32Value());
+				if (found == _sockets.end()) {
+					return args.GetReturnValue().Set(false);
+				}
+
+				if (args[1]->IsArrayBuffer()) {
+					Handle<ArrayBuffer> buf = args[1].As<ArrayBuffer>();
+					found->second->send((const uint8_t*)buf->BaseAddress(), buf->ByteLength(), true);
+				} else if (args[1]->IsArrayBufferView()) {
+					Handle<ArrayBufferView> view = args[1].As<ArrayBufferView>();
+					found->second->send((const uint8_t*)view->Buffer()->BaseAddress() + view->ByteOffset(), view->ByteLength(), true);
+				} else {
+					String::Utf8Value dataStr(args[1]);
+					found->second->send((const uint8_t*)*dataStr, dataStr.length(), false);
+				}
+				args.GetReturnValue().Set(true);
+			}
+
 			void loadString(const v8::FunctionCallbackInfo<v8::Value>& args) {
 				return _load(true, args);
 			}
 
+			// stream(uri, center, radius, callback[, timeoutMs]): load() for an
+			//   asset with a world-space bounding sphere.  It starts once it
+			//   is big enough on screen from the camera passed to
+			//   Renderer.render, and stays ordered by what that camera sees
+			//   until it arrives.  Returns a handle for unstream().
+			void stream(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 4 || !args[1]->IsObject() || !args[3]->IsFunction()) {
+					return;
+				}
+
+				String::Utf8Value uriStr(args[0]);
+				std::string uri(*uriStr);
+				math::Vector3 center = Vector3Wrap(args[1]);
+				float radius = (float)args[2]->NumberValue();
+				PersistentHandleWrapper<Function> callback(gIsolate, args[3].As<Function>());
+				uint64_t timeoutMs = _timeoutArg(args, 4);
+				uint32_t handle = streaming::manager().add(center, radius, [uri, callback, timeoutMs](iothread::Priority priority, float rank) -> uint32_t {
+					uint32_t fetchId;
+					_startLoad(false, uri, callback, priority, rank, timeoutMs, &fetchId);
+					return fetchId;
+				});
+				args.GetReturnValue().Set(handle);
+			}
+
+			// unstream(handle): forgets a streamed asset.  One not started
+			//   yet never calls back; one already loading finishes as usual.
+			void unstream(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 1) {
+					return;
+				}
+				streaming::manager().remove(args[0]->Uint32Value());
+			}
+
+			// setStreamMinSize(size): apparent radius, as a fraction of half
+			//   the viewport height, below which streamed loads wait.
+			void setStreamMinSize(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 1 || !args[0]->IsNumber()) {
+					return;
+				}
+				streaming::manager().setMinScreenSize((float)args[0]->NumberValue());
+			}
+
+			// setPriority(id, priority): reorders a load that hasn't started.
+			void setPriority(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 2 || !args[0]->IsUint32() || !args[1]->IsUint32()) {
+					return;
+				}
+				uint32_t priority = args[1]->Uint32Value();
+				if (priority >= (uint32_t)iothread::Priority::Count) {
+					return;
+				}
+				uint32_t id = args[0]->Uint32Value();
+				auto ticket = _tickets.find(id);
+				if (ticket != _tickets.end()) {
+					auto inFlight = _inFlight.find(ticket->second);
+					if (inFlight == _inFlight.end()) {
+						return;
+					}
+					id = inFlight->second.id;
+				}
+				iothread::setPriority(id, (iothread::Priority)priority);
+			}
+
+			// cancel(id): abandons a request by the id its load call returned.
+			//   Its callback never runs.  A load shared with other callers
+			//   carries on for them and stops only once the last of them
+			//   cancels.  A connection from connect() is closed.  Returns
+			//   false if it had already completed.
+			void cancel(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 1 || !args[0]->IsUint32()) {
+					return;
+				}
+				uint32_t id = args[0]->Uint32Value();
+				bool cancelled = _cancelTicket(id);
+				if (!cancelled) {
+					cancelled = iothread::cancel(id);
+					if (cancelled) {
+						_sockets.erase(id);
+					}
+				}
+				args.GetReturnValue().Set(cancelled);
+			}
+
+			// pollStats(): how the last frame's completion delivery went.
+			void pollStats(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				const iothread::PollStats& stats = iothread::pollStats();
+				Handle<Object> statsObj = NavNew<Object>();
+				NavSetObjVal(statsObj, "lastMs", Number::New(gIsolate, stats.lastPollNs / 1e6));
+				NavSetObjVal(statsObj, "maxMs", Number::New(gIsolate, stats.maxPollNs / 1e6));
+				NavSetObjVal(statsObj, "delivered", Number::New(gIsolate, stats.lastDelivered));
+				NavSetObjVal(statsObj, "backlog", Number::New(gIsolate, (double)stats.backlog));
+				NavSetObjVal(statsObj, "overBudget", Number::New(gIsolate, (double)stats.overBudget));
+				args.GetReturnValue().Set(statsObj);
+			}
+
 			void Init(Handle<Object> targetObj) {
 				Handle<Object> ioObj = NavNew<Object>();
 				NavSetObjFunc(ioObj, "load", load);
 				NavSetObjFunc(ioObj, "loadString", loadString);
+				NavSetObjFunc(ioObj, "loadStream", loadStream);
+				NavSetObjFunc(ioObj, "loadRange", loadRange);
+				NavSetObjFunc(ioObj, "stream", stream);
+				NavSetObjFunc(ioObj, "unstream", unstream);
+				NavSetObjFunc(ioObj, "setStreamMinSize", setStreamMinSize);
+				NavSetObjFunc(ioObj, "post", post);
+				NavSetObjFunc(ioObj, "put", put);
+				NavSetObjFunc(ioObj, "loadGeometry", loadGeometry);
+				NavSetObjFunc(ioObj, "loadGLTF", loadGLTF);
+				NavSetObjFunc(ioObj, "connect", connect);
+				NavSetObjFunc(ioObj, "send", send);
+				NavSetObjFunc(ioObj, "setPriority", setPriority);
+				NavSetObjFunc(ioObj, "cancel", cancel);
+				NavSetObjFunc(ioObj, "pollStats", pollStats);
+
+				Handle<Object> priorityObj = NavNew<Object>();
+				NavSetObjEnumVal(priorityObj, "Critical", iothread::Priority::Critical);
+				NavSetObjEnumVal(priorityObj, "Visible", iothread::Priority::Visible);
+				NavSetObjEnumVal(priorityObj, "Prefetch", iothread::Priority::Prefetch);
+				NavSetObjVal(ioObj, "Priority", priorityObj);
 				NavSetObjVal(targetObj, "io", ioObj);
 			}
 
 			void Shutdown() {
+				streaming::manager().clear();
+				_inFlight.clear();
+				_tickets.clear();
+				_sockets.clear();
+				_bodyCache.clear();
+			}
+		}
+
+		namespace fs {
+			// readFile calls back with (err, buffer).  readFiles calls back
+			//   with (errors, buffers), one entry per path in order; errors
+			//   is null when every file was read, and a failed file's buffer
+			//   is null.  Buffers come from io's external ArrayBuffers.
+			class ReadRequest : public iothread::FileBatchRequest {
+			public:
+				ReadRequest(const std::vector<std::string>& paths, bool single, bool sequential, PersistentHandleWrapper<Function> callback)
+					: iothread::FileBatchRequest(paths, sequential), _single(single), _callback(callback) {
+				}
+
+			private:
+				void onComplete() override {
+					if (!cancelled()) {
+						_deliver();
+					}
+					delete this;
+				}
+
+				static Handle<Value> _buffer(const Result& result) {
+					if (result.body) {
+						return io::_newBlobBuffer(result.body);
+					}
+					return NavNull();
+				}
+
+				void _deliver() {
+					HandleScope handleScope(gIsolate);
+					Handle<Value> args[2];
+					if (_single) {
+						const Result& result = _results[0];
+						if (result.errorCode != 0) {
+							args[0] = NavNew<Integer>(result.errorCode);
+						} else {
+							args[0] = NavNull();
+						}
+						args[1] = _buffer(result);
+					} else {
+						Handle<Array> errorArr = NavNew<Array>();
+						Handle<Array> bufferArr = NavNew<Array>();
+						bool failed = false;
+						for (size_t i = 0; i < _results.size(); ++i) {
+							const Result& result = _results[i];
+							failed = failed || result.errorCode != 0;
+							errorArr->Set((uint32_t)i, NavNew<Integer>(result.errorCode));
+							bufferArr->Set((uint32_t)i, _buffer(result));
+						}
+						if (failed) {
+							args[0] = errorArr;
+						} else {
+							args[0] = NavNull();
+						}
+						args[1] = bufferArr;
+					}
+					_results.clear();
+					Handle<Function> callback = _callback.Extract();
+					callback->Call(NavGlobal(), 2, args);
+				}
+
+				bool _single;
+				PersistentHandleWrapper<Function> _callback;
+
+			};
+
+			// Optional trailing sequential flag: the files are read whole,
+			//   front to back, so the OS may read ahead further.
+			bool _sequentialArg(const v8::FunctionCallbackInfo<v8::Value>& args, int index) {
+				return args.Length() > index && args[index]->BooleanValue();
+			}
+
+			// readFile(path, callback[, sequential]): reads a whole file on an
+			//   IO loop.  Returns an id for FOUR.io.cancel.
+			void readFile(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 2 || !args[1]->IsFunction()) {
+					return;
+				}
+
+				String::Utf8Value pathStr(args[0]);
+				std::vector<std::string> paths(1, *pathStr);
+				PersistentHandleWrapper<Function> callback(gIsolate, args[1].As<Function>());
+				uint32_t id = iothread::dispatch(new ReadRequest(paths, true, _sequentialArg(args, 2), callback));
+				args.GetReturnValue().Set(id);
+			}
+
+			// readFiles(paths, callback[, sequential]): reads every file in
+			//   paths, many at once, with a single callback at the end.
+			void readFiles(const v8::FunctionCallbackInfo<v8::Value>& args) {
+				if (args.Length() < 2 || !args[0]->IsArray() || !args[1]->IsFunction()) {
+					return;
+				}
+
+				Handle<Array> pathArr = args[0].As<Array>();
+				std::vector<std::string> paths;
+				paths.reserve(pathArr->Length());
+				for (uint32_t i = 0; i < pathArr->Length(); ++i) {
+					String::Utf8Value pathStr(pathArr->Get(i));
+					paths.push_back(*pathStr);
+				}
+				PersistentHandleWrapper<Function> callback(gIsolate, args[1].As<Function>());
+				uint32_t id = iothread::dispatch(new ReadRequest(paths, false, _sequentialArg(args, 2), callback));
+				args.GetReturnValue().Set(id);
+			}
+
+			void Init(Handle<Object> targetObj) {
+				Handle<Object> fsObj = NavNew<Object>();
+				NavSetObjFunc(fsObj, "readFile", readFile);
+				NavSetObjFunc(fsObj, "readFiles", readFiles);
+				NavSetObjVal(targetObj, "fs", fsObj);
 			}
 		}
 
@@ -581,6 +2065,7 @@ namespace js {
 			Local<Object> fourObj = NavNew<Object>();
 			InitConstants(fourObj);
 			io::Init(fourObj);
+			fs::Init(fourObj);
 
 			NavObjectWrap<BufferAttribute>::Init(fourObj, "BufferAttribute");
 			NavObjectWrap<BufferGeometry>::Init(fourObj, "BufferGeometry");
@@ -628,6 +2113,83 @@ namespace js {
 	}
 }
 
+// Per-frame numbers for the metrics server.  Main thread.
+namespace perf {
+	const double kFrameBoundsMs[] = { 4, 8, 12, 16.7, 20, 25, 33.3, 50, 100, 250 };
+	const size_t kFrameBounds = sizeof(kFrameBoundsMs) / sizeof(kFrameBoundsMs[0]);
+	const uint64_t kHeapSampleNs = 1000000000ULL;
+
+	metrics::Histogram frameMs(kFrameBoundsMs, kFrameBounds);
+	metrics::Histogram intervalMs(kFrameBoundsMs, kFrameBounds);
+	metrics::Counter frames;
+	metrics::Counter draws;
+	metrics::Counter programBinds;
+	metrics::Counter uniformUploads;
+	metrics::Counter attributeBinds;
+	metrics::Gauge heapUsed;
+	metrics::Gauge heapTotal;
+	metrics::Gauge heapLimit;
+	metrics::Profile profile({ "start_ms", "interval_ms", "frame_ms", "poll_ms", "script_ms", "draws", "program_binds" });
+
+	uint64_t firstStartNs = 0;
+	uint64_t lastStartNs = 0;
+	uint64_t lastHeapNs = 0;
+	gfx::Renderer::Stats lastStats;
+
+	void Init() {
+		metrics::Registry& r = metrics::registry();
+		r.add("four_frame_ms", "Time spent producing a frame", frameMs);
+		r.add("four_frame_interval_ms", "Time from one frame's start to the next", intervalMs);
+		r.add("four_frames_total", "Frames produced", frames);
+		r.add("four_draws_total", "Draw calls issued", draws);
+		r.add("four_program_binds_total", "Shader program changes", programBinds);
+		r.add("four_uniform_uploads_total", "Uniform values uploaded", uniformUploads);
+		r.add("four_attribute_binds_total", "Vertex attribute bindings", attributeBinds);
+		r.add("four_js_heap_used_bytes", "V8 heap in use", heapUsed);
+		r.add("four_js_heap_total_bytes", "V8 heap reserved", heapTotal);
+		r.add("four_js_heap_limit_bytes", "V8 heap size limit", heapLimit);
+		r.setProfile(&profile);
+	}
+
+	// The heap is sampled about once a second; the rest every frame.
+	void record(uint64_t startNs, uint64_t pollEndNs, uint64_t endNs) {
+		const gfx::Renderer::Stats& stats = gfx::Renderer::stats;
+		uint64_t frameDraws = stats.draws - lastStats.draws;
+		uint64_t frameBinds = stats.programBinds - lastStats.programBinds;
+		double intervalMsValue = lastStartNs ? (startNs - lastStartNs) / 1e6 : 0.0;
+
+		frames.add();
+		frameMs.observe((endNs - startNs) / 1e6);
+		if (lastStartNs) {
+			intervalMs.observe(intervalMsValue);
+		}
+		draws.add(frameDraws);
+		programBinds.add(frameBinds);
+		uniformUploads.add(stats.uniformUploads - lastStats.uniformUploads);
+		attributeBinds.add(stats.attributeBinds - lastStats.attributeBinds);
+		lastStats = stats;
+
+		if (startNs - lastHeapNs >= kHeapSampleNs) {
+			lastHeapNs = startNs;
+			v8::HeapStatistics heap;
+			gIsolate->GetHeapStatistics(&heap);
+			heapUsed.set((int64_t)heap.used_heap_size());
+			heapTotal.set((int64_t)heap.total_heap_size());
+			heapLimit.set((int64_t)heap.heap_size_limit());
+		}
+
+		if (!firstStartNs) {
+			firstStartNs = startNs;
+		}
+		lastStartNs = startNs;
+		double row[] = {
+			(startNs - firstStartNs) / 1e6, intervalMsValue, (endNs - startNs) / 1e6,
+			(pollEndNs - startNs) / 1e6, (endNs - pollEndNs) / 1e6, (double)frameDraws, (double)frameBinds
+		};
+		profile.record(row);
+	}
+}
+
 void runFsScript(const std::string& path) {
 	std::ifstream myReadFile;
 	myReadFile.open(path);
@@ -662,14 +2224,43 @@ public:
 	virtual void Free(void* data, size_t length) { free(data); }
 };
 
+// Routes IO buffers through V8's allocator so response bodies can become
+//   ArrayBuffers without a copy.
+class EngineBufferAllocator : public uvpp::BufferAllocator {
+public:
+	EngineBufferAllocator(v8::ArrayBuffer::Allocator *allocator)
+		: _allocator(allocator) {
+	}
+	void * allocate(size_t len) override {
+		return _allocator->AllocateUninitialized(len);
+	}
+	void release(void *data, size_t len) override {
+		_allocator->Free(data, len);
+	}
+private:
+	v8::ArrayBuffer::Allocator *_allocator;
+};
+
 bool fourSetup() {
+	v8::ArrayBuffer::Allocator *arrayBufferAllocator = new MallocArrayBufferAllocator;
+	uvpp::setBufferAllocator(new EngineBufferAllocator(arrayBufferAllocator));
 	iothread::Init();
+	// Relative to the working directory, like the scripts.
+	if (!iothread::EnableHttpCache("httpcache", 512ULL * 1024 * 1024)) {
+		printf("HTTP cache unavailable\n");
+	}
+	perf::Init();
+	// Off unless asked for, and only ever on localhost.
+	const char *metricsPort = getenv("FOUR_METRICS_PORT");
+	if (metricsPort && atoi(metricsPort) > 0 && atoi(metricsPort) < 65536) {
+		iothread::EnableMetricsServer((uint16_t)atoi(metricsPort));
+	}
 
 	// Initialize V8
 	gPlatform = v8::platform::CreateDefaultPlatform();
 	v8::V8::InitializePlatform(gPlatform);
 	v8::V8::Initialize();
-	v8::V8::SetArrayBufferAllocator(new MallocArrayBufferAllocator);
+	v8::V8::SetArrayBufferAllocator(arrayBufferAllocator);
 
 	// Create a new Isolate and make it the current one.
 	gIsolate = Isolate::New();
@@ -737,12 +2328,14 @@ void fourDestroy() {
 }
 
 void fourRender() {
+	uint64_t startNs = uv_hrtime();
 	std::vector<PersistentHandleWrapper<Function>> animCallbacks = gAnimCallbacks;
 	gAnimCallbacks.clear();
 
 	HandleScope handleScope(gIsolate);
 
 	iothread::poll();
+	uint64_t pollEndNs = uv_hrtime();
 
 	Local<Value> animCallbackArgs[] = {
 		Number::New(gIsolate, 0.0)
@@ -751,4 +2344,6 @@ void fourRender() {
 		Handle<Function> animCallback = i->Extract();
 		animCallback->Call(gIsolate->GetCurrentContext()->Global(), 1, animCallbackArgs);
 	}
-}
+
+	perf::record(startNs, pollEndNs, uv_hrtime());
+}
\ No newline at end of file
@@ -0,0 +1,188 @@
+/* Throughput of http_parser_execute on the traffic shapes the IO threads
+ * see: keep-alive tile responses with CDN headers and small bodies,
+ * header-heavy 304s from revalidation, and requests with long paths.
+ * Each stream is parsed in 64 KB reads, as the sockets deliver it, with
+ * callbacks that do nothing.
+ *
+ * Standalone; build it next to the parser with optimisations on:
+ *
+ *   cc -O2 -I. bench/http_parser_bench.c http_parser.c -o http_parser_bench
+ *   cl /O2 /I. bench\http_parser_bench.c http_parser.c
+ *
+ * Usage: http_parser_bench [megabytes per case, default 256]
+ */
+#include "http_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#define READ_SIZE (64 * 1024)
+#define STREAM_SIZE (4 * 1024 * 1024)
+
+static double
+now_seconds(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double) count.QuadPart / (double) freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static int
+on_data(http_parser *parser, const char *at, size_t length)
+{
+  (void) parser;
+  (void) at;
+  (void) length;
+  return 0;
+}
+
+static int
+on_event(http_parser *parser)
+{
+  (void) parser;
+  return 0;
+}
+
+static const char *cdn_headers =
+  "Date: Mon, 19 Oct 2026 09:12:44 GMT\r\n"
+  "Content-Type: application/octet-stream\r\n"
+  "Connection: keep-alive\r\n"
+  "Cache-Control: public, max-age=86400, stale-while-revalidate=3600\r\n"
+  "ETag: \"5f2c9a1e-3d41b7c8e2a94f0b6d15\"\r\n"
+  "Last-Modified: Fri, 16 Oct 2026 22:41:07 GMT\r\n"
+  "Accept-Ranges: bytes\r\n"
+  "Vary: Accept-Encoding, Origin\r\n"
+  "Access-Control-Allow-Origin: *\r\n"
+  "Server: cdn-edge/2.14.7\r\n"
+  "X-Cache: HIT from edge-fra-07, HIT from shield-ams-02\r\n"
+  "X-Cache-Hits: 118, 4\r\n"
+  "X-Served-By: cache-fra19147-FRA, cache-ams21034-AMS\r\n"
+  "X-Request-Id: 7b0f3c9e-61d2-4a8b-9c47-e0d5a2f81b36\r\n"
+  "Strict-Transport-Security: max-age=31536000; includeSubDomains\r\n";
+
+/* Repeats msg until the stream is full; returns the bytes used, always a
+ * whole number of messages.
+ */
+static size_t
+fill(char *buf, size_t size, const char *msg, size_t msg_len)
+{
+  size_t used = 0;
+  while (used + msg_len <= size) {
+    memcpy(buf + used, msg, msg_len);
+    used += msg_len;
+  }
+  return used;
+}
+
+static size_t
+tile_responses(char *buf, size_t size)
+{
+  char msg[4096];
+  char body[1800];
+  int len;
+  memset(body, 'x', sizeof(body));
+  len = sprintf(msg, "HTTP/1.1 200 OK\r\n%sContent-Length: %u\r\n\r\n",
+                cdn_headers, (unsigned) sizeof(body));
+  memcpy(msg + len, body, sizeof(body));
+  return fill(buf, size, msg, len + sizeof(body));
+}
+
+static size_t
+not_modified(char *buf, size_t size)
+{
+  char msg[4096];
+  int len = sprintf(msg, "HTTP/1.1 304 Not Modified\r\n%sContent-Length: 0\r\n\r\n",
+                    cdn_headers);
+  return fill(buf, size, msg, len);
+}
+
+static size_t
+long_path_requests(char *buf, size_t size)
+{
+  char msg[4096];
+  int len = sprintf(msg,
+    "GET /tiles/v3/terrain-rgb/elevation/14/8529/5974/"
+    "0d2f9e7c41b5a6830d2f9e7c41b5a683/lod-2/part-0017.bin?session=7b0f3c9e61d2 HTTP/1.1\r\n"
+    "Host: assets.example.net\r\n"
+    "User-Agent: FOUR/1.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "If-None-Match: \"5f2c9a1e-3d41b7c8e2a94f0b6d15\"\r\n"
+    "\r\n");
+  return fill(buf, size, msg, len);
+}
+
+static int
+run(const char *name, enum http_parser_type type, const char *buf, size_t len,
+    size_t total_bytes)
+{
+  http_parser_settings settings;
+  http_parser parser;
+  size_t parsed = 0;
+  double start, elapsed;
+
+  memset(&settings, 0, sizeof(settings));
+  settings.on_message_begin = on_event;
+  settings.on_url = on_data;
+  settings.on_status = on_data;
+  settings.on_header_field = on_data;
+  settings.on_header_value = on_data;
+  settings.on_headers_complete = on_event;
+  settings.on_body = on_data;
+  settings.on_message_complete = on_event;
+
+  http_parser_init(&parser, type);
+  start = now_seconds();
+  while (parsed < total_bytes) {
+    size_t pos;
+    for (pos = 0; pos < len; pos += READ_SIZE) {
+      size_t chunk = len - pos < READ_SIZE ? len - pos : READ_SIZE;
+      size_t consumed = http_parser_execute(&parser, &settings, buf + pos, chunk);
+      if (consumed != chunk) {
+        fprintf(stderr, "%s: %s at byte %u\n", name,
+                http_errno_name(HTTP_PARSER_ERRNO(&parser)), (unsigned) (pos + consumed));
+        return 1;
+      }
+    }
+    parsed += len;
+  }
+  elapsed = now_seconds() - start;
+  printf("%-24s %8.0f MB/s\n", name, parsed / elapsed / 1e6);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t total_bytes = (size_t) (argc > 1 ? atoi(argv[1]) : 256) * 1024 * 1024;
+  char *buf = (char *) malloc(STREAM_SIZE);
+  size_t len;
+  int failed = 0;
+
+  if (buf == NULL) {
+    return 1;
+  }
+
+  len = tile_responses(buf, STREAM_SIZE);
+  failed |= run("tile responses", HTTP_RESPONSE, buf, len, total_bytes);
+  len = not_modified(buf, STREAM_SIZE);
+  failed |= run("304 revalidations", HTTP_RESPONSE, buf, len, total_bytes);
+  len = long_path_requests(buf, STREAM_SIZE);
+  failed |= run("long-path requests", HTTP_REQUEST, buf, len, total_bytes);
+
+  free(buf);
+  return failed;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include "uvpp.h"
+
+namespace dns {
+	// Per-loop host lookup cache.  getaddrinfo doesn't expose record TTLs, so
+	//   successes are held for a fixed ttl and failures for a shorter one.
+	//   Concurrent lookups of one host share a single getaddrinfo call.
+	//   Loop-thread only.
+	class Cache {
+	public:
+		typedef std::function<void(int32_t status, const struct sockaddr *addr)> Callback;
+
+		Cache(uvpp::EventLoop& loop, uint64_t ttlMs = 60000, uint64_t negativeTtlMs = 5000)
+			: _loop(loop), _ttlMs(ttlMs), _negativeTtlMs(negativeTtlMs) {
+		}
+
+		~Cache() {
+			for (auto& i : _entries) {
+				delete i.second.lookup;
+			}
+		}
+
+		void resolve(const std::string& host, uint16_t port, Callback callback) {
+			struct sockaddr_storage addr;
+			if (_parseLiteral(host, addr)) {
+				_setPort(addr, port);
+				return callback(0, reinterpret_cast<const struct sockaddr*>(&addr));
+			}
+
+			Entry& entry = _entries[host];
+			if (!entry.lookup && entry.expires > _loop.now()) {
+				if (entry.status < 0) {
+					return callback(entry.status, nullptr);
+				}
+				addr = entry.addr;
+				_setPort(addr, port);
+				return callback(0, reinterpret_cast<const struct sockaddr*>(&addr));
+			}
+
+			entry.waiters.emplace_back(port, callback);
+			if (!entry.lookup) {
+				entry.lookup = new Lookup(*this, host);
+				if (!entry.lookup->resolve(host)) {
+					_complete(host, UV_EAI_FAIL, nullptr);
+				}
+			}
+		}
+
+		void clear() {
+			for (auto i = _entries.begin(); i != _entries.end();) {
+				if (i->second.lookup) {
+					++i;
+				} else {
+					i = _entries.erase(i);
+				}
+			}
+		}
+
+	private:
+		class Lookup : public uvpp::Resolver {
+		public:
+			Lookup(Cache& owner, const std::string& host)
+				: uvpp::Resolver(owner._loop), _owner(owner), _host(host) {
+			}
+			void onResolve(const struct sockaddr *addr) override {
+				_owner._complete(_host, 0, addr);
+			}
+			void onError(int32_t code) override {
+				_owner._complete(_host, code, nullptr);
+			}
+		private:
+			Cache& _owner;
+			std::string _host;
+		};
+
+		struct Entry {
+			Entry()
+				: status(0), expires(0), lookup(nullptr) {
+				memset(&addr, 0, sizeof(addr));
+			}
+
+			int32_t status;
+			struct sockaddr_storage addr;
+			uint64_t expires;
+			Lookup *lookup;
+			std::vector<std::pair<uint16_t, Callback>> waiters;
+		};
+
+		static bool _parseLiteral(const std::string& host, struct sockaddr_storage& addr) {
+			memset(&addr, 0, sizeof(addr));
+			if (uv_ip4_addr(host.c_str(), 0, reinterpret_cast<struct sockaddr_in*>(&addr)) == 0) {
+				return true;
+			}
+			if (uv_ip6_addr(host.c_str(), 0, reinterpret_cast<struct sockaddr_in6*>(&addr)) == 0) {
+				return true;
+			}
+			return false;
+		}
+
+		static void _setPort(struct sockaddr_storage& addr, uint16_t port) {
+			if (addr.ss_family == AF_INET) {
+				reinterpret_cast<struct sockaddr_in*>(&addr)->sin_port = htons(port);
+			} else if (addr.ss_family == AF_INET6) {
+				reinterpret_cast<struct sockaddr_in6*>(&addr)->sin6_port = htons(port);
+			}
+		}
+
+		// Called from inside the Lookup's own callback; deleting it here is
+		//   safe as long as it's the last thing Resolver does.  host is taken
+		//   by value because it may belong to the Lookup.
+		void _complete(std::string host, int32_t status, const struct sockaddr *addr) {
+			Entry& entry = _entries[host];
+			delete entry.lookup;
+			entry.lookup = nullptr;
+			entry.status = status;
+			if (status == 0) {
+				memset(&entry.addr, 0, sizeof(entry.addr));
+				memcpy(&entry.addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+				entry.expires = _loop.now() + _ttlMs;
+			} else {
+				entry.expires = _loop.now() + _negativeTtlMs;
+			}
+
+			// Waiters may start new lookups, so detach them first.
+			std::vector<std::pair<uint16_t, Callback>> waiters;
+			waiters.swap(entry.waiters);
+			struct sockaddr_storage resolved = entry.addr;
+			for (auto& i : waiters) {
+				if (status < 0) {
+					i.second(status, nullptr);
+				} else {
+					struct sockaddr_storage portAddr = resolved;
+					_setPort(portAddr, i.first);
+					i.second(0, reinterpret_cast<const struct sockaddr*>(&portAddr));
+				}
+			}
+		}
+
+		uvpp::EventLoop& _loop;
+		uint64_t _ttlMs;
+		uint64_t _negativeTtlMs;
+		std::unordered_map<std::string, Entry> _entries;
+
+	};
+}
@@ -0,0 +1,530 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Compact binary geometry container.  Vertex streams are optionally
+//   quantized to 16 bits per component, then every stream is delta coded,
+//   zigzag/varint packed and entropy coded with an order-0 rANS coder.
+//
+//   File:      "FGEO" u16:version u16:attributeCount u32:vertexCount u32:indexCount
+//   Attribute: u8:nameLen name u8:itemSize u8:encoding u8:componentType
+//              [Quantized: f32:min[itemSize] f32:scale[itemSize]] Block
+//   Indices:   Block (only when indexCount > 0)
+//   Block:     u8:coder u32:rawSize u32:payloadSize payload
+//
+//   All values are little-endian.
+namespace geocodec {
+	const uint16_t kVersion = 1;
+
+	enum class ComponentType : uint8_t {
+		Float,
+		Byte,
+		UnsignedByte,
+		Short,
+		UnsignedShort,
+		Int,
+		UnsignedInt
+	};
+
+	enum class Encoding : uint8_t {
+		Raw,
+		Quantized
+	};
+
+	struct Attribute {
+		std::string name;
+		uint8_t itemSize;
+		ComponentType type;
+		std::vector<uint8_t> data;
+	};
+
+	struct Geometry {
+		uint32_t vertexCount;
+		std::vector<Attribute> attributes;
+		std::vector<uint32_t> indices;
+	};
+
+	size_t componentSize(ComponentType type) {
+		switch (type) {
+		case ComponentType::Byte:
+		case ComponentType::UnsignedByte:
+			return 1;
+		case ComponentType::Short:
+		case ComponentType::UnsignedShort:
+			return 2;
+		default:
+			return 4;
+		}
+	}
+
+	namespace internal {
+		enum class Coder : uint8_t {
+			Stored,
+			Rans
+		};
+
+		const uint32_t kRansProbBits = 12;
+		const uint32_t kRansProbScale = 1 << kRansProbBits;
+		const uint32_t kRansLow = 1 << 23;
+		// A run of one symbol decodes without consuming any input, so a
+		//   block's payload size puts no bound on its decoded size.
+		const uint32_t kMaxBlockSize = 256 * 1024 * 1024;
+		// Every varint takes at least one byte and at most five.
+		const uint32_t kMaxVarintBytes = 5;
+
+		class Reader {
+		public:
+			Reader(const uint8_t *data, size_t len)
+				: _data(data), _len(len), _pos(0) {
+			}
+
+			bool read(void *out, size_t len) {
+				if (_len - _pos < len) {
+					return false;
+				}
+				memcpy(out, _data + _pos, len);
+				_pos += len;
+				return true;
+			}
+
+			template<typename T>
+			bool read(T& out) {
+				return read(&out, sizeof(T));
+			}
+
+			const uint8_t * take(size_t len) {
+				if (_len - _pos < len) {
+					return nullptr;
+				}
+				const uint8_t *out = _data + _pos;
+				_pos += len;
+				return out;
+			}
+
+		private:
+			const uint8_t *_data;
+			size_t _len;
+			size_t _pos;
+
+		};
+
+		template<typename T>
+		void write(std::vector<uint8_t>& out, const T& value) {
+			size_t offset = out.size();
+			out.resize(offset + sizeof(T));
+			memcpy(&out[offset], &value, sizeof(T));
+		}
+
+		uint32_t zigzag(int32_t v) {
+			return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+		}
+
+		int32_t unzigzag(uint32_t v) {
+			return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+		}
+
+		void putVarint(std::vector<uint8_t>& out, uint32_t v) {
+			while (v >= 0x80) {
+				out.push_back((uint8_t)(v | 0x80));
+				v >>= 7;
+			}
+			out.push_back((uint8_t)v);
+		}
+
+		bool getVarint(const uint8_t *& pos, const uint8_t *end, uint32_t& v) {
+			v = 0;
+			for (uint32_t shift = 0; shift < 35; shift += 7) {
+				if (pos == end) {
+					return false;
+				}
+				uint8_t b = *pos++;
+				v |= (uint32_t)(b & 0x7f) << shift;
+				if (!(b & 0x80)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void normalizeFreqs(const uint32_t counts[256], uint16_t freqs[256]) {
+			uint64_t total = 0;
+			for (int s = 0; s < 256; ++s) {
+				total += counts[s];
+			}
+
+			uint32_t sum = 0;
+			for (int s = 0; s < 256; ++s) {
+				if (counts[s] == 0) {
+					freqs[s] = 0;
+					continue;
+				}
+				uint32_t f = (uint32_t)((uint64_t)counts[s] * kRansProbScale / total);
+				freqs[s] = (uint16_t)std::max<uint32_t>(f, 1);
+				sum += freqs[s];
+			}
+
+			// Settle rounding error on the most frequent symbols.
+			while (sum != kRansProbScale) {
+				int best = -1;
+				for (int s = 0; s < 256; ++s) {
+					if (freqs[s] > (sum > kRansProbScale ? 1 : 0) && (best < 0 || freqs[s] > freqs[best])) {
+						best = s;
+					}
+				}
+				if (sum > kRansProbScale) {
+					freqs[best]--;
+					sum--;
+				} else {
+					freqs[best]++;
+					sum++;
+				}
+			}
+		}
+
+		void encodeBlock(std::vector<uint8_t>& out, const std::vector<uint8_t>& raw) {
+			std::vector<uint8_t> payload;
+			Coder coder = Coder::Stored;
+
+			if (raw.size() > 1024) {
+				uint32_t counts[256] = { 0 };
+				for (auto& b : raw) {
+					counts[b]++;
+				}
+				uint16_t freqs[256];
+				normalizeFreqs(counts, freqs);
+				uint32_t starts[256];
+				uint32_t start = 0;
+				for (int s = 0; s < 256; ++s) {
+					starts[s] = start;
+					start += freqs[s];
+				}
+
+				// rANS emits backwards; encode into the tail of a scratch buffer.
+				//   12-bit probabilities cap expansion at 1.5x.
+				std::vector<uint8_t> scratch(raw.size() * 2 + 16);
+				uint8_t *ptr = &scratch[0] + scratch.size();
+				uint32_t x = kRansLow;
+				for (size_t n = raw.size(); n > 0; --n) {
+					uint8_t s = raw[n - 1];
+					uint32_t freq = freqs[s];
+					uint32_t xMax = ((kRansLow >> kRansProbBits) << 8) * freq;
+					while (x >= xMax) {
+						*--ptr = (uint8_t)(x & 0xff);
+						x >>= 8;
+					}
+					x = ((x / freq) << kRansProbBits) + (x % freq) + starts[s];
+				}
+				ptr -= 4;
+				memcpy(ptr, &x, 4);
+
+				size_t encodedLen = &scratch[0] + scratch.size() - ptr;
+				if (encodedLen + sizeof(freqs) < raw.size()) {
+					coder = Coder::Rans;
+					payload.resize(sizeof(freqs) + encodedLen);
+					memcpy(&payload[0], freqs, sizeof(freqs));
+					memcpy(&payload[sizeof(freqs)], ptr, encodedLen);
+				}
+			}
+			if (coder == Coder::Stored) {
+				payload = raw;
+			}
+
+			write(out, (uint8_t)coder);
+			write(out, (uint32_t)raw.size());
+			write(out, (uint32_t)payload.size());
+			out.insert(out.end(), payload.begin(), payload.end());
+		}
+
+		// maxSize is the most the caller can make sense of; anything larger
+		//   is rejected before it is allocated.
+		bool decodeBlock(Reader& reader, std::vector<uint8_t>& raw, uint64_t maxSize) {
+			uint8_t coder;
+			uint32_t rawSize, payloadSize;
+			if (!reader.read(coder) || !reader.read(rawSize) || !reader.read(payloadSize)) {
+				return false;
+			}
+			if (rawSize > kMaxBlockSize || rawSize > maxSize) {
+				return false;
+			}
+			const uint8_t *payload = reader.take(payloadSize);
+			if (!payload) {
+				return false;
+			}
+
+			if (coder == (uint8_t)Coder::Stored) {
+				if (payloadSize != rawSize) {
+					return false;
+				}
+				raw.assign(payload, payload + payloadSize);
+				return true;
+			} else if (coder != (uint8_t)Coder::Rans) {
+				return false;
+			}
+
+			uint16_t freqs[256];
+			if (payloadSize < sizeof(freqs) + 4) {
+				return false;
+			}
+			memcpy(freqs, payload, sizeof(freqs));
+
+			uint32_t starts[256];
+			uint32_t start = 0;
+			std::vector<uint8_t> slots(kRansProbScale);
+			for (int s = 0; s < 256; ++s) {
+				starts[s] = start;
+				if (start + freqs[s] > kRansProbScale) {
+					return false;
+				}
+				if (freqs[s] > 0) {
+					memset(&slots[start], s, freqs[s]);
+				}
+				start += freqs[s];
+			}
+			if (start != kRansProbScale) {
+				return false;
+			}
+
+			const uint8_t *ptr = payload + sizeof(freqs);
+			const uint8_t *end = payload + payloadSize;
+			uint32_t x;
+			memcpy(&x, ptr, 4);
+			ptr += 4;
+
+			raw.resize(rawSize);
+			for (uint32_t n = 0; n < rawSize; ++n) {
+				uint8_t s = slots[x & (kRansProbScale - 1)];
+				raw[n] = s;
+				x = freqs[s] * (x >> kRansProbBits) + (x & (kRansProbScale - 1)) - starts[s];
+				while (x < kRansLow) {
+					if (ptr == end) {
+						return false;
+					}
+					x = (x << 8) | *ptr++;
+				}
+			}
+			return true;
+		}
+
+		// Delta coding runs per component, down each column of the stream.
+		void deltaEncode(std::vector<uint8_t>& out, const int32_t *values, size_t count, size_t columns) {
+			for (size_t n = 0; n < count; ++n) {
+				int32_t prev = n >= columns ? values[n - columns] : 0;
+				putVarint(out, zigzag((int32_t)((uint32_t)values[n] - (uint32_t)prev)));
+			}
+		}
+
+		bool deltaDecode(const std::vector<uint8_t>& in, int32_t *values, size_t count, size_t columns) {
+			const uint8_t *pos = in.empty() ? nullptr : &in[0];
+			const uint8_t *end = pos + in.size();
+			for (size_t n = 0; n < count; ++n) {
+				uint32_t v;
+				if (!getVarint(pos, end, v)) {
+					return false;
+				}
+				int32_t prev = n >= columns ? values[n - columns] : 0;
+				values[n] = (int32_t)((uint32_t)prev + (uint32_t)unzigzag(v));
+			}
+			return pos == end;
+		}
+
+		int32_t readComponent(const uint8_t *src, ComponentType type) {
+			switch (type) {
+			case ComponentType::Byte: return *(const int8_t*)src;
+			case ComponentType::UnsignedByte: return *src;
+			case ComponentType::Short: { int16_t v; memcpy(&v, src, 2); return v; }
+			case ComponentType::UnsignedShort: { uint16_t v; memcpy(&v, src, 2); return v; }
+			default: { int32_t v; memcpy(&v, src, 4); return v; }
+			}
+		}
+
+		void writeComponent(uint8_t *dst, ComponentType type, int32_t value) {
+			size_t size = componentSize(type);
+			memcpy(dst, &value, size);
+		}
+	}
+	namespace i = geocodec::internal;
+
+	// Decodes a container straight into attribute storage.  Returns false on
+	//   any truncation or inconsistency; out is left in an unspecified state.
+	bool decode(const uint8_t *data, size_t len, Geometry& out) {
+		i::Reader reader(data, len);
+
+		char magic[4];
+		uint16_t version, attributeCount;
+		uint32_t indexCount;
+		if (!reader.read(magic) || memcmp(magic, "FGEO", 4) != 0) {
+			return false;
+		}
+		if (!reader.read(version) || version != kVersion) {
+			return false;
+		}
+		if (!reader.read(attributeCount) || !reader.read(out.vertexCount) || !reader.read(indexCount)) {
+			return false;
+		}
+
+		std::vector<uint8_t> raw;
+		std::vector<int32_t> values;
+		out.attributes.resize(attributeCount);
+		for (auto& attrib : out.attributes) {
+			uint8_t nameLen, encoding, type;
+			if (!reader.read(nameLen)) {
+				return false;
+			}
+			attrib.name.resize(nameLen);
+			if (nameLen > 0 && !reader.read(&attrib.name[0], nameLen)) {
+				return false;
+			}
+			if (!reader.read(attrib.itemSize) || !reader.read(encoding) || !reader.read(type)) {
+				return false;
+			}
+			if (attrib.itemSize == 0 || attrib.itemSize > 4 || type > (uint8_t)ComponentType::UnsignedInt) {
+				return false;
+			}
+			attrib.type = (ComponentType)type;
+
+			// Every value takes at least a byte of some block, so a count the
+			//   blocks can't hold is rejected before anything is sized by it.
+			const uint64_t count64 = (uint64_t)out.vertexCount * attrib.itemSize;
+			if (count64 > i::kMaxBlockSize) {
+				return false;
+			}
+			const size_t count = (size_t)count64;
+			if (encoding == (uint8_t)Encoding::Quantized) {
+				float min[4], scale[4];
+				if (!reader.read(min, attrib.itemSize * sizeof(float)) || !reader.read(scale, attrib.itemSize * sizeof(float))) {
+					return false;
+				}
+				if (!i::decodeBlock(reader, raw, count64 * i::kMaxVarintBytes) || raw.size() < count) {
+					return false;
+				}
+				values.resize(count);
+				if (!i::deltaDecode(raw, values.data(), count, attrib.itemSize)) {
+					return false;
+				}
+				attrib.type = ComponentType::Float;
+				attrib.data.resize(count * sizeof(float));
+				float *dst = (float*)&attrib.data[0];
+				for (size_t n = 0; n < count; ++n) {
+					size_t c = n % attrib.itemSize;
+					dst[n] = min[c] + (float)(uint16_t)values[n] * scale[c];
+				}
+			} else if (encoding == (uint8_t)Encoding::Raw) {
+				uint64_t maxSize = count64 * (attrib.type == ComponentType::Float ? sizeof(float) : i::kMaxVarintBytes);
+				if (!i::decodeBlock(reader, raw, maxSize)) {
+					return false;
+				}
+				if (attrib.type == ComponentType::Float) {
+					// Float bits don't delta well; they're entropy coded as-is.
+					if (raw.size() != count * sizeof(float)) {
+						return false;
+					}
+					attrib.data.swap(raw);
+				} else {
+					if (raw.size() < count) {
+						return false;
+					}
+					values.resize(count);
+					if (!i::deltaDecode(raw, values.data(), count, attrib.itemSize)) {
+						return false;
+					}
+					size_t size = componentSize(attrib.type);
+					attrib.data.resize(count * size);
+					for (size_t n = 0; n < count; ++n) {
+						i::writeComponent(&attrib.data[n * size], attrib.type, values[n]);
+					}
+				}
+			} else {
+				return false;
+			}
+		}
+
+		out.indices.clear();
+		if (indexCount > 0) {
+			if (!i::decodeBlock(reader, raw, (uint64_t)indexCount * i::kMaxVarintBytes) || raw.size() < indexCount) {
+				return false;
+			}
+			out.indices.resize(indexCount);
+			if (!i::deltaDecode(raw, (int32_t*)out.indices.data(), indexCount, 1)) {
+				return false;
+			}
+			for (auto& idx : out.indices) {
+				if (idx >= out.vertexCount) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// Encoder used by asset tooling.  Float attributes named in quantize are
+	//   stored as 16-bit fixed point over their bounding range.
+	void encode(const Geometry& geom, std::vector<uint8_t>& out, const std::vector<std::string>& quantize) {
+		out.clear();
+		out.insert(out.end(), "FGEO", "FGEO" + 4);
+		i::write(out, kVersion);
+		i::write(out, (uint16_t)geom.attributes.size());
+		i::write(out, geom.vertexCount);
+		i::write(out, (uint32_t)geom.indices.size());
+
+		std::vector<uint8_t> raw;
+		std::vector<int32_t> values;
+		for (auto& attrib : geom.attributes) {
+			const size_t count = (size_t)geom.vertexCount * attrib.itemSize;
+			bool quantized = attrib.type == ComponentType::Float &&
+				std::find(quantize.begin(), quantize.end(), attrib.name) != quantize.end();
+
+			i::write(out, (uint8_t)attrib.name.size());
+			out.insert(out.end(), attrib.name.begin(), attrib.name.end());
+			i::write(out, attrib.itemSize);
+			i::write(out, (uint8_t)(quantized ? Encoding::Quantized : Encoding::Raw));
+			i::write(out, (uint8_t)attrib.type);
+
+			raw.clear();
+			if (quantized) {
+				const float *src = (const float*)&attrib.data[0];
+				float min[4], max[4], scale[4];
+				for (size_t c = 0; c < attrib.itemSize; ++c) {
+					min[c] = max[c] = count > 0 ? src[c] : 0.0f;
+				}
+				for (size_t n = 0; n < count; ++n) {
+					size_t c = n % attrib.itemSize;
+					min[c] = std::min(min[c], src[n]);
+					max[c] = std::max(max[c], src[n]);
+				}
+				for (size_t c = 0; c < attrib.itemSize; ++c) {
+					scale[c] = max[c] > min[c] ? (max[c] - min[c]) / 65535.0f : 1.0f;
+				}
+				out.insert(out.end(), (const uint8_t*)min, (const uint8_t*)(min + attrib.itemSize));
+				out.insert(out.end(), (const uint8_t*)scale, (const uint8_t*)(scale + attrib.itemSize));
+
+				values.resize(count);
+				for (size_t n = 0; n < count; ++n) {
+					size_t c = n % attrib.itemSize;
+					float q = (src[n] - min[c]) / scale[c] + 0.5f;
+					values[n] = (int32_t)std::min(std::max(q, 0.0f), 65535.0f);
+				}
+				i::deltaEncode(raw, values.data(), count, attrib.itemSize);
+			} else if (attrib.type == ComponentType::Float) {
+				raw = attrib.data;
+			} else {
+				size_t size = componentSize(attrib.type);
+				values.resize(count);
+				for (size_t n = 0; n < count; ++n) {
+					values[n] = i::readComponent(&attrib.data[n * size], attrib.type);
+				}
+				i::deltaEncode(raw, values.data(), count, attrib.itemSize);
+			}
+			i::encodeBlock(out, raw);
+		}
+
+		if (!geom.indices.empty()) {
+			raw.clear();
+			i::deltaEncode(raw, (const int32_t*)geom.indices.data(), geom.indices.size(), 1);
+			i::encodeBlock(out, raw);
+		}
+	}
+}
@@ -42,10 +42,36 @@ namespace gfx {
 		Float = GL_FLOAT
 	};
 
+	size_t bufferTypeSize(BufferType type) {
+		switch (type) {
+		case BufferType::Byte:
+		case BufferType::UnsignedByte:
+			return 1;
+		case BufferType::Short:
+		case BufferType::UnsignedShort:
+			return 2;
+		default:
+			return 4;
+		}
+	}
+
 	namespace Renderer {
 		math::Matrix4 projMatrix;
 		math::Affine3 viewMatrix;
 		math::Affine3 modelViewMatrix;
+
+		// GL work issued since startup, for frame metrics.
+		struct Stats {
+			Stats()
+				: draws(0), programBinds(0), uniformUploads(0), attributeBinds(0) {
+			}
+
+			uint64_t draws;
+			uint64_t programBinds;
+			uint64_t uniformUploads;
+			uint64_t attributeBinds;
+		};
+		Stats stats;
 	}
 
 	class Object3d {
@@ -119,7 +145,8 @@ namespace gfx {
 	class BufferAttribute {
 	public:
 		BufferAttribute()
-			: _needsUpdate(false), _itemType(BufferType::Float) {
+			: _needsUpdate(false), _itemType(BufferType::Float), _normalized(false),
+				_offset(0), _length(0), _stride(0), _version(0) {
 			printf("gfx::^BufferAttribute\n");
 		}
 
@@ -136,23 +163,113 @@ namespace gfx {
 				}
 			}
 
-			glVertexAttribPointer(slot, _itemSize, (GLenum)_itemType, GL_FALSE, 0, &_data[0]);
+			glVertexAttribPointer(slot, _itemSize, (GLenum)_itemType, _normalized ? GL_TRUE : GL_FALSE, _stride, bytes());
 			return true;
 		}
 
+		// Attribute bytes are either owned in _data or, for loaders that can
+		//   avoid a copy, a strided view into a shared blob kept alive by
+		//   _storage.  Writers go through allocate()/setData(), which drop
+		//   any view.  Every write bumps _version, so work done on a copy
+		//   can tell whether the attribute changed in the meantime.
+		uint8_t * allocate(size_t len) {
+			++_version;
+			_storage.reset();
+			_stride = 0;
+			_data.resize(len);
+			return _data.empty() ? nullptr : &_data[0];
+		}
+
+		void setData(std::vector<uint8_t>& data) {
+			++_version;
+			_storage.reset();
+			_stride = 0;
+			_data.swap(data);
+		}
+
+		void setView(std::shared_ptr<const std::vector<uint8_t>> storage, size_t offset, size_t length, int32_t stride) {
+			++_version;
+			_data.clear();
+			_storage = storage;
+			_offset = offset;
+			_length = length;
+			_stride = stride;
+		}
+
+		const uint8_t * bytes() const {
+			if (_storage) {
+				return &(*_storage)[_offset];
+			}
+			return _data.empty() ? nullptr : &_data[0];
+		}
+
+		size_t byteLength() const {
+			return _storage ? _length : _data.size();
+		}
+
+		size_t elementSize() const {
+			return _itemSize * bufferTypeSize(_itemType);
+		}
+
+		size_t count() const {
+			size_t elemSize = elementSize();
+			size_t len = byteLength();
+			if (elemSize == 0 || len < elemSize) {
+				return 0;
+			}
+			if (_stride > 0 && (size_t)_stride != elemSize) {
+				return (len - elemSize) / _stride + 1;
+			}
+			return len / elemSize;
+		}
+
+		// Tightly packed copy of the elements, whatever the storage.
+		std::vector<uint8_t> packed() const {
+			size_t elemSize = elementSize();
+			size_t num = count();
+			size_t stride = _stride > 0 ? _stride : elemSize;
+			std::vector<uint8_t> out(num * elemSize);
+			const uint8_t *src = bytes();
+			for (size_t i = 0; i < num; ++i) {
+				memcpy(&out[i * elemSize], src + i * stride, elemSize);
+			}
+			return out;
+		}
+
 		std::vector<uint8_t> _data;
 		int32_t _itemSize;
 		BufferType _itemType;
 		bool _needsUpdate;
+		bool _normalized;
+
+		std::shared_ptr<const std::vector<uint8_t>> _storage;
+		size_t _offset;
+		size_t _length;
+		int32_t _stride;
+		uint32_t _version;
 	};
 
 	class BufferGeometry {
 	public:
-		BufferGeometry() {
+		BufferGeometry()
+			: _static(false) {
 			printf("gfx::^BufferGeometry\n");
 		}
 
+		BufferAttribute* attribute(const std::string& name) {
+			auto foundI = _attributes.find(name);
+			if (foundI != _attributes.end()) {
+				return foundI->second;
+			}
+			return nullptr;
+		}
+
+		BufferAttribute* index() {
+			return attribute("index");
+		}
+
 		std::unordered_map<std::string, BufferAttribute*> _attributes;
+		bool _static;
 	};
 
 	class Shader {
@@ -337,6 +454,7 @@ namespace gfx {
 			}
 			if (_compileState == CompileState::LINKED) {
 				glUseProgram(_program);
+				++Renderer::stats.programBinds;
 
 				return true;
 			}
@@ -373,6 +491,7 @@ namespace gfx {
 							bindSuccess = false;
 							break;
 						}
+						++Renderer::stats.uniformUploads;
 					}
 				}
 				if (bindSuccess) {
@@ -388,6 +507,7 @@ namespace gfx {
 									break;
 								}
 								glEnableVertexAttribArray(bindInfo.location);
+								++Renderer::stats.attributeBinds;
 							}
 						}
 					}
@@ -477,8 +597,18 @@ namespace gfx {
 		}
 
 		void render() {
+			if (!_geometry || !_material) {
+				return;
+			}
 			if (_material->bindFor(_geometry)) {
-				glDrawArrays(GL_TRIANGLES, 0, 3);
+				BufferAttribute *index = _geometry->index();
+				++Renderer::stats.draws;
+				if (index) {
+					glDrawElements(GL_TRIANGLES, (GLsizei)index->count(), (GLenum)index->_itemType, index->bytes());
+				} else {
+					BufferAttribute *position = _geometry->attribute("position");
+					glDrawArrays(GL_TRIANGLES, 0, position ? (GLsizei)position->count() : 3);
+				}
 			}
 		}
 	};
@@ -490,6 +620,8 @@ namespace gfx {
 
 		Camera() {
 			printf("gfx::^Camera\n");
+			_viewMatrix.setIdentity();
+			_projMatrix.setIdentity();
 		}
 
 		virtual ObjectType type() override { return ObjectType::Camera; }
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <cctype>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "math.h"
+#include "json.h"
+
+// glTF 2.0 binary (.glb) parsing.  This runs on the IO thread and only
+//   resolves accessors to byte ranges inside the BIN chunk; the main thread
+//   turns the result into gfx objects whose attributes view that chunk
+//   directly.
+namespace gltf {
+	struct AttributeView {
+		std::string name;
+		size_t offset;
+		size_t length;
+		int32_t stride;
+		int32_t itemSize;
+		uint32_t componentType;
+		bool normalized;
+	};
+
+	struct Primitive {
+		std::vector<AttributeView> attributes;
+		bool indexed;
+		AttributeView indices;
+	};
+
+	struct Mesh {
+		std::string name;
+		std::vector<Primitive> primitives;
+	};
+
+	struct Node {
+		std::string name;
+		int32_t mesh;
+		std::vector<int32_t> children;
+		float translation[3];
+		float rotation[4];
+		float scale[3];
+	};
+
+	struct Scene {
+		std::shared_ptr<const std::vector<uint8_t>> storage;
+		std::vector<Mesh> meshes;
+		std::vector<Node> nodes;
+		std::vector<int32_t> roots;
+	};
+
+	namespace internal {
+		const uint32_t kGlbMagic = 0x46546C67;
+		const uint32_t kChunkJson = 0x4E4F534A;
+		const uint32_t kChunkBin = 0x004E4942;
+
+		uint32_t readU32(const uint8_t *p) {
+			uint32_t v;
+			memcpy(&v, p, 4);
+			return v;
+		}
+
+		size_t componentSize(uint32_t componentType) {
+			switch (componentType) {
+			case 5120: // BYTE
+			case 5121: // UNSIGNED_BYTE
+				return 1;
+			case 5122: // SHORT
+			case 5123: // UNSIGNED_SHORT
+				return 2;
+			case 5125: // UNSIGNED_INT
+			case 5126: // FLOAT
+				return 4;
+			default:
+				return 0;
+			}
+		}
+
+		int32_t typeItemSize(const std::string& type) {
+			if (type == "SCALAR") return 1;
+			if (type == "VEC2") return 2;
+			if (type == "VEC3") return 3;
+			if (type == "VEC4") return 4;
+			return 0;
+		}
+
+		// Maps glTF semantics onto the attribute names our shaders use.
+		std::string attributeName(const std::string& semantic) {
+			if (semantic == "POSITION") return "position";
+			if (semantic == "NORMAL") return "normal";
+			if (semantic == "TANGENT") return "tangent";
+			if (semantic == "TEXCOORD_0") return "uv";
+			if (semantic == "TEXCOORD_1") return "uv2";
+			if (semantic == "COLOR_0") return "color";
+			std::string out = semantic;
+			for (auto& c : out) {
+				c = (char)tolower(c);
+			}
+			return out;
+		}
+
+		bool resolveAccessor(const json::Value& doc, int64_t index, size_t binOffset, size_t binLength, AttributeView& out) {
+			const json::Value& accessor = doc["accessors"][(size_t)index];
+			if (!accessor.isObject() || accessor.has("sparse") || !accessor.has("bufferView")) {
+				return false;
+			}
+			const json::Value& view = doc["bufferViews"][(size_t)accessor["bufferView"].asInt(-1)];
+			if (!view.isObject() || view["buffer"].asInt(0) != 0) {
+				return false;
+			}
+
+			out.componentType = (uint32_t)accessor["componentType"].asInt();
+			out.itemSize = typeItemSize(accessor["type"].asString());
+			out.normalized = accessor["normalized"].asBool();
+			size_t compSize = componentSize(out.componentType);
+			int64_t count = accessor["count"].asInt(-1);
+			if (compSize == 0 || out.itemSize == 0 || count <= 0) {
+				return false;
+			}
+
+			size_t elemSize = compSize * out.itemSize;
+			int64_t stride = view["byteStride"].asInt(0);
+			if (stride != 0 && (stride < (int64_t)elemSize || stride > 252)) {
+				return false;
+			}
+			out.stride = (int32_t)stride;
+
+			int64_t viewOffset = view["byteOffset"].asInt(0);
+			int64_t viewLength = view["byteLength"].asInt(-1);
+			int64_t accessorOffset = accessor["byteOffset"].asInt(0);
+			if (viewOffset < 0 || viewLength < 0 || accessorOffset < 0 || (size_t)(viewOffset + viewLength) > binLength) {
+				return false;
+			}
+			size_t span = (size_t)(count - 1) * (stride ? (size_t)stride : elemSize) + elemSize;
+			if ((size_t)accessorOffset + span > (size_t)viewLength) {
+				return false;
+			}
+
+			out.offset = binOffset + (size_t)viewOffset + (size_t)accessorOffset;
+			out.length = span;
+			return true;
+		}
+	}
+	namespace i = gltf::internal;
+
+	// Parses a GLB container.  Only the embedded BIN chunk is supported as a
+	//   buffer source; primitives referencing anything else are dropped.
+	bool parseGlb(std::shared_ptr<const std::vector<uint8_t>> data, Scene& out) {
+		const std::vector<uint8_t>& bytes = *data;
+		if (bytes.size() < 20 || i::readU32(&bytes[0]) != i::kGlbMagic || i::readU32(&bytes[4]) != 2) {
+			return false;
+		}
+		size_t totalLength = std::min<size_t>(i::readU32(&bytes[8]), bytes.size());
+
+		size_t jsonOffset = 0, jsonLength = 0;
+		size_t binOffset = 0, binLength = 0;
+		size_t pos = 12;
+		while (pos + 8 <= totalLength) {
+			uint32_t chunkLength = i::readU32(&bytes[pos]);
+			uint32_t chunkType = i::readU32(&bytes[pos + 4]);
+			pos += 8;
+			if (chunkLength > totalLength - pos) {
+				return false;
+			}
+			if (chunkType == i::kChunkJson && jsonLength == 0) {
+				jsonOffset = pos;
+				jsonLength = chunkLength;
+			} else if (chunkType == i::kChunkBin && binLength == 0) {
+				binOffset = pos;
+				binLength = chunkLength;
+			}
+			pos += (chunkLength + 3) & ~3;
+		}
+		if (jsonLength == 0) {
+			return false;
+		}
+
+		json::Value doc;
+		if (!json::parse((const char*)&bytes[jsonOffset], jsonLength, doc)) {
+			return false;
+		}
+
+		out.storage = data;
+
+		const json::Value& meshes = doc["meshes"];
+		out.meshes.resize(meshes.size());
+		for (size_t m = 0; m < meshes.size(); ++m) {
+			out.meshes[m].name = meshes[m]["name"].asString();
+			const json::Value& primitives = meshes[m]["primitives"];
+			for (size_t p = 0; p < primitives.size(); ++p) {
+				const json::Value& prim = primitives[p];
+				// Only triangle lists for now.
+				if (prim["mode"].asInt(4) != 4) {
+					continue;
+				}
+
+				Primitive primitive;
+				bool valid = true;
+				const json::Value& attributes = prim["attributes"];
+				static const char *kSemantics[] = {
+					"POSITION", "NORMAL", "TANGENT", "TEXCOORD_0", "TEXCOORD_1", "COLOR_0"
+				};
+				for (auto semantic : kSemantics) {
+					if (!attributes.has(semantic)) {
+						continue;
+					}
+					AttributeView view;
+					if (!i::resolveAccessor(doc, attributes[semantic].asInt(-1), binOffset, binLength, view)) {
+						valid = false;
+						break;
+					}
+					view.name = i::attributeName(semantic);
+					primitive.attributes.push_back(view);
+				}
+				if (!valid || primitive.attributes.empty()) {
+					continue;
+				}
+
+				primitive.indexed = prim.has("indices");
+				if (primitive.indexed) {
+					if (!i::resolveAccessor(doc, prim["indices"].asInt(-1), binOffset, binLength, primitive.indices) ||
+						primitive.indices.itemSize != 1 || primitive.indices.stride != 0 ||
+						primitive.indices.componentType == 5120 || primitive.indices.componentType == 5122 ||
+						primitive.indices.componentType == 5126) {
+						continue;
+					}
+					primitive.indices.name = "index";
+				}
+				out.meshes[m].primitives.push_back(primitive);
+			}
+		}
+
+		const json::Value& nodes = doc["nodes"];
+		out.nodes.resize(nodes.size());
+		for (size_t n = 0; n < nodes.size(); ++n) {
+			const json::Value& src = nodes[n];
+			Node& node = out.nodes[n];
+			node.name = src["name"].asString();
+			node.mesh = (int32_t)src["mesh"].asInt(-1);
+			if (node.mesh >= (int32_t)out.meshes.size()) {
+				node.mesh = -1;
+			}
+			for (size_t c = 0; c < src["children"].size(); ++c) {
+				int64_t child = src["children"][c].asInt(-1);
+				if (child >= 0 && child < (int64_t)nodes.size()) {
+					node.children.push_back((int32_t)child);
+				}
+			}
+
+			const json::Value& t = src["translation"];
+			const json::Value& r = src["rotation"];
+			const json::Value& s = src["scale"];
+			for (size_t k = 0; k < 3; ++k) {
+				node.translation[k] = (float)t[k].asNumber(0.0);
+				node.scale[k] = (float)s[k].asNumber(1.0);
+			}
+			for (size_t k = 0; k < 4; ++k) {
+				node.rotation[k] = (float)r[k].asNumber(k == 3 ? 1.0 : 0.0);
+			}
+
+			// Column-major matrix form; decompose into TRS assuming no shear.
+			const json::Value& m = src["matrix"];
+			if (m.size() == 16) {
+				float mat[16];
+				for (size_t k = 0; k < 16; ++k) {
+					mat[k] = (float)m[k].asNumber();
+				}
+				math::Matrix3 rot;
+				for (int c = 0; c < 3; ++c) {
+					math::Vector3 col(mat[c * 4], mat[c * 4 + 1], mat[c * 4 + 2]);
+					node.scale[c] = col.norm();
+					rot.col(c) = node.scale[c] > 0.0f ? math::Vector3(col / node.scale[c]) : col;
+					node.translation[c] = mat[12 + c];
+				}
+				math::Quaternion q(rot);
+				node.rotation[0] = q.x();
+				node.rotation[1] = q.y();
+				node.rotation[2] = q.z();
+				node.rotation[3] = q.w();
+			}
+		}
+
+		const json::Value& scenes = doc["scenes"];
+		const json::Value& scene = scenes[(size_t)doc["scene"].asInt(0)];
+		if (scene.isObject()) {
+			for (size_t n = 0; n < scene["nodes"].size(); ++n) {
+				int64_t root = scene["nodes"][n].asInt(-1);
+				if (root >= 0 && root < (int64_t)out.nodes.size()) {
+					out.roots.push_back((int32_t)root);
+				}
+			}
+		} else {
+			// No scenes; every node nobody claims as a child is a root.
+			std::vector<bool> isChild(out.nodes.size(), false);
+			for (auto& node : out.nodes) {
+				for (auto& c : node.children) {
+					isChild[c] = true;
+				}
+			}
+			for (size_t n = 0; n < out.nodes.size(); ++n) {
+				if (!isChild[n]) {
+					out.roots.push_back((int32_t)n);
+				}
+			}
+		}
+
+		return true;
+	}
+}
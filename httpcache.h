@@ -0,0 +1,635 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "uvpp.h"
+#include "uvhttp.h"
+
+// Persistent HTTP cache shared by every IO loop.  Each stored response is a
+//   pair of files named after a hash of its URL plus a version: <name>.body
+//   holds the decoded body and <name>.hdr the URL, expiry and headers.  The
+//   .hdr is only written once the body is complete, and always via a
+//   scratch file renamed into place, so open() treats any file without a
+//   valid partner as debris from an interrupted run.
+namespace httpcache {
+	struct Entry {
+		Entry()
+			: size(0), expires(0), lastUsed(0) {
+		}
+
+		// Wall-clock; anything else must be revalidated before use.
+		bool fresh() const {
+			return (int64_t)time(nullptr) < expires;
+		}
+
+		const std::string * header(const char *name) const {
+			for (auto& i : headers) {
+				if (http::equalsIgnoreCase(i.first, name)) {
+					return &i.second;
+				}
+			}
+			return nullptr;
+		}
+
+		// Same rules as http::freshnessLifetime, over the stored headers.
+		int64_t freshnessLifetime() const {
+			const std::string *expires = header("Expires");
+			const std::string *date = header("Date");
+			return http::freshnessLifetime(cacheControl(),
+				expires ? http::StringRef(expires->data(), expires->size()) : http::StringRef(),
+				date ? http::StringRef(date->data(), date->size()) : http::StringRef());
+		}
+
+		http::CacheControl cacheControl() const {
+			http::CacheControl out;
+			for (auto& i : headers) {
+				if (http::equalsIgnoreCase(i.first, "Cache-Control")) {
+					http::parseCacheControl(i.second.data(), i.second.size(), out);
+				}
+			}
+			return out;
+		}
+
+		std::string url;
+		std::string name;
+		uint64_t size;
+		// Seconds since the epoch.
+		int64_t expires;
+		uint64_t lastUsed;
+		http::Headers headers;
+	};
+
+	namespace internal {
+		const char kHeaderMagic[] = "FOURCACHE 1";
+
+		uint64_t hashUrl(const std::string& url) {
+			uint64_t hash = 14695981039346656037ULL;
+			for (auto c : url) {
+				hash ^= (uint8_t)c;
+				hash *= 1099511628211ULL;
+			}
+			return hash;
+		}
+
+		// Response headers that describe the transfer rather than the body
+		//   we keep, plus cookies, which have no business being replayed.
+		bool isStoredHeader(http::StringRef name) {
+			static const char *kSkipped[] = {
+				"Connection", "Keep-Alive", "Transfer-Encoding", "Content-Encoding", "Content-Length", "Set-Cookie"
+			};
+			for (auto skipped : kSkipped) {
+				if (name.equalsIgnoreCase(skipped)) {
+					return false;
+				}
+			}
+			return true;
+		}
+	}
+	namespace i = httpcache::internal;
+
+	class Cache;
+
+	// Streams one response body to disk and files it with the cache once it
+	//   is complete.  Deletes itself when commit() or abort() has settled.
+	//   Loop-thread only.
+	class Writer : public uvpp::FileWriter {
+	public:
+		void append(const void *data, size_t len);
+
+		void commit() {
+			finish();
+		}
+
+		void abort() {
+			_aborted = true;
+			finish();
+		}
+
+	private:
+		friend class Cache;
+
+		Writer(Cache& cache, uvpp::EventLoop& loop, const Entry& entry, uint64_t maxSize)
+			: uvpp::FileWriter(loop), _cache(cache), _entry(entry), _maxSize(maxSize), _aborted(false) {
+		}
+
+		void onFinish(int32_t status) override;
+
+		Cache& _cache;
+		Entry _entry;
+		uint64_t _maxSize;
+		bool _aborted;
+
+	};
+
+	// Writes an entry's .hdr to a scratch file and renames it over the old
+	//   one once complete.  Deletes itself when done.  Loop-thread only.
+	class HeaderWriter : public uvpp::FileWriter {
+	private:
+		friend class Cache;
+
+		HeaderWriter(Cache& cache, uvpp::EventLoop& loop, const Entry& entry, const std::string& scratch, const std::string& path)
+			: uvpp::FileWriter(loop), _cache(cache), _entry(entry), _scratch(scratch), _path(path) {
+		}
+
+		void onFinish(int32_t status) override;
+
+		Cache& _cache;
+		Entry _entry;
+		std::string _scratch;
+		std::string _path;
+
+	};
+
+	// Index and files of the cache.  Everything but open() may be called
+	//   from any loop, passing that loop for the file work.  The index lock
+	//   only ever covers the in-memory index; headers, deletions and LRU
+	//   touches go out as async requests once it is released.
+	class Cache {
+	public:
+		struct Stats {
+			Stats()
+				: hits(0), revalidated(0), misses(0), stores(0), evictions(0), bytes(0), entries(0) {
+			}
+
+			uint64_t hits;
+			uint64_t revalidated;
+			uint64_t misses;
+			uint64_t stores;
+			uint64_t evictions;
+			uint64_t bytes;
+			size_t entries;
+		};
+
+		Cache(const std::string& dir, uint64_t maxBytes)
+			: _dir(dir), _maxBytes(maxBytes), _bytes(0), _clock(0), _nextVersion(0), _nextScratch(0) {
+			uv_loop_init(&_fsLoop);
+		}
+
+		~Cache() {
+			uv_loop_close(&_fsLoop);
+		}
+
+		// Creates the directory if needed and indexes what earlier runs
+		//   left behind, least recently used first.  Call before any loop
+		//   uses the cache; this one works synchronously.
+		bool open() {
+			uvpp::ScopedLock lock(_mutex);
+			uv_fs_t req;
+			int32_t result = uv_fs_mkdir(&_fsLoop, &req, _dir.c_str(), 0755, nullptr);
+			uv_fs_req_cleanup(&req);
+			if (result < 0 && result != UV_EEXIST) {
+				return false;
+			}
+
+			std::vector<std::string> files;
+			if (uv_fs_scandir(&_fsLoop, &req, _dir.c_str(), 0, nullptr) < 0) {
+				uv_fs_req_cleanup(&req);
+				return false;
+			}
+			uv_dirent_t dirent;
+			while (uv_fs_scandir_next(&req, &dirent) != UV_EOF) {
+				files.push_back(dirent.name);
+			}
+			uv_fs_req_cleanup(&req);
+
+			std::vector<std::pair<double, Entry>> found;
+			std::unordered_map<std::string, bool> keep;
+			for (auto& file : files) {
+				if (file.size() <= 4 || file.compare(file.size() - 4, 4, ".hdr") != 0) {
+					continue;
+				}
+				Entry entry;
+				entry.name = file.substr(0, file.size() - 4);
+				double mtime;
+				if (!_readHeader(entry) || !_statBody(entry, mtime)) {
+					continue;
+				}
+				_nextVersion = std::max<uint64_t>(_nextVersion, strtoull(entry.name.c_str() + entry.name.find('-') + 1, nullptr, 16) + 1);
+				found.emplace_back(mtime, entry);
+			}
+			std::sort(found.begin(), found.end(), [](const std::pair<double, Entry>& a, const std::pair<double, Entry>& b) {
+				return a.first < b.first;
+			});
+
+			// A URL indexed twice means a replaced version outlived us; the
+			//   newer one wins.
+			for (auto& i : found) {
+				Entry& entry = i.second;
+				auto existing = _entries.find(entry.url);
+				if (existing != _entries.end()) {
+					keep.erase(existing->second.name);
+					_bytes -= existing->second.size;
+				}
+				entry.lastUsed = ++_clock;
+				keep[entry.name] = true;
+				_bytes += entry.size;
+				_entries[entry.url] = entry;
+			}
+			for (auto& file : files) {
+				size_t dot = file.rfind('.');
+				if (dot == std::string::npos || keep.find(file.substr(0, dot)) == keep.end()) {
+					_unlink(_dir + "/" + file);
+				}
+			}
+
+			std::vector<std::string> evicted;
+			_evict(std::string(), evicted);
+			for (auto& name : evicted) {
+				_unlink(_dir + "/" + name + ".hdr");
+				_unlink(_dir + "/" + name + ".body");
+			}
+			_stats.bytes = _bytes;
+			_stats.entries = _entries.size();
+			return true;
+		}
+
+		// Copies out the entry for url and marks it used.  Counts a hit
+		//   only when the entry is fresh; a stale one still has to be
+		//   revalidated by the caller.
+		bool lookup(uvpp::EventLoop& loop, const std::string& url, Entry& out) {
+			{
+				uvpp::ScopedLock lock(_mutex);
+				auto i = _entries.find(url);
+				if (i == _entries.end()) {
+					++_stats.misses;
+					return false;
+				}
+				i->second.lastUsed = ++_clock;
+				if (i->second.fresh()) {
+					++_stats.hits;
+				}
+				out = i->second;
+			}
+			// Keeps LRU order across restarts; open() sorts by mtime.
+			double now = (double)time(nullptr);
+			uvpp::FileOp::utime(loop, _bodyPath(out), now, now);
+			return true;
+		}
+
+		// Applies a 304 to the stored entry: new validators and expiry, same
+		//   body.  Returns false if the entry has gone since the request
+		//   went out.
+		bool refresh(uvpp::EventLoop& loop, const std::string& url, const http::Response& notModified, Entry& out) {
+			{
+				uvpp::ScopedLock lock(_mutex);
+				auto found = _entries.find(url);
+				if (found == _entries.end() || found->second.name != out.name) {
+					return false;
+				}
+				_refresh(found->second, notModified);
+				++_stats.revalidated;
+				out = found->second;
+			}
+			_writeHeader(loop, out);
+			return true;
+		}
+
+		// Drops the entry a caller looked up, say because its body has
+		//   gone.  A newer version stored since then is left alone.
+		void remove(uvpp::EventLoop& loop, const Entry& stale) {
+			{
+				uvpp::ScopedLock lock(_mutex);
+				auto i = _entries.find(stale.url);
+				if (i == _entries.end() || i->second.name != stale.name) {
+					return;
+				}
+				_bytes -= i->second.size;
+				_entries.erase(i);
+				_stats.bytes = _bytes;
+				_stats.entries = _entries.size();
+			}
+			_discard(loop, stale.name);
+		}
+
+		// Starts storing a response whose headers just arrived, or returns
+		//   nullptr when it shouldn't be cached: anything but a 200, no-store,
+		//   Vary: *, too large, or neither a validator nor a lifetime.
+		Writer * store(uvpp::EventLoop& loop, const std::string& url, const http::Response& response) {
+			if (response.statusCode != 200) {
+				return nullptr;
+			}
+			if (response.cacheControl.noStore || response.header("Vary").contains('*')) {
+				return nullptr;
+			}
+			int64_t lifetime = http::freshnessLifetime(response);
+			if (lifetime <= 0 && !response.etag().valid() && !response.header("Last-Modified").valid()) {
+				return nullptr;
+			}
+			uint64_t maxSize = _maxBytes / 4;
+			if (response.contentLength > 0 && (uint64_t)response.contentLength > maxSize) {
+				return nullptr;
+			}
+
+			Entry entry;
+			entry.url = url;
+			for (size_t h = 0; h < response.headerCount(); ++h) {
+				if (i::isStoredHeader(response.headerName(h))) {
+					entry.headers.emplace_back(response.headerName(h).str(), response.headerValue(h).str());
+				}
+			}
+			entry.expires = _expiry(lifetime);
+			{
+				uvpp::ScopedLock lock(_mutex);
+				char name[40];
+				sprintf(name, "%016llx-%08llx", (unsigned long long)i::hashUrl(url), (unsigned long long)_nextVersion++);
+				entry.name = name;
+			}
+
+			Writer *writer = new Writer(*this, loop, entry, maxSize);
+			if (!writer->open(_bodyPath(entry))) {
+				delete writer;
+				return nullptr;
+			}
+			return writer;
+		}
+
+		std::string bodyPath(const Entry& entry) const {
+			return _bodyPath(entry);
+		}
+
+		Stats stats() {
+			uvpp::ScopedLock lock(_mutex);
+			return _stats;
+		}
+
+	private:
+		friend class Writer;
+		friend class HeaderWriter;
+
+		// Wall-clock expiry for a lifetime from http::freshnessLifetime; a
+		//   response without one is stored stale, for revalidation.
+		static int64_t _expiry(int64_t lifetime) {
+			if (lifetime <= 0) {
+				return 0;
+			}
+			return (int64_t)time(nullptr) + lifetime;
+		}
+
+		std::string _bodyPath(const Entry& entry) const {
+			return _dir + "/" + entry.name + ".body";
+		}
+
+		std::string _headerPath(const Entry& entry) const {
+			return _dir + "/" + entry.name + ".hdr";
+		}
+
+		// New validators and expiry from a 304; the body stays.
+		void _refresh(Entry& entry, const http::Response& notModified) {
+			for (size_t h = 0; h < notModified.headerCount(); ++h) {
+				http::StringRef name = notModified.headerName(h);
+				if (!i::isStoredHeader(name)) {
+					continue;
+				}
+				bool replaced = false;
+				for (auto& stored : entry.headers) {
+					if (name.equalsIgnoreCase(stored.first.c_str())) {
+						stored.second = notModified.headerValue(h).str();
+						replaced = true;
+						break;
+					}
+				}
+				if (!replaced) {
+					entry.headers.emplace_back(name.str(), notModified.headerValue(h).str());
+				}
+			}
+			entry.expires = _expiry(entry.freshnessLifetime());
+			entry.lastUsed = ++_clock;
+		}
+
+		// Called by a Writer on its loop once the body is on disk.  The
+		//   entry is served from now on; its header follows, and if that
+		//   can't be written the entry goes again.
+		void _commit(uvpp::EventLoop& loop, const Entry& stored) {
+			Entry entry = stored;
+			std::vector<std::string> dropped;
+			{
+				uvpp::ScopedLock lock(_mutex);
+				entry.lastUsed = ++_clock;
+				auto existing = _entries.find(entry.url);
+				if (existing != _entries.end()) {
+					dropped.push_back(existing->second.name);
+					_bytes -= existing->second.size;
+				}
+				_bytes += entry.size;
+				_entries[entry.url] = entry;
+				++_stats.stores;
+
+				_evict(entry.url, dropped);
+				_stats.bytes = _bytes;
+				_stats.entries = _entries.size();
+			}
+			_writeHeader(loop, entry);
+			for (auto& name : dropped) {
+				_discard(loop, name);
+			}
+		}
+
+		void _abandon(uvpp::EventLoop& loop, const Entry& entry) {
+			_discard(loop, entry.name);
+		}
+
+		// A header that never made it to disk would leave the entry to
+		//   be thrown away by the next open() anyway; drop it now, unless
+		//   a newer version has replaced it meanwhile.
+		void _headerFailed(uvpp::EventLoop& loop, const Entry& entry) {
+			{
+				uvpp::ScopedLock lock(_mutex);
+				auto found = _entries.find(entry.url);
+				if (found == _entries.end() || found->second.name != entry.name) {
+					return;
+				}
+				_bytes -= found->second.size;
+				_entries.erase(found);
+				_stats.bytes = _bytes;
+				_stats.entries = _entries.size();
+			}
+			_discard(loop, entry.name);
+		}
+
+		// Drops least recently used entries until the cache fits, sparing
+		//   the one just stored.  The caller deletes the dropped files once
+		//   it has let go of the lock.
+		void _evict(const std::string& spare, std::vector<std::string>& dropped) {
+			if (_bytes <= _maxBytes) {
+				return;
+			}
+			std::vector<std::pair<uint64_t, std::string>> order;
+			for (auto& i : _entries) {
+				if (i.first != spare) {
+					order.emplace_back(i.second.lastUsed, i.first);
+				}
+			}
+			std::sort(order.begin(), order.end());
+			for (auto& i : order) {
+				if (_bytes <= _maxBytes) {
+					break;
+				}
+				auto entry = _entries.find(i.second);
+				dropped.push_back(entry->second.name);
+				_bytes -= entry->second.size;
+				_entries.erase(entry);
+				++_stats.evictions;
+			}
+		}
+
+		// A body still mapped elsewhere can't be deleted on Windows; the
+		//   leftover is cleared by the next open().
+		void _discard(uvpp::EventLoop& loop, const std::string& name) {
+			uvpp::FileOp::unlink(loop, _dir + "/" + name + ".hdr");
+			uvpp::FileOp::unlink(loop, _dir + "/" + name + ".body");
+		}
+
+		void _unlink(const std::string& path) {
+			uv_fs_t req;
+			uv_fs_unlink(&_fsLoop, &req, path.c_str(), nullptr);
+			uv_fs_req_cleanup(&req);
+		}
+
+		bool _statBody(const Entry& entry, double& mtime) {
+			uv_fs_t req;
+			int32_t result = uv_fs_stat(&_fsLoop, &req, _bodyPath(entry).c_str(), nullptr);
+			uint64_t size = (uint64_t)req.statbuf.st_size;
+			mtime = (double)req.statbuf.st_mtim.tv_sec + req.statbuf.st_mtim.tv_nsec / 1e9;
+			uv_fs_req_cleanup(&req);
+			return result >= 0 && size == entry.size;
+		}
+
+		// Magic, URL, expiry, body size, headers, then a lone "." so a
+		//   header cut short by a crash is recognisable.  Each write gets a
+		//   scratch file of its own, so concurrent refreshes can't
+		//   interleave; open() sweeps up any a crash left behind.
+		void _writeHeader(uvpp::EventLoop& loop, const Entry& entry) {
+			uint64_t scratchId;
+			{
+				uvpp::ScopedLock lock(_mutex);
+				scratchId = ++_nextScratch;
+			}
+			std::string path = _headerPath(entry);
+			std::string scratch = path + "." + std::to_string((unsigned long long)scratchId);
+			HeaderWriter *writer = new HeaderWriter(*this, loop, entry, scratch, path);
+			if (!writer->open(scratch)) {
+				delete writer;
+				_headerFailed(loop, entry);
+				return;
+			}
+			std::string text = _headerText(entry);
+			writer->write(text.data(), text.size());
+			writer->finish();
+		}
+
+		static std::string _headerText(const Entry& entry) {
+			std::string text;
+			text.append(i::kHeaderMagic).append("\n");
+			text.append(entry.url).append("\n");
+			text.append(std::to_string((long long)entry.expires)).append("\n");
+			text.append(std::to_string((unsigned long long)entry.size)).append("\n");
+			for (auto& i : entry.headers) {
+				text.append(i.first).append(": ").append(i.second).append("\n");
+			}
+			text.append(".\n");
+			return text;
+		}
+
+		bool _readHeader(Entry& entry) {
+			uv_fs_t req;
+			int32_t file = uv_fs_open(&_fsLoop, &req, _headerPath(entry).c_str(), O_RDONLY, 0, nullptr);
+			uv_fs_req_cleanup(&req);
+			if (file < 0) {
+				return false;
+			}
+			std::string text;
+			char chunk[4096];
+			while (true) {
+				uv_buf_t buf = uv_buf_init(chunk, sizeof(chunk));
+				int32_t read = uv_fs_read(&_fsLoop, &req, file, &buf, 1, (int64_t)text.size(), nullptr);
+				uv_fs_req_cleanup(&req);
+				if (read <= 0) {
+					break;
+				}
+				text.append(chunk, read);
+			}
+			uv_fs_close(&_fsLoop, &req, file, nullptr);
+			uv_fs_req_cleanup(&req);
+
+			std::vector<std::string> lines;
+			size_t pos = 0;
+			while (pos < text.size()) {
+				size_t end = text.find('\n', pos);
+				if (end == std::string::npos) {
+					return false;
+				}
+				lines.push_back(text.substr(pos, end - pos));
+				pos = end + 1;
+			}
+			if (lines.size() < 5 || lines[0] != i::kHeaderMagic || lines.back() != ".") {
+				return false;
+			}
+			entry.url = lines[1];
+			entry.expires = strtoll(lines[2].c_str(), nullptr, 10);
+			entry.size = strtoull(lines[3].c_str(), nullptr, 10);
+			for (size_t n = 4; n + 1 < lines.size(); ++n) {
+				size_t colon = lines[n].find(": ");
+				if (colon == std::string::npos) {
+					return false;
+				}
+				entry.headers.emplace_back(lines[n].substr(0, colon), lines[n].substr(colon + 2));
+			}
+			return true;
+		}
+
+		std::string _dir;
+		uint64_t _maxBytes;
+		uvpp::Mutex _mutex;
+		uv_loop_t _fsLoop;
+		std::unordered_map<std::string, Entry> _entries;
+		uint64_t _bytes;
+		uint64_t _clock;
+		uint64_t _nextVersion;
+		uint64_t _nextScratch;
+		Stats _stats;
+
+	};
+
+	void Writer::append(const void *data, size_t len) {
+		if (_aborted) {
+			return;
+		}
+		if (size() + len > _maxSize) {
+			_aborted = true;
+			return;
+		}
+		write(data, len);
+	}
+
+	void Writer::onFinish(int32_t status) {
+		if (status < 0 || _aborted) {
+			_cache._abandon(loop(), _entry);
+		} else {
+			_entry.size = size();
+			_cache._commit(loop(), _entry);
+		}
+		delete this;
+	}
+
+	void HeaderWriter::onFinish(int32_t status) {
+		uvpp::EventLoop& eventLoop = loop();
+		Cache& cache = _cache;
+		Entry entry = _entry;
+		if (status < 0) {
+			uvpp::FileOp::unlink(eventLoop, _scratch);
+			cache._headerFailed(eventLoop, entry);
+		} else {
+			uvpp::FileOp::rename(eventLoop, _scratch, _path, [&eventLoop, &cache, entry](int32_t result) {
+				if (result < 0) {
+					cache._headerFailed(eventLoop, entry);
+				}
+			});
+		}
+		delete this;
+	}
+}
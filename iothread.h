@@ -1,51 +1,694 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include "uvpp.h"
 #include "uvhttp.h"
+#include "dns.h"
+#include "httpcache.h"
+#include "metrics.h"
+#include "websocket.h"
 
 namespace iothread {
+	enum class Priority : uint32_t {
+		Critical,
+		Visible,
+		Prefetch,
+		Count
+	};
+
+	class _WorkerThread;
+
 	class WorkerRequest {
+		friend class _WorkerThread;
+		friend class _Outbox;
+		friend class Scheduler;
+		friend uint32_t dispatch(WorkerRequest*, Priority);
+		friend void dispatchCpu(WorkerRequest*);
+
 	public:
+		WorkerRequest()
+			: _id(0), _priority(Priority::Visible), _rank(0.0f), _worker(nullptr), _timeoutMs(0), _cancelled(false) {
+			_link.request = this;
+			_link.final = true;
+			_link.backlogged = false;
+			_progressLink.request = this;
+			_progressLink.final = false;
+			_progressLink.backlogged = false;
+		}
+
 		virtual void execute() = 0;
 		virtual void onComplete() = 0;
 
+		// Main thread; runs for each progress notification posted before
+		//   completion, in order.
+		virtual void onProgress() {
+		}
+
+		// Requests with a key are queued by priority and limited per key;
+		//   the rest execute as soon as they reach the IO thread.  Requests
+		//   sharing a key always go to the same IO loop.  Called once, on the
+		//   dispatching thread.
+		virtual std::string schedulingKey() const {
+			return std::string();
+		}
+
+		uint32_t id() const {
+			return _id;
+		}
+
+		// Main thread, before dispatch.  A cancellable request still running
+		//   timeoutMs after it reaches its loop is cancelled with
+		//   UV_ETIMEDOUT.  0 means no deadline.
+		void setTimeout(uint64_t timeoutMs) {
+			_timeoutMs = timeoutMs;
+		}
+
+		// Main thread, before dispatch.  Orders a keyed request among the
+		//   queued ones of its priority; lower ranks start first and equal
+		//   ranks keep dispatch order.  0 by default.
+		void setRank(float rank) {
+			_rank = rank;
+		}
+
+		// Main thread.  Set by the time onComplete runs if iothread::cancel
+		//   got to the request first; onComplete should then just free it.
+		bool cancelled() const {
+			return _cancelled;
+		}
+
+	protected:
+		// Requests that can stop part way return true and implement cancel.
+		virtual bool cancellable() const {
+			return false;
+		}
+
+		// IO thread.  Stop as soon as possible and complete with code,
+		//   either UV_ECANCELED or UV_ETIMEDOUT.  Called at most once, and
+		//   never after the request has completed.
+		virtual void cancel(int32_t code) {
+		}
+
+		// IO loop the request was dispatched to; valid from execute() on.
+		_WorkerThread& worker() const {
+			return *_worker;
+		}
+
+	private:
+		// _link carries the request to its loop and its completion back;
+		//   the two never overlap.  Progress has its own link because a
+		//   progress notification can still be queued when completion is.
+		struct _Link : uvpp::MpscNode {
+			WorkerRequest *request;
+			bool final;
+			// Stamped by the producer, read by poll() on the main thread.
+			Priority priority;
+			// Main thread; set while waiting in poll()'s backlog.
+			bool backlogged;
+		};
+
+		uint32_t _id;
+		Priority _priority;
+		float _rank;
+		std::string _key;
+		_WorkerThread *_worker;
+		uint64_t _timeoutMs;
+		bool _cancelled;
+		_Link _link;
+		_Link _progressLink;
+
 	};
 
-	class _WorkerThread : public uvpp::Thread {
-		friend class WorkerRequest;
+	struct PriorityChange {
+		PriorityChange(uint32_t id, Priority priority, float rank)
+			: id(id), priority(priority), rank(rank) {
+		}
+
+		uint32_t id;
+		Priority priority;
+		float rank;
+	};
 
+	// Orders keyed requests by priority, then rank, and caps how many run
+	//   at once, both overall and per key.  A request counts as running
+	//   from execute() until its completion is dispatched.  Prefetches are
+	//   held to a smaller share of both caps so they can never fill every
+	//   slot ahead of visible work.  IO-thread only.
+	class Scheduler {
 	public:
-		_WorkerThread()
-			: _signalEvent(*this, _eventLoop) {
+		Scheduler(size_t maxActive = 16, size_t maxPerKey = 6)
+			: _maxActive(maxActive), _maxPerKey(maxPerKey), _activeCount(0), _pumping(false), _repump(false) {
 		}
 
-		void dispatch(WorkerRequest *request) {
-				{
-					uvpp::ScopedLock lock(_inMutex);
-					_requestsIn.push_back(request);
+		void submit(WorkerRequest *request) {
+			if (request->_key.empty()) {
+				return request->execute();
+			}
+			_enqueue(Entry(request, request->_key));
+			_pump();
+		}
+
+		// Moves a still-queued request to its rank's place in another
+		//   class.  Requests already running keep their slot.
+		void setPriority(uint32_t id, Priority priority, float rank) {
+			for (auto& queue : _queues) {
+				for (auto i = queue.begin(); i != queue.end(); ++i) {
+					if (i->request->_id != id) {
+						continue;
+					}
+					Entry entry = *i;
+					queue.erase(i);
+					entry.request->_priority = priority;
+					entry.request->_rank = rank;
+					_enqueue(entry);
+					return _pump();
+				}
+			}
+		}
+
+		// setPriority for many requests in one pass over the queues;
+		//   changes for requests not queued here are ignored.
+		void reorder(const std::vector<PriorityChange>& changes) {
+			std::unordered_map<uint32_t, const PriorityChange*> byId;
+			for (auto& i : changes) {
+				byId[i.id] = &i;
+			}
+			std::vector<Entry> moved;
+			for (auto& queue : _queues) {
+				std::deque<Entry> kept;
+				for (auto& entry : queue) {
+					auto found = byId.find(entry.request->_id);
+					if (found == byId.end()) {
+						kept.push_back(entry);
+						continue;
+					}
+					entry.request->_priority = found->second->priority;
+					entry.request->_rank = found->second->rank;
+					moved.push_back(entry);
+				}
+				queue.swap(kept);
+			}
+			if (moved.empty()) {
+				return;
+			}
+			std::stable_sort(moved.begin(), moved.end(), _byRank);
+			for (size_t p = 0; p < (size_t)Priority::Count; ++p) {
+				std::deque<Entry> merged;
+				auto begin = moved.begin();
+				auto end = std::stable_partition(begin, moved.end(), [p](const Entry& entry) {
+					return (size_t)entry.request->_priority == p;
+				});
+				if (begin == end) {
+					continue;
+				}
+				std::merge(_queues[p].begin(), _queues[p].end(), begin, end, std::back_inserter(merged), _byRank);
+				_queues[p].swap(merged);
+				moved.erase(begin, end);
+			}
+			_pump();
+		}
+
+		// Takes a request out of the queue before it starts; false if it
+		//   isn't queued here.
+		bool remove(uint32_t id) {
+			for (auto& queue : _queues) {
+				for (auto i = queue.begin(); i != queue.end(); ++i) {
+					if (i->request->_id == id) {
+						queue.erase(i);
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+
+		size_t active() const {
+			return _activeCount;
+		}
+
+		size_t queued() const {
+			size_t count = 0;
+			for (auto& queue : _queues) {
+				count += queue.size();
+			}
+			return count;
+		}
+
+		void finished(uint32_t id) {
+			auto foundI = _active.find(id);
+			if (foundI == _active.end()) {
+				return;
+			}
+			--_activeCount;
+			if (--_keyCounts[foundI->second] == 0) {
+				_keyCounts.erase(foundI->second);
+			}
+			_active.erase(foundI);
+			_pump();
+		}
+
+	private:
+		struct Entry {
+			Entry(WorkerRequest *request, const std::string& key)
+				: request(request), key(key) {
+			}
+
+			WorkerRequest *request;
+			std::string key;
+		};
+
+		static bool _byRank(const Entry& a, const Entry& b) {
+			return a.request->_rank < b.request->_rank;
+		}
+
+		// Queues stay sorted by rank; a new entry goes after its equals.
+		void _enqueue(const Entry& entry) {
+			std::deque<Entry>& queue = _queues[(size_t)entry.request->_priority];
+			auto i = queue.end();
+			while (i != queue.begin() && (i - 1)->request->_rank > entry.request->_rank) {
+				--i;
+			}
+			queue.insert(i, entry);
+		}
+
+		size_t _activeLimit(Priority priority) const {
+			if (priority == Priority::Prefetch) {
+				return _maxActive - _maxActive / 4;
+			}
+			return _maxActive;
+		}
+
+		size_t _keyLimit(Priority priority) const {
+			if (priority == Priority::Prefetch && _maxPerKey > 1) {
+				return _maxPerKey - 1;
+			}
+			return _maxPerKey;
+		}
+
+		// execute() can finish a request synchronously, which lands back
+		//   here through finished(); that just asks for another pass.
+		void _pump() {
+			if (_pumping) {
+				_repump = true;
+				return;
+			}
+			_pumping = true;
+			do {
+				_repump = false;
+				for (size_t p = 0; p < (size_t)Priority::Count; ++p) {
+					auto& queue = _queues[p];
+					for (auto i = queue.begin(); i != queue.end() && _activeCount < _activeLimit((Priority)p);) {
+						if (_keyCounts[i->key] >= _keyLimit((Priority)p)) {
+							++i;
+							continue;
+						}
+						Entry entry = *i;
+						i = queue.erase(i);
+						++_activeCount;
+						++_keyCounts[entry.key];
+						_active[entry.request->_id] = entry.key;
+						entry.request->execute();
+					}
+				}
+			} while (_repump);
+			_pumping = false;
+		}
+
+		size_t _maxActive;
+		size_t _maxPerKey;
+		size_t _activeCount;
+		bool _pumping;
+		bool _repump;
+		std::deque<Entry> _queues[(size_t)Priority::Count];
+		std::unordered_map<std::string, size_t> _keyCounts;
+		std::unordered_map<uint32_t, std::string> _active;
+
+	};
+
+	struct PollStats {
+		PollStats()
+			: lastPollNs(0), maxPollNs(0), lastDelivered(0), backlog(0), overBudget(0) {
+		}
+
+		uint64_t lastPollNs;
+		uint64_t maxPollNs;
+		uint32_t lastDelivered;
+		// Notifications left for later frames after the last poll.
+		size_t backlog;
+		// Polls that stopped early because the budget ran out.
+		uint64_t overBudget;
+	};
+
+	// Completions and progress notifications from every IO loop and CPU
+	//   worker, drained on the main thread by poll().  A full outbox stalls
+	//   the producing thread until the main thread catches up, which also
+	//   stops an IO loop reading more data it has no room to deliver.
+	class _Outbox {
+	public:
+		static const size_t kCapacity = 4096;
+
+		_Outbox()
+			: _queue(kCapacity), _closing(false), _backlogSize(0) {
+		}
+
+		void push(WorkerRequest *request, bool final) {
+			WorkerRequest::_Link *link = final ? &request->_link : &request->_progressLink;
+			link->priority = request->_priority;
+			while (!_queue.push(link)) {
+				if (_closing.load()) {
+					return;
+				}
+				std::this_thread::yield();
+			}
+		}
+
+		// Empties the queue into the backlog, then delivers most urgent first
+		//   until budgetNs is spent.  At least one notification goes out per
+		//   call so a slow callback can't stall delivery entirely.
+		void poll(uint64_t budgetNs) {
+			uint64_t start = uv_hrtime();
+			while (uvpp::MpscNode *node = _queue.pop()) {
+				_backlog(static_cast<WorkerRequest::_Link*>(node));
+			}
+
+			uint32_t delivered = 0;
+			bool overBudget = false;
+			for (size_t p = 0; p < (size_t)Priority::Count; ++p) {
+				std::deque<WorkerRequest::_Link*>& ready = _ready[p];
+				while (!ready.empty()) {
+					if (delivered > 0 && uv_hrtime() - start >= budgetNs) {
+						overBudget = true;
+						break;
+					}
+					WorkerRequest::_Link *link = ready.front();
+					ready.pop_front();
+					--_backlogSize;
+					link->backlogged = false;
+					++delivered;
+					WorkerRequest *request = link->request;
+					// onComplete usually deletes the request.
+					if (link->final) {
+						_live.erase(request->_id);
+						request->_cancelled = _cancelledIds.erase(request->_id) > 0;
+						request->onComplete();
+					} else if (_cancelledIds.find(request->_id) == _cancelledIds.end()) {
+						request->onProgress();
+					}
 				}
-			_signalEvent.signal();
+				if (overBudget) {
+					break;
+				}
+			}
+
+			_stats.lastPollNs = uv_hrtime() - start;
+			_stats.maxPollNs = std::max(_stats.maxPollNs, _stats.lastPollNs);
+			_stats.lastDelivered = delivered;
+			_stats.backlog = _backlogSize;
+			if (overBudget) {
+				++_stats.overBudget;
+			}
+		}
+
+		const PollStats& stats() const {
+			return _stats;
+		}
+
+		// Main thread.  Requests dispatched and not yet completed.
+		size_t live() const {
+			return _live.size();
+		}
+
+		// Main thread.  A request is live from dispatch until its completion
+		//   is delivered; worker is its loop, nullptr on the CPU pool.
+		void track(WorkerRequest *request, _WorkerThread *worker) {
+			_live[request->_id] = worker;
+		}
+
+		// Main thread.  Returns false if id is no longer live.
+		bool find(uint32_t id, _WorkerThread *& worker) const {
+			auto found = _live.find(id);
+			if (found == _live.end()) {
+				return false;
+			}
+			worker = found->second;
+			return true;
+		}
+
+		// Main thread.  Returns false if id is no longer live.
+		bool markCancelled(uint32_t id, _WorkerThread *& worker) {
+			auto found = _live.find(id);
+			if (found == _live.end()) {
+				return false;
+			}
+			worker = found->second;
+			_cancelledIds.insert(id);
+			return true;
+		}
+
+		// Nothing drains the outbox once shutdown starts; producers drop
+		//   what doesn't fit rather than wait forever.
+		void close() {
+			_closing.store(true);
+		}
+
+		const uvpp::MpscQueue& queue() const {
+			return _queue;
+		}
+
+	private:
+		// A completion joins its request's waiting progress notification
+		//   so it can never be delivered ahead of it, even if the
+		//   request's priority changed in between.
+		void _backlog(WorkerRequest::_Link *link) {
+			Priority priority = link->priority;
+			WorkerRequest::_Link& progress = link->request->_progressLink;
+			if (link->final && progress.backlogged) {
+				priority = progress.priority;
+			}
+			link->backlogged = true;
+			_ready[(size_t)priority].push_back(link);
+			++_backlogSize;
+		}
+
+		uvpp::MpscQueue _queue;
+		std::atomic<bool> _closing;
+		std::deque<WorkerRequest::_Link*> _ready[(size_t)Priority::Count];
+		size_t _backlogSize;
+		PollStats _stats;
+		std::unordered_map<uint32_t, _WorkerThread*> _live;
+		std::unordered_set<uint32_t> _cancelledIds;
+
+	};
+	_Outbox *_outbox = nullptr;
+
+	// Fixed set of threads for CPU-bound work such as decoding and mesh
+	//   optimisation, so it never holds up socket servicing on an IO loop.
+	//   Queued tasks still run during shutdown.
+	class _CpuPool {
+	public:
+		typedef std::function<void()> Task;
+
+		_CpuPool(size_t count)
+			: _stopping(false) {
+			for (size_t i = 0; i < count; ++i) {
+				_workers.push_back(new _Worker(*this));
+				_workers.back()->start();
+			}
+		}
+
+		~_CpuPool() {
+			{
+				uvpp::ScopedLock lock(_mutex);
+				_stopping = true;
+			}
+			_cond.broadcast();
+			for (auto& i : _workers) {
+				i->join();
+				delete i;
+			}
 		}
 
-		void poll() {
-			std::vector<WorkerRequest*> requests;
+		void post(Task task) {
 			{
-				uvpp::ScopedLock lock(_outMutex);
-				requests = std::move(_requestsOut);
+				uvpp::ScopedLock lock(_mutex);
+				_tasks.push_back(std::move(task));
+			}
+			_cond.signal();
+		}
+
+	private:
+		class _Worker : public uvpp::Thread {
+		public:
+			_Worker(_CpuPool& owner)
+				: _owner(owner) {
+			}
+			void threadExec() override {
+				_owner._run();
+			}
+		private:
+			_CpuPool& _owner;
+		};
+
+		void _run() {
+			while (true) {
+				Task task;
+				{
+					uvpp::ScopedLock lock(_mutex);
+					while (_tasks.empty() && !_stopping) {
+						_cond.wait(_mutex);
+					}
+					if (_tasks.empty()) {
+						return;
+					}
+					task = std::move(_tasks.front());
+					_tasks.pop_front();
+				}
+				task();
+			}
+		}
+
+		uvpp::Mutex _mutex;
+		uvpp::Condition _cond;
+		bool _stopping;
+		std::deque<Task> _tasks;
+		std::vector<_Worker*> _workers;
+
+	};
+	_CpuPool *_cpuPool = nullptr;
+	httpcache::Cache *_httpCache = nullptr;
+
+	// Exported through metrics::registry() by Init.  The loop-side gauges
+	//   are sums over all loops, each loop adding the change in its own
+	//   share.
+	namespace _metrics {
+		const double kPollBoundsMs[] = { 0.25, 0.5, 1, 2, 4, 8, 16 };
+
+		metrics::Histogram pollMs(kPollBoundsMs, sizeof(kPollBoundsMs) / sizeof(kPollBoundsMs[0]));
+		metrics::Counter delivered;
+		metrics::Counter overBudget;
+		metrics::Gauge backlog;
+		metrics::Gauge overflow;
+		metrics::Gauge live;
+		metrics::Gauge active;
+		metrics::Gauge queued;
+		metrics::Gauge bufferBytes;
+	}
+
+	// One IO loop and its thread.  Each loop has its own DNS cache,
+	//   connection pool and scheduler; requests are spread across loops by
+	//   dispatch().
+	class _WorkerThread : public uvpp::Thread {
+	public:
+		static const size_t kInboxCapacity = 1024;
+
+		_WorkerThread(size_t maxActive)
+			: _inbox(kInboxCapacity), _signalEvent(*this, _eventLoop), _dnsCache(_eventLoop), _httpPool(_eventLoop),
+			_scheduler(maxActive), _deadlineTimer(*this), _spilled(0), _publishedActive(0), _publishedQueued(0),
+			_publishedBufferBytes(0) {
+		}
+
+		// Main thread only.  When the inbox is full, requests wait in a
+		//   main-thread list, in order, until flush() finds room.
+		void dispatch(WorkerRequest *request) {
+			request->_worker = this;
+			if (_overflow.empty() && _inbox.push(&request->_link)) {
+				_signalEvent.signal();
+				return;
 			}
+			++_spilled;
+			_overflow.push_back(request);
+		}
 
-			for (auto& i : requests) {
-				i->onComplete();
+		// Main thread only; returns true once nothing is held back.
+		bool flush() {
+			bool pushed = false;
+			while (!_overflow.empty() && _inbox.push(&_overflow.front()->_link)) {
+				_overflow.pop_front();
+				pushed = true;
+			}
+			if (pushed) {
+				_signalEvent.signal();
 			}
+			return _overflow.empty();
+		}
+
+		const uvpp::MpscQueue& inbox() const {
+			return _inbox;
+		}
+
+		// Requests that had to wait for inbox room.
+		uint64_t spilled() const {
+			return _spilled;
+		}
+
+		// Main thread only.  Requests waiting for inbox room right now.
+		size_t overflow() const {
+			return _overflow.size();
 		}
 
 		uvpp::EventLoop& loop() {
 			return _eventLoop;
 		}
 
+		dns::Cache& dnsCache() {
+			return _dnsCache;
+		}
+
+		http::Pool& httpPool() {
+			return _httpPool;
+		}
+
+		Scheduler& scheduler() {
+			return _scheduler;
+		}
+
+		// IO-thread completion.  The main thread may free request as soon as
+		//   it is queued, so the scheduler is told by id afterwards.
 		void _dispatchCompletion(WorkerRequest *request) {
-			uvpp::ScopedLock lock(_outMutex);
-			_requestsOut.push_back(request);
+			uint32_t id = request->_id;
+			_cancellable.erase(id);
+			_outbox->push(request, true);
+			_scheduler.finished(id);
+			_publishStats();
+		}
+
+		// Moves the rest of request's work to the CPU pool and frees its
+		//   scheduler slot; task must end by calling iothread::complete.
+		//   Past this point the request can no longer be cancelled here.
+		void _handoff(WorkerRequest *request, _CpuPool::Task task) {
+			uint32_t id = request->_id;
+			_cancellable.erase(id);
+			_cpuPool->post(std::move(task));
+			_scheduler.finished(id);
+			_publishStats();
+		}
+
+		// Loop thread.  Ignored once the request has completed or moved on
+		//   to the CPU pool.
+		void cancel(uint32_t id, int32_t code) {
+			auto found = _cancellable.find(id);
+			if (found == _cancellable.end()) {
+				return;
+			}
+			WorkerRequest *request = found->second;
+			_cancellable.erase(found);
+			_scheduler.remove(id);
+			request->cancel(code);
+		}
+
+		// Loop thread.  A cancellable request that is still running, or
+		//   nullptr.
+		WorkerRequest * find(uint32_t id) {
+			auto found = _cancellable.find(id);
+			return found != _cancellable.end() ? found->second : nullptr;
 		}
 
 	private:
@@ -54,14 +697,54 @@ namespace iothread {
 		}
 
 		void _grabRequests() {
-			std::vector<WorkerRequest*> requests;
-			{
-				uvpp::ScopedLock lock(_inMutex);
-				requests = std::move(_requestsIn);
+			while (uvpp::MpscNode *node = _inbox.pop()) {
+				WorkerRequest *request = static_cast<WorkerRequest::_Link*>(node)->request;
+				if (request->cancellable()) {
+					_cancellable[request->_id] = request;
+					if (request->_timeoutMs > 0) {
+						_deadlines.emplace(_eventLoop.now() + request->_timeoutMs, request->_id);
+						_armDeadlines();
+					}
+				}
+				_scheduler.submit(request);
+			}
+			_publishStats();
+		}
+
+		// Loop-local numbers are only readable here, so each loop adds
+		//   the change in its own share to the shared gauges.
+		void _publishStats() {
+			int64_t active = (int64_t)_scheduler.active();
+			int64_t queued = (int64_t)_scheduler.queued();
+			int64_t bufferBytes = (int64_t)_eventLoop.bufferPool().stats().bytesInFlight;
+			_metrics::active.add(active - _publishedActive);
+			_metrics::queued.add(queued - _publishedQueued);
+			_metrics::bufferBytes.add(bufferBytes - _publishedBufferBytes);
+			_publishedActive = active;
+			_publishedQueued = queued;
+			_publishedBufferBytes = bufferBytes;
+		}
+
+		// One timer for every deadline on the loop, set for the earliest.
+		//   Deadlines of requests that finished in time are dropped when
+		//   they come up.
+		void _armDeadlines() {
+			if (_deadlines.empty()) {
+				return _deadlineTimer.stop();
 			}
-			for (auto& i : requests) {
-				i->execute();
+			uint64_t now = _eventLoop.now();
+			uint64_t first = _deadlines.begin()->first;
+			_deadlineTimer.start(first > now ? first - now : 0);
+		}
+
+		void _expireDeadlines() {
+			uint64_t now = _eventLoop.now();
+			while (!_deadlines.empty() && _deadlines.begin()->first <= now) {
+				uint32_t id = _deadlines.begin()->second;
+				_deadlines.erase(_deadlines.begin());
+				cancel(id, UV_ETIMEDOUT);
 			}
+			_armDeadlines();
 		}
 
 		class _NewRequestEvent : public uvpp::Event {
@@ -76,98 +759,1329 @@ namespace iothread {
 			_WorkerThread& _owner;
 		};
 
+		class _DeadlineTimer : public uvpp::Timer {
+		public:
+			_DeadlineTimer(_WorkerThread& owner)
+				: uvpp::Timer(owner._eventLoop), _owner(owner) {
+			}
+			virtual void onTimer() override {
+				_owner._expireDeadlines();
+			}
+		private:
+			_WorkerThread& _owner;
+		};
+
 		uvpp::EventLoop _eventLoop;
-		uvpp::Mutex _inMutex;
-		uvpp::Mutex _outMutex;
+		uvpp::MpscQueue _inbox;
 		_NewRequestEvent _signalEvent;
-		std::vector<class WorkerRequest*> _requestsIn;
-		std::vector<class WorkerRequest*> _requestsOut;
+		dns::Cache _dnsCache;
+		http::Pool _httpPool;
+		Scheduler _scheduler;
+		std::unordered_map<uint32_t, WorkerRequest*> _cancellable;
+		std::multimap<uint64_t, uint32_t> _deadlines;
+		_DeadlineTimer _deadlineTimer;
+		std::deque<WorkerRequest*> _overflow;
+		uint64_t _spilled;
+		int64_t _publishedActive;
+		int64_t _publishedQueued;
+		int64_t _publishedBufferBytes;
 
 	};
-	_WorkerThread *_thread = nullptr;
+	std::vector<_WorkerThread*> _threads;
+	uint32_t _nextId = 0;
+	size_t _nextThread = 0;
+
+	// Total in-flight keyed requests across all loops.
+	const size_t kMaxActive = 16;
+
+	bool _metricsRegistered = false;
+
+	// Queue depths are atomics and safe to read from the server's loop.
+	//   Everything else is pushed into _metrics by the thread that owns it.
+	void _registerMetrics() {
+		if (_metricsRegistered) {
+			return;
+		}
+		_metricsRegistered = true;
+		metrics::Registry& r = metrics::registry();
+		r.add("four_io_poll_ms", "Time spent delivering IO completions per frame", _metrics::pollMs);
+		r.add("four_io_delivered_total", "Completions and progress notifications delivered", _metrics::delivered);
+		r.add("four_io_over_budget_total", "Polls that ran out of frame budget", _metrics::overBudget);
+		r.add("four_io_poll_backlog", "Notifications left for later frames", _metrics::backlog);
+		r.add("four_io_overflow", "Requests waiting for room in an IO loop inbox", _metrics::overflow);
+		r.add("four_io_live_requests", "Requests dispatched and not yet completed", _metrics::live);
+		r.add("four_io_active_requests", "Scheduled requests running on IO loops", _metrics::active);
+		r.add("four_io_queued_requests", "Scheduled requests waiting for a slot", _metrics::queued);
+		r.add("four_io_buffer_bytes", "Socket and write buffers in use on IO loops", _metrics::bufferBytes);
+		r.addReader("four_io_outbox_depth", "Notifications waiting in the outbox", []() {
+			return _outbox ? (double)_outbox->queue().depth() : 0.0;
+		});
+		r.addReader("four_io_outbox_full_total", "Times a producer found the outbox full", []() {
+			return _outbox ? (double)_outbox->queue().fullCount() : 0.0;
+		});
+		for (size_t i = 0; i < _threads.size(); ++i) {
+			std::string labels = "loop=\"" + std::to_string(i) + "\"";
+			r.addReader("four_io_inbox_depth", "Requests waiting in an IO loop inbox", [i]() {
+				return i < _threads.size() ? (double)_threads[i]->inbox().depth() : 0.0;
+			}, labels);
+			r.addReader("four_io_inbox_high_water", "Deepest an IO loop inbox has been", [i]() {
+				return i < _threads.size() ? (double)_threads[i]->inbox().highWater() : 0.0;
+			}, labels);
+		}
+	}
 
 	class KillRequest : public WorkerRequest {
 	private:
 		void execute() {
-			_thread->loop().stop();
+			worker().loop().stop();
+			delete this;
 		}
 		void onComplete() { }
 	};
 
-	void Init() {
-		_thread = new _WorkerThread();
-		_thread->start();
+	// cpuThreads of 0 picks half the hardware threads.
+	void Init(size_t ioThreads = 2, size_t cpuThreads = 0) {
+		if (cpuThreads == 0) {
+			cpuThreads = std::max<size_t>(1, std::thread::hardware_concurrency() / 2);
+		}
+		ioThreads = std::max<size_t>(1, ioThreads);
+		// File reads and DNS lookups run on libuv's own thread pool, 4
+		//   threads unless told otherwise, which caps how many file reads
+		//   are really in flight.  It is sized on first use.
+		if (!getenv("UV_THREADPOOL_SIZE")) {
+#ifdef _WIN32
+			_putenv_s("UV_THREADPOOL_SIZE", "16");
+#else
+			setenv("UV_THREADPOOL_SIZE", "16", 0);
+#endif
+		}
+		_outbox = new _Outbox();
+		_cpuPool = new _CpuPool(cpuThreads);
+		size_t maxActive = std::max<size_t>(4, (kMaxActive + ioThreads - 1) / ioThreads);
+		for (size_t i = 0; i < ioThreads; ++i) {
+			_threads.push_back(new _WorkerThread(maxActive));
+			_threads.back()->start();
+		}
+		_registerMetrics();
+	}
+
+	// Owned by the first IO loop.
+	http::Server *_metricsServer = nullptr;
+
+	class _MetricsServerRequest : public WorkerRequest {
+	public:
+		// port 0 closes the server.
+		_MetricsServerRequest(uint16_t port)
+			: _port(port) {
+		}
+	private:
+		void execute() override {
+			delete _metricsServer;
+			_metricsServer = nullptr;
+			if (_port != 0) {
+				_metricsServer = new http::Server(worker().loop(), metrics::handle);
+				if (!_metricsServer->listen("127.0.0.1", _port)) {
+					printf("Metrics server can't listen on port %d\n", (int)_port);
+					delete _metricsServer;
+					_metricsServer = nullptr;
+				}
+			}
+			delete this;
+		}
+		void onComplete() override { }
+
+		uint16_t _port;
+	};
+
+	// Main thread, after Init.  Serves metrics::handle on 127.0.0.1:port
+	//   from the first IO loop.  Off unless called.
+	void EnableMetricsServer(uint16_t port) {
+		if (port != 0) {
+			_threads[0]->dispatch(new _MetricsServerRequest(port));
+		}
+	}
+
+	// Main thread, before the first dispatch.  GET requests are then served
+	//   from and stored to a disk cache in dir holding up to maxBytes.
+	bool EnableHttpCache(const std::string& dir, uint64_t maxBytes) {
+		std::unique_ptr<httpcache::Cache> cache(new httpcache::Cache(dir, maxBytes));
+		if (!cache->open()) {
+			return false;
+		}
+		delete _httpCache;
+		_httpCache = cache.release();
+		return true;
 	}
 
+	// IO loops stop first since they may still hand work to the CPU pool.
 	void Shutdown() {
-		if (_thread) {
-			_thread->dispatch(new KillRequest());
-			_thread->join();
-			delete _thread;
-			_thread = nullptr;
+		_outbox->close();
+		_threads[0]->dispatch(new _MetricsServerRequest(0));
+		for (auto& i : _threads) {
+			i->dispatch(new KillRequest());
+			while (!i->flush()) {
+				std::this_thread::yield();
+			}
 		}
+		for (auto& i : _threads) {
+			i->join();
+			delete i;
+		}
+		_threads.clear();
+		delete _cpuPool;
+		_cpuPool = nullptr;
+		delete _outbox;
+		_outbox = nullptr;
+		delete _httpCache;
+		_httpCache = nullptr;
 	}
 
-	void dispatch(WorkerRequest *request) {
-		_thread->dispatch(request);
+	// Main thread only.  Keyed requests are pinned to a loop by key, so one
+	//   host's connections and limits live in one place; the rest are
+	//   spread round-robin.
+	uint32_t dispatch(WorkerRequest *request, Priority priority = Priority::Visible) {
+		request->_id = ++_nextId;
+		request->_priority = priority;
+		request->_key = request->schedulingKey();
+		size_t index = request->_key.empty()
+			? _nextThread++ % _threads.size()
+			: std::hash<std::string>()(request->_key) % _threads.size();
+		uint32_t id = request->_id;
+		_outbox->track(request, _threads[index]);
+		_threads[index]->dispatch(request);
+		return id;
 	}
 
-	void poll() {
-		_thread->poll();
+	// Main thread.  An id no request will be given, for callers that hand
+	//   out ids of their own alongside request ids.
+	uint32_t reserveId() {
+		return ++_nextId;
 	}
 
-	class UriRequest : public WorkerRequest {
+	// Runs request->execute() on the CPU pool; it must end by calling
+	//   iothread::complete.
+	void dispatchCpu(WorkerRequest *request) {
+		request->_id = ++_nextId;
+		_outbox->track(request, nullptr);
+		_cpuPool->post([request]() {
+			request->execute();
+		});
+	}
+
+	class _PriorityRequest : public WorkerRequest {
 	public:
-		UriRequest(const std::string& uri)
-			: _proc(nullptr) {
+		_PriorityRequest(uint32_t id, Priority priority, float rank)
+			: _target(id), _targetPriority(priority), _targetRank(rank) {
 		}
-
-	protected:
-		int32_t _errorCode;
-		http::Response _response;
-
 	private:
-		class HttpProc : http::Socket {
-		public:
-			HttpProc(UriRequest& owner, const std::string& host, uint16_t port, const std::string& path)
-				: http::Socket(_thread->loop()), _owner(owner), _host(host), _port(port), _path(path) {
-			}
-			void start() {
-				connect(_host, _port);
-			}
-			virtual void onConnect() override {
-				request(_host, _path);
-			}
-			virtual void onResponse(const http::Response& response) {
-				_owner.onComplete(response);
-			}
-			virtual void onError(uint32_t code) override {
-				_owner.onError(code);
-			}
-		private:
-			UriRequest& _owner;
-			std::string _host;
-			uint16_t _port;
-			std::string _path;
-		};
-		HttpProc *_proc;
-
 		void execute() override {
-			printf("HttpProc execute\n");
-			_proc = new HttpProc(*this, "127.0.0.1", 80, "/");
-			_proc->start();
+			worker().scheduler().setPriority(_target, _targetPriority, _targetRank);
+			delete this;
 		}
+		void onComplete() override { }
 
-		virtual void onComplete(const http::Response& response) {
-			_errorCode = 0;
-			_response = response;
-			_thread->_dispatchCompletion(this);
-		}
+		uint32_t _target;
+		Priority _targetPriority;
+		float _targetRank;
+	};
 
-		virtual void onError(int32_t code) {
-			_errorCode = code;
-			_thread->_dispatchCompletion(this);
+	// Re-queues a request that hasn't started yet; ignored once it has.
+	//   Only the loop holding the request will find it.
+	void setPriority(uint32_t id, Priority priority, float rank = 0.0f) {
+		for (auto& i : _threads) {
+			i->dispatch(new _PriorityRequest(id, priority, rank));
 		}
+	}
+
+	class _ReorderRequest : public WorkerRequest {
+	public:
+		_ReorderRequest(std::vector<PriorityChange>& changes) {
+			_changes.swap(changes);
+		}
+	private:
+		void execute() override {
+			worker().scheduler().reorder(_changes);
+			delete this;
+		}
+		void onComplete() override { }
+
+		std::vector<PriorityChange> _changes;
+	};
+
+	// Main thread.  setPriority for many requests, with one message to
+	//   each loop holding any of them rather than one per request per loop.
+	void setPriorities(const std::vector<PriorityChange>& changes) {
+		std::unordered_map<_WorkerThread*, std::vector<PriorityChange>> byWorker;
+		for (auto& i : changes) {
+			_WorkerThread *worker;
+			if (_outbox->find(i.id, worker) && worker) {
+				byWorker[worker].push_back(i);
+			}
+		}
+		for (auto& i : byWorker) {
+			i.first->dispatch(new _ReorderRequest(i.second));
+		}
+	}
+
+	// Main thread.  True from dispatch until the request's completion has
+	//   been delivered.
+	bool pending(uint32_t id) {
+		_WorkerThread *worker;
+		return _outbox->find(id, worker);
+	}
+
+	class _CancelRequest : public WorkerRequest {
+	public:
+		_CancelRequest(uint32_t id)
+			: _target(id) {
+		}
+	private:
+		void execute() override {
+			worker().cancel(_target, UV_ECANCELED);
+			delete this;
+		}
+		void onComplete() override { }
+
+		uint32_t _target;
+	};
+
+	// Main thread.  Stops a request wherever it has got to.  Its
+	//   onComplete still runs, to free it, but with cancelled() set, and
+	//   no further onProgress is delivered.  Returns false if the request
+	//   had already completed.
+	bool cancel(uint32_t id) {
+		_WorkerThread *worker;
+		if (!_outbox->markCancelled(id, worker)) {
+			return false;
+		}
+		if (worker) {
+			worker->dispatch(new _CancelRequest(id));
+		}
+		return true;
+	}
+
+	const uint64_t kDefaultPollBudgetUs = 2000;
+
+	// Main thread, once per frame.  Delivers completions and progress in
+	//   priority order for up to budgetUs; the rest carry over to the next
+	//   call.
+	void poll(uint64_t budgetUs = kDefaultPollBudgetUs) {
+		size_t overflow = 0;
+		for (auto& i : _threads) {
+			i->flush();
+			overflow += i->overflow();
+		}
+		uint64_t overBudget = _outbox->stats().overBudget;
+		_outbox->poll(budgetUs * 1000);
+
+		const PollStats& stats = _outbox->stats();
+		_metrics::pollMs.observe(stats.lastPollNs / 1e6);
+		_metrics::delivered.add(stats.lastDelivered);
+		_metrics::overBudget.add(stats.overBudget - overBudget);
+		_metrics::backlog.set((int64_t)stats.backlog);
+		_metrics::overflow.set((int64_t)overflow);
+		_metrics::live.set((int64_t)_outbox->live());
+	}
+
+	const PollStats& pollStats() {
+		return _outbox->stats();
+	}
+
+	// Completion from a CPU worker or any thread other than the request's
+	//   IO loop.
+	void complete(WorkerRequest *request) {
+		_outbox->push(request, true);
+	}
+
+	class UriRequest : public WorkerRequest {
+	public:
+		UriRequest(const std::string& uri, const std::string& method = "GET",
+			const http::Headers& headers = http::Headers(), std::shared_ptr<http::BodySource> body = nullptr)
+			: _errorCode(0), _uri(uri), _method(method), _headers(headers), _requestBody(body), _proc(*this), _finished(false),
+			_callerHeaders(headers.size()), _useCache(false), _store(nullptr), _storeChecked(false), _revalidating(false),
+			_fromCache(false), _cancelCode(0), _alive(std::make_shared<bool>(true)), _inBody(false), _deliverPending(false) {
+			_urlValid = http::parseUrl(_uri, _url);
+			memset(&_peer, 0, sizeof(_peer));
+		}
+
+		virtual std::string schedulingKey() const override {
+			if (!_urlValid || _url.scheme != "http") {
+				return std::string();
+			}
+			return _url.authority();
+		}
+
+	protected:
+		// Runs once the request finishes, before completion is handed back
+		//   to the main thread.  Decoding belongs here.  It runs on the IO
+		//   loop unless processOnCpuPool says otherwise.
+		virtual void processResponse() {
+		}
+
+		// Return true when processResponse is heavy enough that it would
+		//   stall the IO loop.
+		virtual bool processOnCpuPool() const {
+			return false;
+		}
+
+		// IO thread.  Return true to take a body chunk instead of having it
+		//   collected into _response.body.
+		virtual bool processChunk(const http::Response& response, const char *data, size_t len) {
+			return false;
+		}
+
+		// IO thread.  A body served from the disk cache is offered here
+		//   whole, usually memory-mapped; return true to keep it.  Otherwise
+		//   it goes through processChunk and then _response.body as usual.
+		virtual bool processCachedBody(const http::Response& response, std::shared_ptr<uvpp::Blob> body) {
+			return false;
+		}
+
+		// IO thread.  Runs as the request finishes or fails, before
+		//   completion; subclasses with fetches of their own stop them here.
+		virtual void abortTransfers() {
+		}
+
+		// Plain GETs without a caller Range can have their body fetched in
+		//   pieces.
+		bool rangesAllowed() const {
+			if (_method != "GET" || _requestBody || _fromCache) {
+				return false;
+			}
+			for (size_t i = 0; i < _callerHeaders; ++i) {
+				if (http::equalsIgnoreCase(_headers[i].first, "Range")) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// IO thread, once the response has started.  Fetches bytes
+		//   [first, last] of the same resource from the same server into
+		//   handler, uncompressed.  ifRange, when not empty, is the
+		//   validator the parts must match.
+		void fetchRange(http::RequestHandler *handler, uint64_t first, uint64_t last, const std::string& ifRange) {
+			http::Headers headers(_headers.begin(), _headers.begin() + _callerHeaders);
+			char range[64];
+			snprintf(range, sizeof(range), "bytes=%llu-%llu", (unsigned long long)first, (unsigned long long)last);
+			headers.emplace_back("Range", range);
+			headers.emplace_back("Accept-Encoding", "identity");
+			if (!ifRange.empty()) {
+				headers.emplace_back("If-Range", ifRange);
+			}
+			worker().httpPool().request(reinterpret_cast<const struct sockaddr*>(&_peer), _url.authority(), "GET", _url.path,
+				headers, nullptr, handler);
+		}
+
+		void cancelRange(http::RequestHandler *handler) {
+			worker().httpPool().cancel(handler);
+		}
+
+		// Drops the main response part way through, without completing.
+		//   The body so far is not stored in the disk cache.
+		void detachTransfer() {
+			worker().httpPool().cancel(&_proc);
+			_storeChecked = true;
+			if (_store) {
+				_store->abort();
+				_store = nullptr;
+			}
+		}
+
+		// For a subclass that detached the main transfer and finished the
+		//   body itself.
+		void finishTransfer(http::Response& response) {
+			onComplete(response);
+		}
+
+		void failTransfer(int32_t code) {
+			onError(code);
+		}
+
+		int32_t _errorCode;
+		http::Response _response;
+
+	private:
+		class HttpProc : public http::RequestHandler {
+		public:
+			HttpProc(UriRequest& owner)
+				: _owner(owner) {
+			}
+			virtual void onResponse(http::Response& response) override {
+				_owner.onComplete(response);
+			}
+			virtual void onError(int32_t code) override {
+				_owner.onError(code);
+			}
+			// The connection still expects the request to be there after
+			//   a chunk, so completion reached from inside one waits.
+			virtual bool onBody(const http::Response& response, const char *data, size_t len) override {
+				_owner._inBody = true;
+				bool taken = _owner.processChunk(response, data, len);
+				_owner._storeChunk(response, taken ? data : nullptr, len);
+				_owner._inBody = false;
+				if (_owner._deliverPending) {
+					_owner._deliverPending = false;
+					_owner._deliver();
+				}
+				return taken;
+			}
+		private:
+			UriRequest& _owner;
+		};
+		class CacheReader : public uvpp::FileReader {
+		public:
+			CacheReader(UriRequest& owner, uvpp::EventLoop& loop)
+				: uvpp::FileReader(loop), _owner(owner) {
+			}
+			virtual void onRead(std::shared_ptr<uvpp::Blob> data) override {
+				_owner._onCachedBody(data);
+			}
+			virtual void onError(int32_t code) override {
+				_owner._onCacheMissing(code);
+			}
+		private:
+			UriRequest& _owner;
+		};
+		std::string _uri;
+		std::string _method;
+		http::Headers _headers;
+		std::shared_ptr<http::BodySource> _requestBody;
+		http::Url _url;
+		bool _urlValid;
+		HttpProc _proc;
+		bool _finished;
+		size_t _callerHeaders;
+		bool _useCache;
+		httpcache::Entry _cached;
+		httpcache::Writer *_store;
+		bool _storeChecked;
+		bool _revalidating;
+		bool _fromCache;
+		std::unique_ptr<CacheReader> _cacheReader;
+		int32_t _cancelCode;
+		std::shared_ptr<bool> _alive;
+		struct sockaddr_storage _peer;
+		bool _inBody;
+		bool _deliverPending;
+
+		bool cancellable() const override {
+			return true;
+		}
+
+		// A disk read in flight can't be stopped, so it is left to finish
+		//   and fail then.  Anything on the network is dropped at once; a
+		//   pending DNS lookup outlives the request and is told not to
+		//   touch it.
+		void cancel(int32_t code) override {
+			if (_finished) {
+				return;
+			}
+			if (_fromCache) {
+				_cancelCode = code;
+				return;
+			}
+			*_alive = false;
+			onError(code);
+		}
+
+		void execute() override {
+			printf("HttpProc execute\n");
+			if (!_urlValid) {
+				return onError(UV_EINVAL);
+			}
+			if (_url.scheme != "http") {
+				return onError(UV_EPROTONOSUPPORT);
+			}
+
+			_useCache = _cacheable();
+			if (_useCache && _httpCache->lookup(worker().loop(), _uri, _cached)) {
+				if (_cached.fresh()) {
+					return _readCached();
+				}
+				_addValidators();
+			}
+			_fetch();
+		}
+
+		// Plain GETs only; a caller sending its own validators or ranges
+		//   wants exactly that response.
+		bool _cacheable() const {
+			if (!_httpCache || _method != "GET" || _requestBody) {
+				return false;
+			}
+			for (size_t i = 0; i < _callerHeaders; ++i) {
+				const std::string& name = _headers[i].first;
+				if (http::equalsIgnoreCase(name, "Range") || http::equalsIgnoreCase(name, "If-None-Match") ||
+					http::equalsIgnoreCase(name, "If-Modified-Since")) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void _addValidators() {
+			const std::string *etag = _cached.header("ETag");
+			const std::string *lastModified = _cached.header("Last-Modified");
+			if (etag) {
+				_headers.emplace_back("If-None-Match", *etag);
+			}
+			if (lastModified) {
+				_headers.emplace_back("If-Modified-Since", *lastModified);
+			}
+			_revalidating = etag || lastModified;
+		}
+
+		void _readCached() {
+			_fromCache = true;
+			_storeChecked = true;
+			_cacheReader.reset(new CacheReader(*this, worker().loop()));
+			_cacheReader->read(_httpCache->bodyPath(_cached), 1);
+		}
+
+		void _onCachedBody(std::shared_ptr<uvpp::Blob> body) {
+			if (_cancelCode) {
+				return onError(_cancelCode);
+			}
+			http::Response response;
+			response.statusCode = 200;
+			response.contentLength = (int64_t)body->size();
+			for (auto& i : _cached.headers) {
+				response.addHeader(i.first, i.second);
+			}
+			if (!processCachedBody(response, body)) {
+				const char *data = (const char*)body->data();
+				size_t len = body->size();
+				if (len > 0 && !processChunk(response, data, len)) {
+					response.body.assign(data, data + len);
+				}
+			}
+			onComplete(response);
+		}
+
+		// Evicted, or never fully there; go to the network as if it had
+		//   never been cached.
+		void _onCacheMissing(int32_t code) {
+			if (_cancelCode) {
+				return onError(_cancelCode);
+			}
+			_httpCache->remove(worker().loop(), _cached);
+			_headers.resize(_callerHeaders);
+			_fromCache = false;
+			_storeChecked = false;
+			_revalidating = false;
+			_fetch();
+		}
+
+		// Called before each body chunk is handed on; data is nullptr when
+		//   the chunk is going into _response.body, which is stored as a
+		//   whole at completion instead.
+		void _storeChunk(const http::Response& response, const char *data, size_t len) {
+			if (!_storeChecked) {
+				_storeChecked = true;
+				if (_useCache) {
+					_store = _httpCache->store(worker().loop(), _uri, response);
+				}
+			}
+			if (_store && data) {
+				_store->append(data, len);
+			}
+		}
+
+		void _fetch() {
+			std::shared_ptr<bool> alive = _alive;
+			worker().dnsCache().resolve(_url.host, _url.port, [this, alive](int32_t status, const struct sockaddr *addr) {
+				if (!*alive) {
+					return;
+				}
+				if (status < 0) {
+					return onError(status);
+				}
+				memcpy(&_peer, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+				worker().httpPool().request(addr, _url.authority(), _method, _url.path, _headers, _requestBody, &_proc);
+				_requestBody = nullptr;
+			});
+		}
+
+		// Only the first outcome is delivered; completion hands this request
+		//   to the main thread, which may free it.
+		virtual void onComplete(http::Response& response) {
+			if (_finished) {
+				return;
+			}
+			if (_revalidating && response.statusCode == 304) {
+				_revalidating = false;
+				if (_httpCache->refresh(worker().loop(), _uri, response, _cached)) {
+					return _readCached();
+				}
+				return _onCacheMissing(UV_ENOENT);
+			}
+			_storeChunk(response, nullptr, 0);
+			if (_store) {
+				if (!response.body.empty()) {
+					_store->append(&response.body[0], response.body.size());
+				}
+				_store->commit();
+				_store = nullptr;
+			}
+			_finished = true;
+			_errorCode = 0;
+			_response = std::move(response);
+			abortTransfers();
+			_deliver();
+		}
+
+		virtual void onError(int32_t code) {
+			if (_finished) {
+				return;
+			}
+			if (_store) {
+				_store->abort();
+				_store = nullptr;
+			}
+			_finished = true;
+			_errorCode = code;
+			worker().httpPool().cancel(&_proc);
+			abortTransfers();
+			_deliver();
+		}
+
+		void _deliver() {
+			if (_inBody) {
+				_deliverPending = true;
+				return;
+			}
+			if (_errorCode != 0) {
+				return worker()._dispatchCompletion(this);
+			}
+			if (processOnCpuPool()) {
+				return worker()._handoff(this, [this]() {
+					processResponse();
+					complete(this);
+				});
+			}
+			processResponse();
+			worker()._dispatchCompletion(this);
+		}
+
+	};
+
+	// UriRequest that hands the body to the main thread as it arrives rather
+	//   than collecting it.  Chunks that land between two polls are merged
+	//   and delivered through a single onProgress.
+	class StreamRequest : public UriRequest {
+	public:
+		StreamRequest(const std::string& uri)
+			: UriRequest(uri), _statusCode(0), _received(0), _progressPosted(false) {
+		}
+
+	protected:
+		// Main thread.  Swaps out everything received since the last call;
+		//   offset is the position of the first byte in the body.
+		bool takeChunk(std::vector<uint8_t>& out, size_t& offset, uint32_t& statusCode) {
+			uvpp::ScopedLock lock(_chunkMutex);
+			_progressPosted = false;
+			statusCode = _statusCode;
+			offset = _received - _pending.size();
+			out.clear();
+			out.swap(_pending);
+			return !out.empty();
+		}
+
+	private:
+		bool processChunk(const http::Response& response, const char *data, size_t len) override {
+			bool post = false;
+			{
+				uvpp::ScopedLock lock(_chunkMutex);
+				_statusCode = response.statusCode;
+				_pending.insert(_pending.end(), data, data + len);
+				_received += len;
+				if (!_progressPosted) {
+					_progressPosted = true;
+					post = true;
+				}
+			}
+			if (post) {
+				_outbox->push(this, false);
+			}
+			return true;
+		}
+
+		uvpp::Mutex _chunkMutex;
+		uint32_t _statusCode;
+		size_t _received;
+		bool _progressPosted;
+		std::vector<uint8_t> _pending;
+
+	};
+
+	// UriRequest whose body is written into a single buffer from the uvpp
+	//   buffer allocator, reserved from Content-Length when there is one,
+	//   and handed over as _body.  _response.body stays empty.
+	//
+	// A body of at least kSegmentThreshold bytes from a server that takes
+	//   byte ranges is split: the first response carries on for the first
+	//   kSegmentBytes and the rest is fetched in kSegmentBytes ranges, up
+	//   to kMaxSegments at a time over other pooled connections, each
+	//   written straight to its place in the buffer.  Per-connection
+	//   throughput caps on CDNs make that several times faster than one
+	//   stream.
+	class BlobRequest : public UriRequest {
+	public:
+		static const size_t kSegmentThreshold = 16 * 1024 * 1024;
+		static const size_t kSegmentBytes = 4 * 1024 * 1024;
+		static const size_t kMaxSegments = 4;
+
+		BlobRequest(const std::string& uri, const std::string& method = "GET",
+			const http::Headers& headers = http::Headers(), std::shared_ptr<http::BodySource> body = nullptr)
+			: UriRequest(uri, method, headers, body), _allocFailed(false), _segmented(false), _total(0),
+			_primaryReceived(0), _primaryDone(false), _nextOffset(0) {
+		}
+
+		~BlobRequest() {
+			for (auto& i : _segments) {
+				delete i;
+			}
+		}
+
+	protected:
+		// Subclasses overriding this must call through first.
+		virtual void processResponse() override {
+			if (_cachedBody) {
+				_body = _cachedBody;
+				_cachedBody = nullptr;
+				return;
+			}
+			if (_allocFailed) {
+				_errorCode = UV_ENOMEM;
+				_buffer = nullptr;
+				return;
+			}
+			if (!_buffer) {
+				_buffer = std::make_shared<uvpp::BufferBlob>();
+			}
+			_body = _buffer;
+			_buffer = nullptr;
+		}
+
+		std::shared_ptr<uvpp::Blob> _body;
+
+	private:
+		class Segment : public http::RequestHandler {
+		public:
+			Segment(BlobRequest& owner, size_t offset, size_t length)
+				: _owner(owner), _offset(offset), _length(length), _received(0), _checked(false), _valid(false) {
+			}
+			size_t offset() const { return _offset; }
+			size_t length() const { return _length; }
+			virtual void onResponse(http::Response& response) override {
+				_owner._segmentDone(this, _valid && _received == _length ? 0 : UV_EPROTO);
+			}
+			virtual void onError(int32_t code) override {
+				_owner._segmentDone(this, code);
+			}
+			// A server that ignores the range, or whose copy changed under
+			//   If-Range, answers 200 with the whole body; that fails the
+			//   segment rather than landing in the wrong place.
+			virtual bool onBody(const http::Response& response, const char *data, size_t len) override {
+				if (!_checked) {
+					_checked = true;
+					http::StringRef range = response.header("Content-Range");
+					int64_t first, last, total;
+					_valid = response.statusCode == 206 && range.valid() && http::parseContentRange(range, first, last, total) &&
+						(uint64_t)first == _offset && (uint64_t)last == _offset + _length - 1 && (uint64_t)total == _owner._total;
+				}
+				if (_valid && len <= _length - _received) {
+					memcpy(_owner._buffer->data() + _offset + _received, data, len);
+					_received += len;
+				} else {
+					_valid = false;
+				}
+				return true;
+			}
+		private:
+			BlobRequest& _owner;
+			size_t _offset;
+			size_t _length;
+			size_t _received;
+			bool _checked;
+			bool _valid;
+		};
+
+		bool processChunk(const http::Response& response, const char *data, size_t len) override {
+			if (_allocFailed) {
+				return true;
+			}
+			if (!_buffer) {
+				_buffer = std::make_shared<uvpp::BufferBlob>();
+				if (_split(response)) {
+					if (!_buffer->resize(_total)) {
+						_allocFailed = true;
+						failTransfer(UV_ENOMEM);
+						return true;
+					}
+					_nextOffset = kSegmentBytes;
+					_startSegments();
+				} else if (response.contentLength > 0) {
+					_buffer->reserve((size_t)std::min<int64_t>(response.contentLength, (int64_t)http::ResponseParser::kMaxReserve));
+				}
+			}
+			if (_segmented) {
+				_primaryChunk(data, len);
+			} else if (!_buffer->append(data, len)) {
+				_allocFailed = true;
+			}
+			return true;
+		}
+
+		bool _split(const http::Response& response) {
+			if (response.statusCode != 200 || response.contentLength < (int64_t)kSegmentThreshold ||
+				(uint64_t)response.contentLength > (uint64_t)SIZE_MAX || !response.header("Accept-Ranges").equalsIgnoreCase("bytes") ||
+				!rangesAllowed()) {
+				return false;
+			}
+			// If-Range takes a strong ETag or a date, so a weak ETag falls
+			//   back to Last-Modified.  Without either, parts fetched after
+			//   the resource changed could be stitched together unnoticed,
+			//   so the body is read in one go.
+			http::StringRef etag = response.etag();
+			http::StringRef lastModified = response.header("Last-Modified");
+			if (etag.valid() && !(etag.size >= 2 && etag.data[0] == 'W' && etag.data[1] == '/')) {
+				_ifRange = etag.str();
+			} else if (lastModified.valid()) {
+				_ifRange = lastModified.str();
+			} else {
+				return false;
+			}
+			_segmented = true;
+			_total = (size_t)response.contentLength;
+			_head = response;
+			return true;
+		}
+
+		// The first response is only kept for the first segment.
+		void _primaryChunk(const char *data, size_t len) {
+			if (_primaryDone) {
+				return;
+			}
+			size_t take = std::min(len, kSegmentBytes - _primaryReceived);
+			memcpy(_buffer->data() + _primaryReceived, data, take);
+			_primaryReceived += take;
+			if (_primaryReceived == (size_t)kSegmentBytes) {
+				_primaryDone = true;
+				detachTransfer();
+				_checkSegments();
+			}
+		}
+
+		void _startSegments() {
+			while (_segments.size() < kMaxSegments && _nextOffset < _total) {
+				size_t length = std::min(_total - _nextOffset, (size_t)kSegmentBytes);
+				Segment *segment = new Segment(*this, _nextOffset, length);
+				_segments.push_back(segment);
+				_nextOffset += length;
+				fetchRange(segment, segment->offset(), segment->offset() + length - 1, _ifRange);
+			}
+		}
+
+		// Called from inside the segment's own handler, as its last use.
+		void _segmentDone(Segment *segment, int32_t code) {
+			_segments.erase(std::remove(_segments.begin(), _segments.end(), segment), _segments.end());
+			delete segment;
+			if (code < 0) {
+				return failTransfer(code);
+			}
+			_startSegments();
+			_checkSegments();
+		}
+
+		void _checkSegments() {
+			if (_primaryDone && _segments.empty() && _nextOffset >= _total) {
+				finishTransfer(_head);
+			}
+		}
+
+		void abortTransfers() override {
+			std::vector<Segment*> segments;
+			segments.swap(_segments);
+			_nextOffset = _total;
+			for (auto& i : segments) {
+				cancelRange(i);
+				delete i;
+			}
+		}
+
+		bool processCachedBody(const http::Response& response, std::shared_ptr<uvpp::Blob> body) override {
+			_cachedBody = body;
+			return true;
+		}
+
+		std::shared_ptr<uvpp::BufferBlob> _buffer;
+		std::shared_ptr<uvpp::Blob> _cachedBody;
+		bool _allocFailed;
+		bool _segmented;
+		size_t _total;
+		size_t _primaryReceived;
+		bool _primaryDone;
+		size_t _nextOffset;
+		std::string _ifRange;
+		http::Response _head;
+		std::vector<Segment*> _segments;
+
+	};
+
+	// Local file load.  Small files are read into the heap; anything of at
+	//   least kMapThreshold bytes is memory-mapped instead.
+	class FileRequest : public WorkerRequest {
+	public:
+		static const size_t kMapThreshold = 256 * 1024;
+
+		FileRequest(const std::string& path)
+			: _errorCode(0), _path(path) {
+		}
+
+	protected:
+		virtual void processResponse() {
+		}
+
+		int32_t _errorCode;
+		std::shared_ptr<uvpp::Blob> _body;
+
+	private:
+		class Reader : public uvpp::FileReader {
+		public:
+			Reader(FileRequest& owner, uvpp::EventLoop& loop)
+				: uvpp::FileReader(loop), _owner(owner) {
+			}
+			virtual void onRead(std::shared_ptr<uvpp::Blob> data) override {
+				_owner.onRead(data);
+			}
+			virtual void onError(int32_t code) override {
+				_owner.onError(code);
+			}
+		private:
+			FileRequest& _owner;
+		};
+
+		void execute() override {
+			_reader.reset(new Reader(*this, worker().loop()));
+			_reader->read(_path, kMapThreshold);
+		}
+
+		void onRead(std::shared_ptr<uvpp::Blob> data) {
+			_errorCode = 0;
+			_body = data;
+			processResponse();
+			worker()._dispatchCompletion(this);
+		}
+
+		void onError(int32_t code) {
+			_errorCode = code;
+			worker()._dispatchCompletion(this);
+		}
+
+		std::string _path;
+		std::unique_ptr<Reader> _reader;
+
+	};
+
+	// Reads many files on one loop with up to kMaxInFlight open at once,
+	//   and completes once when they are all done, so a few thousand small
+	//   files cost one notification rather than one each.  Cancelling
+	//   stops new reads; _errorCode is then set and files never read keep
+	//   it as their error.
+	class FileBatchRequest : public WorkerRequest {
+	public:
+		static const size_t kMaxInFlight = 32;
+
+		struct Result {
+			Result()
+				: errorCode(0) {
+			}
+
+			int32_t errorCode;
+			std::shared_ptr<uvpp::Blob> body;
+		};
+
+		// sequential hints that the files are read whole, front to back.
+		FileBatchRequest(const std::vector<std::string>& paths, bool sequential = false)
+			: _errorCode(0), _results(paths.size()), _paths(paths), _sequential(sequential), _next(0), _reading(0) {
+		}
+
+	protected:
+		bool cancellable() const override {
+			return true;
+		}
+
+		void cancel(int32_t code) override {
+			_errorCode = code;
+			for (size_t i = _next; i < _paths.size(); ++i) {
+				_results[i].errorCode = code;
+			}
+			_next = _paths.size();
+			if (_reading == 0) {
+				_finish();
+			}
+		}
+
+		int32_t _errorCode;
+		// One per path, in the same order.
+		std::vector<Result> _results;
+
+	private:
+		class Reader : public uvpp::FileReader {
+		public:
+			Reader(FileBatchRequest& owner, uvpp::EventLoop& loop)
+				: uvpp::FileReader(loop), _owner(owner), _index(0) {
+			}
+
+			void read(size_t index) {
+				_index = index;
+				uvpp::FileReader::read(_owner._paths[index], FileRequest::kMapThreshold, _owner._sequential);
+			}
+
+			virtual void onRead(std::shared_ptr<uvpp::Blob> data) override {
+				_owner._results[_index].body = data;
+				_owner._onFile(*this);
+			}
+
+			virtual void onError(int32_t code) override {
+				_owner._results[_index].errorCode = code;
+				_owner._onFile(*this);
+			}
+
+		private:
+			FileBatchRequest& _owner;
+			size_t _index;
+		};
+
+		void execute() override {
+			if (_paths.empty()) {
+				return _finish();
+			}
+			size_t readers = _paths.size() < kMaxInFlight ? _paths.size() : kMaxInFlight;
+			for (size_t i = 0; i < readers; ++i) {
+				_readers.emplace_back(new Reader(*this, worker().loop()));
+			}
+			for (auto& i : _readers) {
+				++_reading;
+				i->read(_next++);
+			}
+		}
+
+		// Each reader moves straight on to the next unread file.
+		void _onFile(Reader& reader) {
+			if (_next < _paths.size()) {
+				return reader.read(_next++);
+			}
+			if (--_reading == 0) {
+				_finish();
+			}
+		}
+
+		// Readers are still on the stack when the last one reports, so they
+		//   go with the request rather than here.
+		void _finish() {
+			worker()._dispatchCompletion(this);
+		}
+
+		std::vector<std::string> _paths;
+		bool _sequential;
+		size_t _next;
+		size_t _reading;
+		std::vector<std::unique_ptr<Reader>> _readers;
+
+	};
+
+	// Long-lived ws:// connection.  Messages are queued as they arrive and
+	//   handed over through onProgress, as many per notification as landed
+	//   between two polls; onComplete runs once the connection is gone.
+	//   Cancelling, or a timeout, closes it with a closing handshake.
+	class WebSocketRequest : public WorkerRequest {
+	public:
+		struct Message {
+			std::shared_ptr<uvpp::BufferBlob> data;
+			bool binary;
+		};
+
+		WebSocketRequest(const std::string& uri, const http::Headers& headers = http::Headers())
+			: _errorCode(0), _closeCode(0), _uri(uri), _headers(headers), _socket(nullptr),
+			_alive(std::make_shared<bool>(true)), _cancelCode(0), _progressPosted(false), _flushPosted(false) {
+			_urlValid = http::parseUrl(_uri, _url);
+		}
+
+		// Main thread, after dispatch.  The message is framed and masked
+		//   here, in the one copy taken of data, and written from that copy
+		//   by the loop.  Messages sent before the handshake finishes go
+		//   out once it does; after the connection closes they are dropped.
+		void send(const uint8_t *data, size_t len, bool binary) {
+			auto frame = std::make_shared<uvpp::BufferBlob>();
+			if (!frame->resize(len + ws::kMaxFrameOverhead)) {
+				return;
+			}
+			size_t size = ws::writeFrame(frame->data(), binary ? ws::Opcode::Binary : ws::Opcode::Text, data, len, (uint32_t)_rng());
+			frame->resize(size);
+			bool post = false;
+			{
+				uvpp::ScopedLock lock(_mutex);
+				_outgoing.push_back(frame);
+				if (!_flushPosted) {
+					_flushPosted = true;
+					post = true;
+				}
+			}
+			if (post) {
+				worker().dispatch(new _FlushRequest(id()));
+			}
+		}
+
+	protected:
+		// Main thread.  Swaps out every message received since the last call.
+		bool takeMessages(std::vector<Message>& out) {
+			uvpp::ScopedLock lock(_mutex);
+			_progressPosted = false;
+			out.clear();
+			out.swap(_incoming);
+			return !out.empty();
+		}
+
+		int32_t _errorCode;
+		// Status from the server's close frame; 1005 if it gave none, 1006
+		//   if the connection dropped without one.
+		uint16_t _closeCode;
+
+	private:
+		class Connection : public ws::Socket {
+		public:
+			Connection(WebSocketRequest& owner, uvpp::EventLoop& loop)
+				: ws::Socket(loop), _owner(owner) {
+			}
+			virtual void onOpen() override {
+				_owner._flush();
+			}
+			virtual void onMessage(std::shared_ptr<uvpp::BufferBlob> data, bool binary) override {
+				_owner._onMessage(data, binary);
+			}
+			virtual void onClosed(int32_t error, uint16_t code) override {
+				_owner._onClosed(error, code);
+				delete this;
+			}
+		private:
+			WebSocketRequest& _owner;
+		};
+
+		// Carries a send() wake-up to the request's loop, which ignores it
+		//   if the connection has already finished.
+		class _FlushRequest : public WorkerRequest {
+		public:
+			_FlushRequest(uint32_t id)
+				: _target(id) {
+			}
+		private:
+			void execute() override {
+				WorkerRequest *request = worker().find(_target);
+				if (request) {
+					static_cast<WebSocketRequest*>(request)->_flush();
+				}
+				delete this;
+			}
+			void onComplete() override { }
+
+			uint32_t _target;
+		};
+
+		bool cancellable() const override {
+			return true;
+		}
+
+		void cancel(int32_t code) override {
+			_cancelCode = code;
+			if (_socket) {
+				return _socket->shutdown(1000);
+			}
+			*_alive = false;
+			_finish(code, 1006);
+		}
+
+		void execute() override {
+			if (!_urlValid) {
+				return _finish(UV_EINVAL, 1006);
+			}
+			if (_url.scheme != "ws") {
+				return _finish(UV_EPROTONOSUPPORT, 1006);
+			}
+			std::shared_ptr<bool> alive = _alive;
+			worker().dnsCache().resolve(_url.host, _url.port, [this, alive](int32_t status, const struct sockaddr *addr) {
+				if (!*alive) {
+					return;
+				}
+				if (status < 0) {
+					return _finish(status, 1006);
+				}
+				_socket = new Connection(*this, worker().loop());
+				_socket->open(addr, _url.authority(), _url.path, _headers);
+			});
+		}
+
+		// Anything sent before the connection opened waits for onOpen.
+		void _flush() {
+			std::vector<std::shared_ptr<uvpp::Blob>> outgoing;
+			{
+				uvpp::ScopedLock lock(_mutex);
+				_flushPosted = false;
+				if (!_socket || _socket->state() != ws::Socket::State::Open) {
+					return;
+				}
+				outgoing.swap(_outgoing);
+			}
+			for (auto& i : outgoing) {
+				_socket->sendFrame(i);
+			}
+		}
+
+		void _onMessage(std::shared_ptr<uvpp::BufferBlob> data, bool binary) {
+			bool post = false;
+			{
+				uvpp::ScopedLock lock(_mutex);
+				Message message;
+				message.data = data;
+				message.binary = binary;
+				_incoming.push_back(message);
+				if (!_progressPosted) {
+					_progressPosted = true;
+					post = true;
+				}
+			}
+			if (post) {
+				_outbox->push(this, false);
+			}
+		}
+
+		void _onClosed(int32_t error, uint16_t code) {
+			_socket = nullptr;
+			_finish(_cancelCode != 0 ? _cancelCode : error, code);
+		}
+
+		void _finish(int32_t error, uint16_t code) {
+			_errorCode = error;
+			_closeCode = code;
+			worker()._dispatchCompletion(this);
+		}
+
+		std::string _uri;
+		http::Headers _headers;
+		http::Url _url;
+		bool _urlValid;
+		// Mask keys for send(), drawn per frame; main thread only.
+		std::random_device _rng;
+		Connection *_socket;
+		std::shared_ptr<bool> _alive;
+		int32_t _cancelCode;
+		uvpp::Mutex _mutex;
+		std::vector<Message> _incoming;
+		std::vector<std::shared_ptr<uvpp::Blob>> _outgoing;
+		bool _progressPosted;
+		bool _flushPosted;
 
 	};
 }
\ No newline at end of file
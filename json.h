@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Minimal JSON DOM for native-side asset parsing off the main thread, where
+//   V8's JSON.parse is not available.
+namespace json {
+	enum class Type : uint32_t {
+		Null,
+		Bool,
+		Number,
+		String,
+		Array,
+		Object
+	};
+
+	class Value {
+	public:
+		Value()
+			: _type(Type::Null), _number(0) {
+		}
+
+		Type type() const { return _type; }
+		bool isNull() const { return _type == Type::Null; }
+		bool isNumber() const { return _type == Type::Number; }
+		bool isString() const { return _type == Type::String; }
+		bool isArray() const { return _type == Type::Array; }
+		bool isObject() const { return _type == Type::Object; }
+
+		double asNumber(double def = 0.0) const {
+			return _type == Type::Number ? _number : def;
+		}
+
+		int64_t asInt(int64_t def = 0) const {
+			return _type == Type::Number ? (int64_t)_number : def;
+		}
+
+		bool asBool(bool def = false) const {
+			return _type == Type::Bool ? _number != 0 : def;
+		}
+
+		const std::string& asString() const {
+			return _string;
+		}
+
+		size_t size() const {
+			return _type == Type::Array ? _array.size() : _type == Type::Object ? _object.size() : 0;
+		}
+
+		// Out of range or mistyped lookups return a shared null value so
+		//   callers can chain without checking every step.
+		const Value& operator[](size_t index) const {
+			if (_type != Type::Array || index >= _array.size()) {
+				return null();
+			}
+			return _array[index];
+		}
+
+		const Value& operator[](const char *key) const {
+			if (_type == Type::Object) {
+				for (auto& i : _object) {
+					if (i.first == key) {
+						return i.second;
+					}
+				}
+			}
+			return null();
+		}
+
+		bool has(const char *key) const {
+			return !(*this)[key].isNull();
+		}
+
+		static const Value& null() {
+			static Value nullValue;
+			return nullValue;
+		}
+
+	private:
+		friend class Parser;
+
+		Type _type;
+		double _number;
+		std::string _string;
+		std::vector<Value> _array;
+		std::vector<std::pair<std::string, Value>> _object;
+
+	};
+
+	class Parser {
+	public:
+		Parser(const char *data, size_t len)
+			: _pos(data), _end(data + len) {
+		}
+
+		bool parse(Value& out) {
+			if (!_parseValue(out, 0)) {
+				return false;
+			}
+			_skipWhitespace();
+			return _pos == _end;
+		}
+
+	private:
+		static const int kMaxDepth = 64;
+
+		void _skipWhitespace() {
+			while (_pos < _end && (*_pos == ' ' || *_pos == '\t' || *_pos == '\n' || *_pos == '\r')) {
+				++_pos;
+			}
+		}
+
+		bool _literal(const char *word, Value& out, Type type, double number) {
+			size_t len = strlen(word);
+			if ((size_t)(_end - _pos) < len || memcmp(_pos, word, len) != 0) {
+				return false;
+			}
+			_pos += len;
+			out._type = type;
+			out._number = number;
+			return true;
+		}
+
+		static void _appendUtf8(std::string& out, uint32_t cp) {
+			if (cp < 0x80) {
+				out += (char)cp;
+			} else if (cp < 0x800) {
+				out += (char)(0xC0 | (cp >> 6));
+				out += (char)(0x80 | (cp & 0x3F));
+			} else if (cp < 0x10000) {
+				out += (char)(0xE0 | (cp >> 12));
+				out += (char)(0x80 | ((cp >> 6) & 0x3F));
+				out += (char)(0x80 | (cp & 0x3F));
+			} else {
+				out += (char)(0xF0 | (cp >> 18));
+				out += (char)(0x80 | ((cp >> 12) & 0x3F));
+				out += (char)(0x80 | ((cp >> 6) & 0x3F));
+				out += (char)(0x80 | (cp & 0x3F));
+			}
+		}
+
+		bool _parseHex4(uint32_t& out) {
+			if (_end - _pos < 4) {
+				return false;
+			}
+			out = 0;
+			for (int i = 0; i < 4; ++i) {
+				char c = *_pos++;
+				out <<= 4;
+				if (c >= '0' && c <= '9') out |= c - '0';
+				else if (c >= 'a' && c <= 'f') out |= c - 'a' + 10;
+				else if (c >= 'A' && c <= 'F') out |= c - 'A' + 10;
+				else return false;
+			}
+			return true;
+		}
+
+		bool _parseString(std::string& out) {
+			++_pos;
+			while (_pos < _end) {
+				char c = *_pos++;
+				if (c == '"') {
+					return true;
+				} else if (c != '\\') {
+					out += c;
+					continue;
+				}
+				if (_pos == _end) {
+					return false;
+				}
+				c = *_pos++;
+				switch (c) {
+				case '"': out += '"'; break;
+				case '\\': out += '\\'; break;
+				case '/': out += '/'; break;
+				case 'b': out += '\b'; break;
+				case 'f': out += '\f'; break;
+				case 'n': out += '\n'; break;
+				case 'r': out += '\r'; break;
+				case 't': out += '\t'; break;
+				case 'u': {
+					uint32_t cp;
+					if (!_parseHex4(cp)) {
+						return false;
+					}
+					if (cp >= 0xD800 && cp <= 0xDBFF) {
+						uint32_t low;
+						if (_end - _pos < 2 || _pos[0] != '\\' || _pos[1] != 'u') {
+							return false;
+						}
+						_pos += 2;
+						if (!_parseHex4(low) || low < 0xDC00 || low > 0xDFFF) {
+							return false;
+						}
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+					}
+					_appendUtf8(out, cp);
+					break;
+				}
+				default:
+					return false;
+				}
+			}
+			return false;
+		}
+
+		bool _parseNumber(Value& out) {
+			// strtod needs a terminator; numbers are short so copy them out.
+			const char *start = _pos;
+			while (_pos < _end && (strchr("+-0123456789.eE", *_pos) != nullptr)) {
+				++_pos;
+			}
+			if (_pos == start || _pos - start > 64) {
+				return false;
+			}
+			char buf[65];
+			memcpy(buf, start, _pos - start);
+			buf[_pos - start] = 0;
+			char *parsedEnd;
+			out._number = strtod(buf, &parsedEnd);
+			out._type = Type::Number;
+			return parsedEnd == buf + (_pos - start);
+		}
+
+		bool _parseValue(Value& out, int depth) {
+			if (depth > kMaxDepth) {
+				return false;
+			}
+			_skipWhitespace();
+			if (_pos == _end) {
+				return false;
+			}
+
+			switch (*_pos) {
+			case 'n': return _literal("null", out, Type::Null, 0);
+			case 't': return _literal("true", out, Type::Bool, 1);
+			case 'f': return _literal("false", out, Type::Bool, 0);
+			case '"':
+				out._type = Type::String;
+				return _parseString(out._string);
+			case '[':
+				out._type = Type::Array;
+				++_pos;
+				_skipWhitespace();
+				if (_pos < _end && *_pos == ']') {
+					++_pos;
+					return true;
+				}
+				while (true) {
+					out._array.emplace_back();
+					if (!_parseValue(out._array.back(), depth + 1)) {
+						return false;
+					}
+					_skipWhitespace();
+					if (_pos == _end) {
+						return false;
+					}
+					char c = *_pos++;
+					if (c == ']') {
+						return true;
+					} else if (c != ',') {
+						return false;
+					}
+				}
+			case '{':
+				out._type = Type::Object;
+				++_pos;
+				_skipWhitespace();
+				if (_pos < _end && *_pos == '}') {
+					++_pos;
+					return true;
+				}
+				while (true) {
+					_skipWhitespace();
+					if (_pos == _end || *_pos != '"') {
+						return false;
+					}
+					out._object.emplace_back();
+					if (!_parseString(out._object.back().first)) {
+						return false;
+					}
+					_skipWhitespace();
+					if (_pos == _end || *_pos++ != ':') {
+						return false;
+					}
+					if (!_parseValue(out._object.back().second, depth + 1)) {
+						return false;
+					}
+					_skipWhitespace();
+					if (_pos == _end) {
+						return false;
+					}
+					char c = *_pos++;
+					if (c == '}') {
+						return true;
+					} else if (c != ',') {
+						return false;
+					}
+				}
+			default:
+				return _parseNumber(out);
+			}
+		}
+
+		const char *_pos;
+		const char *_end;
+
+	};
+
+	bool parse(const char *data, size_t len, Value& out) {
+		Parser parser(data, len);
+		return parser.parse(out);
+	}
+}
@@ -0,0 +1,542 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include "uvpp.h"
+
+// Offline-quality mesh optimisation passes for static geometry.  Everything
+//   in here works on raw vertex streams so it can run on an IO worker without
+//   touching any gfx or v8 state.
+namespace meshopt {
+	struct Stream {
+		std::vector<uint8_t> data;
+		size_t stride;
+	};
+
+	struct Geometry {
+		std::vector<Stream> streams;
+		std::vector<uint32_t> indices;
+		size_t vertexCount;
+	};
+
+	struct Stats {
+		float acmrBefore;
+		float acmrAfter;
+		size_t verticesBefore;
+		size_t verticesAfter;
+	};
+
+	namespace internal {
+		const uint32_t kCacheSize = 32;
+		const uint32_t kMaxValence = 64;
+
+		uint64_t hashBytes(uint64_t hash, const uint8_t *data, size_t len) {
+			// FNV-1a
+			for (size_t i = 0; i < len; ++i) {
+				hash ^= data[i];
+				hash *= 1099511628211ULL;
+			}
+			return hash;
+		}
+
+		uint64_t hashVertex(const Geometry& geom, size_t vertex) {
+			uint64_t hash = 14695981039346656037ULL;
+			for (auto& s : geom.streams) {
+				hash = hashBytes(hash, &s.data[vertex * s.stride], s.stride);
+			}
+			return hash;
+		}
+
+		bool vertexEquals(const Geometry& geom, size_t a, size_t b) {
+			for (auto& s : geom.streams) {
+				if (memcmp(&s.data[a * s.stride], &s.data[b * s.stride], s.stride) != 0) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// Scores from Tom Forsyth's "Linear-Speed Vertex Cache Optimisation".
+		float vertexScore(int32_t cachePos, uint32_t remainingTris) {
+			if (remainingTris == 0) {
+				return -1.0f;
+			}
+
+			float score = 0.0f;
+			if (cachePos >= 0) {
+				if (cachePos < 3) {
+					score = 0.75f;
+				} else {
+					const float scaler = 1.0f / (kCacheSize - 3);
+					score = 1.0f - (cachePos - 3) * scaler;
+					score = powf(score, 1.5f);
+				}
+			}
+
+			score += 2.0f * powf((float)std::min(remainingTris, kMaxValence), -0.5f);
+			return score;
+		}
+
+		float positionAt(const Stream& positions, uint32_t vertex, int axis) {
+			float v;
+			memcpy(&v, &positions.data[vertex * positions.stride + axis * sizeof(float)], sizeof(float));
+			return v;
+		}
+	}
+	namespace i = meshopt::internal;
+
+	// Average cache miss ratio per triangle for a FIFO cache of the given size.
+	float computeAcmr(const std::vector<uint32_t>& indices, size_t vertexCount, uint32_t cacheSize = 16) {
+		if (indices.size() < 3) {
+			return 0.0f;
+		}
+
+		std::vector<uint32_t> timestamps(vertexCount, 0);
+		uint32_t time = cacheSize + 1;
+		uint32_t misses = 0;
+		for (auto& idx : indices) {
+			if (time - timestamps[idx] > cacheSize) {
+				timestamps[idx] = time++;
+				++misses;
+			}
+		}
+		return (float)misses / (float)(indices.size() / 3);
+	}
+
+	// Collapses bitwise-identical vertices across every stream and rewrites
+	//   the index buffer to match.  Unindexed input gets an index buffer.
+	void deduplicateVertices(Geometry& geom) {
+		if (geom.indices.empty()) {
+			geom.indices.resize(geom.vertexCount);
+			for (size_t v = 0; v < geom.vertexCount; ++v) {
+				geom.indices[v] = (uint32_t)v;
+			}
+		}
+
+		std::unordered_multimap<uint64_t, uint32_t> seen;
+		seen.reserve(geom.vertexCount);
+		std::vector<uint32_t> remap(geom.vertexCount);
+		uint32_t uniqueCount = 0;
+
+		for (size_t v = 0; v < geom.vertexCount; ++v) {
+			uint64_t hash = i::hashVertex(geom, v);
+			uint32_t target = (uint32_t)-1;
+			auto range = seen.equal_range(hash);
+			for (auto it = range.first; it != range.second; ++it) {
+				if (i::vertexEquals(geom, it->second, v)) {
+					target = it->second;
+					break;
+				}
+			}
+			if (target == (uint32_t)-1) {
+				// Compact in place; target never overtakes v so unread
+				//   vertices are never clobbered.
+				target = uniqueCount++;
+				seen.emplace(hash, target);
+				for (auto& s : geom.streams) {
+					if (target != v) {
+						memmove(&s.data[target * s.stride], &s.data[v * s.stride], s.stride);
+					}
+				}
+			}
+			remap[v] = target;
+		}
+
+		for (auto& s : geom.streams) {
+			s.data.resize(uniqueCount * s.stride);
+		}
+		for (auto& idx : geom.indices) {
+			idx = remap[idx];
+		}
+		geom.vertexCount = uniqueCount;
+	}
+
+	// Post-transform vertex cache reordering (Forsyth).
+	void optimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount) {
+		const size_t triCount = indices.size() / 3;
+		if (triCount == 0) {
+			return;
+		}
+
+		std::vector<uint32_t> valence(vertexCount, 0);
+		for (auto& idx : indices) {
+			valence[idx]++;
+		}
+
+		std::vector<uint32_t> adjOffset(vertexCount + 1, 0);
+		for (size_t v = 0; v < vertexCount; ++v) {
+			adjOffset[v + 1] = adjOffset[v] + valence[v];
+		}
+		std::vector<uint32_t> adjacency(indices.size());
+		std::vector<uint32_t> fill(adjOffset.begin(), adjOffset.end() - 1);
+		for (size_t t = 0; t < triCount; ++t) {
+			for (int k = 0; k < 3; ++k) {
+				adjacency[fill[indices[t * 3 + k]]++] = (uint32_t)t;
+			}
+		}
+
+		std::vector<int32_t> cachePos(vertexCount, -1);
+		std::vector<float> vertScore(vertexCount);
+		for (size_t v = 0; v < vertexCount; ++v) {
+			vertScore[v] = i::vertexScore(-1, valence[v]);
+		}
+
+		std::vector<bool> emitted(triCount, false);
+		std::vector<float> triScore(triCount);
+		for (size_t t = 0; t < triCount; ++t) {
+			triScore[t] = vertScore[indices[t * 3]] + vertScore[indices[t * 3 + 1]] + vertScore[indices[t * 3 + 2]];
+		}
+
+		std::vector<uint32_t> output;
+		output.reserve(indices.size());
+		std::vector<uint32_t> cache;
+		cache.reserve(i::kCacheSize + 3);
+		size_t scanPos = 0;
+
+		int64_t bestTri = -1;
+		float bestScore = -1.0f;
+		for (size_t t = 0; t < triCount; ++t) {
+			if (triScore[t] > bestScore) {
+				bestScore = triScore[t];
+				bestTri = t;
+			}
+		}
+
+		while (bestTri >= 0) {
+			emitted[(size_t)bestTri] = true;
+
+			std::vector<uint32_t> newCache;
+			newCache.reserve(i::kCacheSize + 3);
+			for (int k = 0; k < 3; ++k) {
+				uint32_t v = indices[(size_t)bestTri * 3 + k];
+				output.push_back(v);
+				newCache.push_back(v);
+
+				// Drop the triangle from the vertex's live adjacency.
+				uint32_t *begin = &adjacency[adjOffset[v]];
+				uint32_t *end = begin + valence[v];
+				uint32_t *found = std::find(begin, end, (uint32_t)bestTri);
+				if (found != end) {
+					std::swap(*found, *(end - 1));
+					valence[v]--;
+				}
+			}
+			for (auto& v : cache) {
+				if (std::find(newCache.begin(), newCache.end(), v) == newCache.end()) {
+					newCache.push_back(v);
+				}
+			}
+
+			for (size_t c = 0; c < newCache.size(); ++c) {
+				uint32_t v = newCache[c];
+				cachePos[v] = c < i::kCacheSize ? (int32_t)c : -1;
+				vertScore[v] = i::vertexScore(cachePos[v], valence[v]);
+			}
+			if (newCache.size() > i::kCacheSize) {
+				newCache.resize(i::kCacheSize);
+			}
+			cache.swap(newCache);
+
+			bestTri = -1;
+			bestScore = -1.0f;
+			for (auto& v : cache) {
+				for (uint32_t a = 0; a < valence[v]; ++a) {
+					uint32_t t = adjacency[adjOffset[v] + a];
+					float score = vertScore[indices[t * 3]] + vertScore[indices[t * 3 + 1]] + vertScore[indices[t * 3 + 2]];
+					triScore[t] = score;
+					if (score > bestScore) {
+						bestScore = score;
+						bestTri = t;
+					}
+				}
+			}
+
+			if (bestTri < 0) {
+				// Nothing adjacent to the cache; take the next unemitted triangle.
+				while (scanPos < triCount && emitted[scanPos]) {
+					++scanPos;
+				}
+				if (scanPos < triCount) {
+					bestTri = scanPos;
+				}
+			}
+		}
+
+		indices.swap(output);
+	}
+
+	// Overdraw-aware triangle ordering (Sander et al.).  The cache-optimised
+	//   sequence is cut into clusters wherever the cache gets thrashed, and
+	//   clusters are sorted so outward-facing ones draw first.  threshold is
+	//   the ACMR regression we accept in exchange for less overdraw.
+	void optimizeOverdraw(std::vector<uint32_t>& indices, const Stream& positions, size_t vertexCount, float threshold = 1.05f) {
+		const size_t triCount = indices.size() / 3;
+		if (triCount == 0 || positions.stride < 3 * sizeof(float)) {
+			return;
+		}
+
+		const float targetAcmr = computeAcmr(indices, vertexCount) * threshold;
+
+		std::vector<size_t> clusters;
+		{
+			std::vector<uint32_t> timestamps(vertexCount, 0);
+			uint32_t time = i::kCacheSize + 1;
+			uint32_t misses = 0;
+			size_t clusterStart = 0;
+			clusters.push_back(0);
+			for (size_t t = 0; t < triCount; ++t) {
+				uint32_t triMisses = 0;
+				for (int k = 0; k < 3; ++k) {
+					uint32_t v = indices[t * 3 + k];
+					if (time - timestamps[v] > i::kCacheSize) {
+						timestamps[v] = time++;
+						++triMisses;
+					}
+				}
+				misses += triMisses;
+
+				// A triangle that misses on every vertex marks a cache reset,
+				//   which is a safe place to cut without hurting ACMR.
+				if (triMisses == 3 && t > clusterStart && (float)misses / (float)(t + 1) <= targetAcmr) {
+					clusters.push_back(t);
+					clusterStart = t;
+				}
+			}
+		}
+		if (clusters.size() < 2) {
+			return;
+		}
+		clusters.push_back(triCount);
+
+		float meshCenter[3] = { 0, 0, 0 };
+		for (size_t v = 0; v < vertexCount; ++v) {
+			for (int a = 0; a < 3; ++a) {
+				meshCenter[a] += i::positionAt(positions, (uint32_t)v, a);
+			}
+		}
+		for (int a = 0; a < 3; ++a) {
+			meshCenter[a] /= (float)std::max<size_t>(vertexCount, 1);
+		}
+
+		struct ClusterSort {
+			float key;
+			size_t begin;
+			size_t end;
+		};
+		std::vector<ClusterSort> sorted;
+		sorted.reserve(clusters.size() - 1);
+		for (size_t c = 0; c + 1 < clusters.size(); ++c) {
+			float center[3] = { 0, 0, 0 };
+			float normal[3] = { 0, 0, 0 };
+			float area = 0.0f;
+			for (size_t t = clusters[c]; t < clusters[c + 1]; ++t) {
+				float p[3][3];
+				for (int k = 0; k < 3; ++k) {
+					for (int a = 0; a < 3; ++a) {
+						p[k][a] = i::positionAt(positions, indices[t * 3 + k], a);
+					}
+				}
+				float e1[3] = { p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2] };
+				float e2[3] = { p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2] };
+				float n[3] = {
+					e1[1] * e2[2] - e1[2] * e2[1],
+					e1[2] * e2[0] - e1[0] * e2[2],
+					e1[0] * e2[1] - e1[1] * e2[0]
+				};
+				float triArea = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				for (int a = 0; a < 3; ++a) {
+					center[a] += (p[0][a] + p[1][a] + p[2][a]) / 3.0f * triArea;
+					normal[a] += n[a];
+				}
+				area += triArea;
+			}
+			float key = 0.0f;
+			if (area > 0.0f) {
+				for (int a = 0; a < 3; ++a) {
+					key += (center[a] / area - meshCenter[a]) * normal[a];
+				}
+			}
+			ClusterSort cs = { key, clusters[c], clusters[c + 1] };
+			sorted.push_back(cs);
+		}
+
+		std::stable_sort(sorted.begin(), sorted.end(), [](const ClusterSort& a, const ClusterSort& b) {
+			return a.key > b.key;
+		});
+
+		std::vector<uint32_t> output;
+		output.reserve(indices.size());
+		for (auto& cs : sorted) {
+			output.insert(output.end(), indices.begin() + cs.begin * 3, indices.begin() + cs.end * 3);
+		}
+		indices.swap(output);
+	}
+
+	// Renumbers vertices in first-use order so the vertex fetch walks
+	//   memory linearly.  Unreferenced vertices are dropped.
+	void optimizeVertexFetch(Geometry& geom) {
+		std::vector<uint32_t> remap(geom.vertexCount, (uint32_t)-1);
+		uint32_t next = 0;
+		for (auto& idx : geom.indices) {
+			if (remap[idx] == (uint32_t)-1) {
+				remap[idx] = next++;
+			}
+			idx = remap[idx];
+		}
+
+		for (auto& s : geom.streams) {
+			std::vector<uint8_t> out(next * s.stride);
+			for (size_t v = 0; v < geom.vertexCount; ++v) {
+				if (remap[v] != (uint32_t)-1) {
+					memcpy(&out[remap[v] * s.stride], &s.data[v * s.stride], s.stride);
+				}
+			}
+			s.data.swap(out);
+		}
+		geom.vertexCount = next;
+	}
+
+	uint64_t contentHash(const Geometry& geom) {
+		uint64_t hash = 14695981039346656037ULL;
+		for (auto& s : geom.streams) {
+			uint64_t stride = s.stride;
+			hash = i::hashBytes(hash, (const uint8_t*)&stride, sizeof(stride));
+			hash = i::hashBytes(hash, s.data.data(), s.data.size());
+		}
+		hash = i::hashBytes(hash, (const uint8_t*)geom.indices.data(), geom.indices.size() * sizeof(uint32_t));
+		return hash;
+	}
+
+	// Runs the full pipeline.  positionStream selects the stream used for
+	//   overdraw sorting; it must hold at least three floats per vertex.
+	Stats optimize(Geometry& geom, size_t positionStream) {
+		Stats stats;
+		stats.verticesBefore = geom.vertexCount;
+		stats.acmrBefore = geom.indices.empty() ? 3.0f : computeAcmr(geom.indices, geom.vertexCount);
+
+		deduplicateVertices(geom);
+		optimizeVertexCache(geom.indices, geom.vertexCount);
+		if (positionStream < geom.streams.size()) {
+			optimizeOverdraw(geom.indices, geom.streams[positionStream], geom.vertexCount);
+		}
+		optimizeVertexFetch(geom);
+
+		stats.verticesAfter = geom.vertexCount;
+		stats.acmrAfter = computeAcmr(geom.indices, geom.vertexCount);
+		return stats;
+	}
+
+	size_t byteSize(const Geometry& geom) {
+		size_t size = geom.indices.size() * sizeof(uint32_t);
+		for (auto& s : geom.streams) {
+			size += s.data.size();
+		}
+		return size;
+	}
+
+	bool sameGeometry(const Geometry& a, const Geometry& b) {
+		if (a.vertexCount != b.vertexCount || a.streams.size() != b.streams.size() || a.indices != b.indices) {
+			return false;
+		}
+		for (size_t s = 0; s < a.streams.size(); ++s) {
+			if (a.streams[s].stride != b.streams[s].stride || a.streams[s].data != b.streams[s].data) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Results for previously seen input, so identical geometry uploaded
+	//   twice is only ever optimised once.  Entries are found by content
+	//   hash but only returned when the stored input matches in full, and
+	//   the least recently used go once inputs and results together pass
+	//   kMaxBytes.
+	class Cache {
+	public:
+		static const size_t kMaxBytes = 64 * 1024 * 1024;
+
+		Cache()
+			: _bytes(0) {
+		}
+
+		std::shared_ptr<const Geometry> find(const Geometry& input) {
+			uint64_t hash = contentHash(input);
+			uvpp::ScopedLock lock(_mutex);
+			auto range = _index.equal_range(hash);
+			for (auto i = range.first; i != range.second; ++i) {
+				if (sameGeometry(*i->second->input, input)) {
+					_lru.splice(_lru.begin(), _lru, i->second);
+					return i->second->output;
+				}
+			}
+			return nullptr;
+		}
+
+		void insert(const Geometry& input, std::shared_ptr<const Geometry> output) {
+			size_t size = byteSize(input) + byteSize(*output);
+			if (size > kMaxBytes / 4) {
+				return;
+			}
+			uint64_t hash = contentHash(input);
+			_Entry entry;
+			entry.hash = hash;
+			entry.input = std::make_shared<Geometry>(input);
+			entry.output = output;
+			entry.bytes = size;
+
+			uvpp::ScopedLock lock(_mutex);
+			auto range = _index.equal_range(hash);
+			for (auto i = range.first; i != range.second; ++i) {
+				if (sameGeometry(*i->second->input, input)) {
+					return;
+				}
+			}
+			_lru.push_front(entry);
+			_index.emplace(hash, _lru.begin());
+			_bytes += size;
+			while (_bytes > kMaxBytes) {
+				_evict(--_lru.end());
+			}
+		}
+
+		void clear() {
+			uvpp::ScopedLock lock(_mutex);
+			_lru.clear();
+			_index.clear();
+			_bytes = 0;
+		}
+
+	private:
+		struct _Entry {
+			uint64_t hash;
+			std::shared_ptr<const Geometry> input;
+			std::shared_ptr<const Geometry> output;
+			size_t bytes;
+		};
+		typedef std::list<_Entry> List;
+
+		void _evict(List::iterator entry) {
+			auto range = _index.equal_range(entry->hash);
+			for (auto i = range.first; i != range.second; ++i) {
+				if (i->second == entry) {
+					_index.erase(i);
+					break;
+				}
+			}
+			_bytes -= entry->bytes;
+			_lru.erase(entry);
+		}
+
+		uvpp::Mutex _mutex;
+		List _lru;
+		std::unordered_multimap<uint64_t, List::iterator> _index;
+		size_t _bytes;
+
+	};
+	Cache gCache;
+}
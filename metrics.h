@@ -0,0 +1,356 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "uvpp.h"
+#include "uvhttp.h"
+
+// Counters, gauges and histograms that any thread can update cheaply,
+//   rendered on request in the Prometheus text format, plus a per-frame
+//   profile that can be switched on remotely.  handle() is the request
+//   handler for the metrics server iothread can run.
+namespace metrics {
+	// Monotonic count.  Any thread.
+	class Counter {
+	public:
+		Counter()
+			: _value(0) {
+		}
+
+		void add(uint64_t n = 1) {
+			_value.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		uint64_t value() const {
+			return _value.load(std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<uint64_t> _value;
+
+	};
+
+	// Current level of something.  Any thread; several threads may add
+	//   their share with add().
+	class Gauge {
+	public:
+		Gauge()
+			: _value(0) {
+		}
+
+		void set(int64_t value) {
+			_value.store(value, std::memory_order_relaxed);
+		}
+
+		void add(int64_t delta) {
+			_value.fetch_add(delta, std::memory_order_relaxed);
+		}
+
+		int64_t value() const {
+			return _value.load(std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<int64_t> _value;
+
+	};
+
+	// Counts observations into fixed buckets.  Any thread.  A scrape can
+	//   catch an observation counted in one field and not yet another,
+	//   which scrapers put up with.  Observations are taken as
+	//   non-negative; the sum keeps three decimal places.
+	class Histogram {
+	public:
+		// bounds are the buckets' upper limits, ascending; a +Inf bucket
+		//   is added after them.
+		Histogram(const double *bounds, size_t count)
+			: _bounds(bounds, bounds + count), _buckets(new std::atomic<uint64_t>[count + 1]), _count(0), _sumMilli(0) {
+			for (size_t b = 0; b <= count; ++b) {
+				_buckets[b].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		void observe(double value) {
+			size_t b = 0;
+			while (b < _bounds.size() && value > _bounds[b]) {
+				++b;
+			}
+			_buckets[b].fetch_add(1, std::memory_order_relaxed);
+			_count.fetch_add(1, std::memory_order_relaxed);
+			_sumMilli.fetch_add((uint64_t)(value * 1000.0 + 0.5), std::memory_order_relaxed);
+		}
+
+		const std::vector<double>& bounds() const {
+			return _bounds;
+		}
+
+		// Observations in bucket b alone; bounds().size() is +Inf.
+		uint64_t bucket(size_t b) const {
+			return _buckets[b].load(std::memory_order_relaxed);
+		}
+
+		uint64_t count() const {
+			return _count.load(std::memory_order_relaxed);
+		}
+
+		double sum() const {
+			return _sumMilli.load(std::memory_order_relaxed) / 1000.0;
+		}
+
+	private:
+		std::vector<double> _bounds;
+		std::unique_ptr<std::atomic<uint64_t>[]> _buckets;
+		std::atomic<uint64_t> _count;
+		std::atomic<uint64_t> _sumMilli;
+
+	};
+
+	// Rows of per-frame samples taken between start() and stop(), served
+	//   as CSV.  Recording stops by itself after kMaxRows.  record() costs
+	//   one atomic load while stopped; start(), stop() and render() may be
+	//   called from any thread.
+	class Profile {
+	public:
+		static const size_t kMaxRows = 60 * 60 * 10;
+
+		Profile(const std::vector<std::string>& columns)
+			: _columns(columns), _recording(false) {
+		}
+
+		// Drops the previous capture.
+		void start() {
+			uvpp::ScopedLock lock(_mutex);
+			_rows.clear();
+			_recording.store(true, std::memory_order_relaxed);
+		}
+
+		void stop() {
+			_recording.store(false, std::memory_order_relaxed);
+		}
+
+		bool recording() const {
+			return _recording.load(std::memory_order_relaxed);
+		}
+
+		// values holds one number per column.
+		void record(const double *values) {
+			if (!recording()) {
+				return;
+			}
+			uvpp::ScopedLock lock(_mutex);
+			if (_rows.size() >= kMaxRows * _columns.size()) {
+				return stop();
+			}
+			_rows.insert(_rows.end(), values, values + _columns.size());
+		}
+
+		void render(std::string& out) {
+			uvpp::ScopedLock lock(_mutex);
+			for (size_t c = 0; c < _columns.size(); ++c) {
+				out.append(c > 0 ? "," : "").append(_columns[c]);
+			}
+			out.append("\n");
+			char value[32];
+			for (size_t r = 0; r < _rows.size(); r += _columns.size()) {
+				for (size_t c = 0; c < _columns.size(); ++c) {
+					snprintf(value, sizeof(value), c > 0 ? ",%.3f" : "%.3f", _rows[r + c]);
+					out.append(value);
+				}
+				out.append("\n");
+			}
+		}
+
+	private:
+		std::vector<std::string> _columns;
+		std::atomic<bool> _recording;
+		uvpp::Mutex _mutex;
+		std::vector<double> _rows;
+
+	};
+
+	// Everything a scrape reports.  Metrics are registered once, usually
+	//   at startup, and must outlive the registry's use.  labels, when
+	//   given, is the inside of the braces, e.g. loop="0"; samples sharing
+	//   a name are reported together under the first one's help.
+	class Registry {
+	public:
+		typedef std::function<double()> Reader;
+
+		Registry()
+			: _profile(nullptr) {
+		}
+
+		void add(const std::string& name, const std::string& help, Counter& counter, const std::string& labels = std::string()) {
+			Entry entry(name, help, labels, Type::Counter);
+			entry.counter = &counter;
+			_add(entry);
+		}
+
+		void add(const std::string& name, const std::string& help, Gauge& gauge, const std::string& labels = std::string()) {
+			Entry entry(name, help, labels, Type::Gauge);
+			entry.gauge = &gauge;
+			_add(entry);
+		}
+
+		void add(const std::string& name, const std::string& help, Histogram& histogram) {
+			Entry entry(name, help, std::string(), Type::Histogram);
+			entry.histogram = &histogram;
+			_add(entry);
+		}
+
+		// A gauge read at scrape time, on the server's thread; reader may
+		//   only touch state that is safe to read from there.
+		void addReader(const std::string& name, const std::string& help, Reader reader, const std::string& labels = std::string()) {
+			Entry entry(name, help, labels, Type::Gauge);
+			entry.reader = reader;
+			_add(entry);
+		}
+
+		void setProfile(Profile *profile) {
+			uvpp::ScopedLock lock(_mutex);
+			_profile = profile;
+		}
+
+		Profile * profile() {
+			uvpp::ScopedLock lock(_mutex);
+			return _profile;
+		}
+
+		void render(std::string& out) {
+			uvpp::ScopedLock lock(_mutex);
+			std::vector<bool> done(_entries.size(), false);
+			for (size_t e = 0; e < _entries.size(); ++e) {
+				if (done[e]) {
+					continue;
+				}
+				const Entry& family = _entries[e];
+				out.append("# HELP ").append(family.name).append(" ").append(family.help).append("\n");
+				out.append("# TYPE ").append(family.name).append(" ").append(_typeName(family.type)).append("\n");
+				for (size_t k = e; k < _entries.size(); ++k) {
+					if (!done[k] && _entries[k].name == family.name) {
+						done[k] = true;
+						_renderEntry(_entries[k], out);
+					}
+				}
+			}
+		}
+
+	private:
+		enum class Type : uint32_t {
+			Counter,
+			Gauge,
+			Histogram
+		};
+
+		struct Entry {
+			Entry(const std::string& name, const std::string& help, const std::string& labels, Type type)
+				: name(name), help(help), labels(labels), type(type), counter(nullptr), gauge(nullptr), histogram(nullptr) {
+			}
+
+			std::string name;
+			std::string help;
+			std::string labels;
+			Type type;
+			Counter *counter;
+			Gauge *gauge;
+			Histogram *histogram;
+			Reader reader;
+		};
+
+		static const char * _typeName(Type type) {
+			switch (type) {
+			case Type::Counter: return "counter";
+			case Type::Gauge: return "gauge";
+			default: return "histogram";
+			}
+		}
+
+		static void _sample(std::string& out, const std::string& name, const std::string& labels, const char *value) {
+			out.append(name);
+			if (!labels.empty()) {
+				out.append("{").append(labels).append("}");
+			}
+			out.append(" ").append(value).append("\n");
+		}
+
+		static void _renderEntry(const Entry& entry, std::string& out) {
+			char value[32];
+			if (entry.counter) {
+				snprintf(value, sizeof(value), "%llu", (unsigned long long)entry.counter->value());
+				_sample(out, entry.name, entry.labels, value);
+			} else if (entry.gauge) {
+				snprintf(value, sizeof(value), "%lld", (long long)entry.gauge->value());
+				_sample(out, entry.name, entry.labels, value);
+			} else if (entry.reader) {
+				snprintf(value, sizeof(value), "%.10g", entry.reader());
+				_sample(out, entry.name, entry.labels, value);
+			} else if (entry.histogram) {
+				const Histogram& h = *entry.histogram;
+				uint64_t cumulative = 0;
+				char le[48];
+				for (size_t b = 0; b <= h.bounds().size(); ++b) {
+					cumulative += h.bucket(b);
+					if (b < h.bounds().size()) {
+						snprintf(le, sizeof(le), "le=\"%g\"", h.bounds()[b]);
+					} else {
+						snprintf(le, sizeof(le), "le=\"+Inf\"");
+					}
+					snprintf(value, sizeof(value), "%llu", (unsigned long long)cumulative);
+					_sample(out, entry.name + "_bucket", le, value);
+				}
+				snprintf(value, sizeof(value), "%.3f", h.sum());
+				_sample(out, entry.name + "_sum", std::string(), value);
+				snprintf(value, sizeof(value), "%llu", (unsigned long long)h.count());
+				_sample(out, entry.name + "_count", std::string(), value);
+			}
+		}
+
+		void _add(const Entry& entry) {
+			uvpp::ScopedLock lock(_mutex);
+			_entries.push_back(entry);
+		}
+
+		uvpp::Mutex _mutex;
+		std::vector<Entry> _entries;
+		Profile *_profile;
+
+	};
+
+	Registry _registry;
+
+	Registry& registry() {
+		return _registry;
+	}
+
+	// GET /metrics          every registered metric
+	// GET /profile          the last profile capture, as CSV
+	// POST /profile/start   starts a new capture
+	// POST /profile/stop    ends it
+	void handle(const http::Server::Request& request, http::Server::Reply& reply) {
+		Profile *profile = registry().profile();
+		bool post = request.method == "POST";
+		if (request.path == "/metrics") {
+			reply.contentType = "text/plain; version=0.0.4";
+			registry().render(reply.body);
+		} else if (request.path == "/profile" && profile) {
+			reply.contentType = "text/csv";
+			profile->render(reply.body);
+		} else if (request.path == "/profile/start" && profile && post) {
+			profile->start();
+			reply.body = "recording\n";
+		} else if (request.path == "/profile/stop" && profile && post) {
+			profile->stop();
+			reply.body = "stopped\n";
+		} else if (request.path == "/profile/start" || request.path == "/profile/stop") {
+			reply.statusCode = profile ? 405 : 404;
+			reply.body = profile ? "use POST\n" : "not found\n";
+		} else {
+			reply.statusCode = 404;
+			reply.body = "not found\n";
+		}
+	}
+}
@@ -14,6 +14,8 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <memory>
+#include <list>
 #include <map>
 #include <unordered_map>
 
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "math.h"
+#include "iothread.h"
+
+// Orders asset loads by what the camera can see.  An asset registers with
+//   its world-space bounding sphere and a function that starts its load;
+//   update() then ranks the ones still loading by how large they appear,
+//   puts those in view ahead of those outside it, and holds back any too
+//   small on screen to matter until the camera comes closer.  Main thread
+//   only.
+namespace streaming {
+	// The camera the frame is rendered with.
+	struct View {
+		// Clip space from world space, for column vectors.
+		math::Matrix4 viewProj;
+		math::Vector3 eye;
+		// The projection's vertical scale, 1 / tan(fovY / 2).
+		float focal;
+	};
+
+	class Manager {
+	public:
+		// Starts the asset's load and returns its request id, or 0 if
+		//   there is nothing left to steer, e.g. the body was cached.
+		typedef std::function<uint32_t(iothread::Priority, float)> Start;
+
+		Manager()
+			: _nextHandle(0), _minScreenSize(0.002f) {
+		}
+
+		// Returns a handle for remove().  Nothing starts until the next
+		//   update().
+		uint32_t add(const math::Vector3& center, float radius, Start start) {
+			uint32_t handle = ++_nextHandle;
+			Asset& asset = _assets[handle];
+			asset.center = center;
+			asset.radius = std::max(radius, 0.0f);
+			asset.start = start;
+			return handle;
+		}
+
+		// Forgets an asset.  A load already under way finishes as usual;
+		//   a deferred one never starts.
+		void remove(uint32_t handle) {
+			_assets.erase(handle);
+		}
+
+		void clear() {
+			_assets.clear();
+		}
+
+		// Apparent radius, as a fraction of half the viewport height, below
+		//   which a load is deferred.
+		void setMinScreenSize(float size) {
+			_minScreenSize = size;
+		}
+
+		// Assets registered and not yet started.
+		size_t deferred() const {
+			size_t count = 0;
+			for (auto& i : _assets) {
+				count += i.second.requestId == 0 ? 1 : 0;
+			}
+			return count;
+		}
+
+		// Once a frame.  Starts the assets that have become big enough,
+		//   most urgent first, and re-ranks the queued ones whose place has
+		//   moved noticeably.  Assets whose load has completed drop out.
+		void update(const View& view) {
+			math::Vector4 planes[6];
+			_frustum(view.viewProj, planes);
+
+			std::vector<uint32_t> done;
+			std::vector<Pending> starts;
+			std::vector<iothread::PriorityChange> changes;
+			for (auto& i : _assets) {
+				Asset& asset = i.second;
+				if (asset.requestId != 0 && !iothread::pending(asset.requestId)) {
+					done.push_back(i.first);
+					continue;
+				}
+
+				float distance = (asset.center - view.eye).norm();
+				bool inside = distance <= asset.radius;
+				float size = inside ? FLT_MAX : asset.radius * view.focal / distance;
+				if (asset.requestId == 0 && size < _minScreenSize) {
+					continue;
+				}
+				iothread::Priority priority = inside || _visible(planes, asset)
+					? iothread::Priority::Visible
+					: iothread::Priority::Prefetch;
+				float rank = inside ? 0.0f : 1.0f / std::max(size, FLT_MIN);
+
+				if (asset.requestId == 0) {
+					starts.push_back(Pending(i.first, priority, rank));
+				} else if (priority != asset.priority || rank < asset.rank * 0.8f || rank > asset.rank * 1.25f) {
+					asset.priority = priority;
+					asset.rank = rank;
+					changes.push_back(iothread::PriorityChange(asset.requestId, priority, rank));
+				}
+			}
+
+			for (auto i : done) {
+				_assets.erase(i);
+			}
+			if (!changes.empty()) {
+				iothread::setPriorities(changes);
+			}
+
+			// Loads that skip the scheduler run in dispatch order, so start
+			//   in the order they should arrive.
+			std::sort(starts.begin(), starts.end());
+			for (auto& i : starts) {
+				auto found = _assets.find(i.handle);
+				if (found == _assets.end()) {
+					continue;
+				}
+				Asset& asset = found->second;
+				asset.priority = i.priority;
+				asset.rank = i.rank;
+				asset.requestId = asset.start(i.priority, i.rank);
+				asset.start = nullptr;
+				if (asset.requestId == 0) {
+					_assets.erase(found);
+				}
+			}
+		}
+
+	private:
+		struct Asset {
+			Asset()
+				: radius(0.0f), requestId(0), priority(iothread::Priority::Prefetch), rank(0.0f) {
+			}
+
+			math::Vector3 center;
+			float radius;
+			Start start;
+			uint32_t requestId;
+			iothread::Priority priority;
+			float rank;
+		};
+
+		struct Pending {
+			Pending(uint32_t handle, iothread::Priority priority, float rank)
+				: handle(handle), priority(priority), rank(rank) {
+			}
+
+			bool operator<(const Pending& other) const {
+				if (priority != other.priority) {
+					return priority < other.priority;
+				}
+				return rank < other.rank;
+			}
+
+			uint32_t handle;
+			iothread::Priority priority;
+			float rank;
+		};
+
+		// Left, right, bottom, top, near and far planes, normalised so a
+		//   plane's dot product with a point is its signed distance.
+		static void _frustum(const math::Matrix4& m, math::Vector4 *planes) {
+			math::Vector4 w = m.row(3).transpose();
+			for (int r = 0; r < 3; ++r) {
+				math::Vector4 row = m.row(r).transpose();
+				planes[r * 2] = w + row;
+				planes[r * 2 + 1] = w - row;
+			}
+			for (int p = 0; p < 6; ++p) {
+				float length = planes[p].head<3>().norm();
+				if (length > 0.0f) {
+					planes[p] /= length;
+				}
+			}
+		}
+
+		static bool _visible(const math::Vector4 *planes, const Asset& asset) {
+			math::Vector4 center(asset.center.x(), asset.center.y(), asset.center.z(), 1.0f);
+			for (int p = 0; p < 6; ++p) {
+				if (planes[p].dot(center) < -asset.radius) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		uint32_t _nextHandle;
+		float _minScreenSize;
+		std::unordered_map<uint32_t, Asset> _assets;
+
+	};
+
+	Manager _manager;
+
+	Manager& manager() {
+		return _manager;
+	}
+}
@@ -1,19 +1,372 @@
 #pragma once
 
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <map>
 #include <vector>
+#include <zlib.h>
 #include "http_parser.h"
 #include "uvpp.h"
 
 namespace http {
+	struct Url {
+		std::string scheme;
+		std::string host;
+		uint16_t port;
+		std::string path;
+
+		// Value for the Host header; IPv6 literals need their brackets back.
+		std::string authority() const {
+			std::string out = host.find(':') != std::string::npos ? "[" + host + "]" : host;
+			if (port != 80) {
+				out += ":" + std::to_string(port);
+			}
+			return out;
+		}
+	};
+
+	bool parseUrl(const std::string& uri, Url& out) {
+		struct http_parser_url u;
+		memset(&u, 0, sizeof(u));
+		if (http_parser_parse_url(uri.c_str(), uri.size(), 0, &u) != 0) {
+			return false;
+		}
+		if (!(u.field_set & (1 << UF_HOST))) {
+			return false;
+		}
+
+		auto field = [&](int f) {
+			return std::string(uri.c_str() + u.field_data[f].off, u.field_data[f].len);
+		};
+
+		out.scheme = (u.field_set & (1 << UF_SCHEMA)) ? field(UF_SCHEMA) : "http";
+		for (auto& c : out.scheme) {
+			c = (char)tolower(c);
+		}
+		out.host = field(UF_HOST);
+		out.port = (u.field_set & (1 << UF_PORT)) ? u.port : 80;
+		out.path = (u.field_set & (1 << UF_PATH)) ? field(UF_PATH) : "/";
+		if (u.field_set & (1 << UF_QUERY)) {
+			out.path += "?" + field(UF_QUERY);
+		}
+		return true;
+	}
+
+	bool equalsIgnoreCase(const char *a, size_t aLen, const char *b) {
+		size_t len = strlen(b);
+		if (aLen != len) {
+			return false;
+		}
+		for (size_t i = 0; i < len; ++i) {
+			if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool equalsIgnoreCase(const std::string& a, const char *b) {
+		return equalsIgnoreCase(a.data(), a.size(), b);
+	}
+
+	// Bytes owned by something else, as far as VS2013 gets towards
+	//   std::string_view.  A null data pointer means "not there", which is
+	//   different from present but empty.
+	struct StringRef {
+		StringRef()
+			: data(nullptr), size(0) {
+		}
+
+		StringRef(const char *data, size_t size)
+			: data(data), size(size) {
+		}
+
+		bool valid() const {
+			return data != nullptr;
+		}
+
+		bool equalsIgnoreCase(const char *other) const {
+			return data && http::equalsIgnoreCase(data, size, other);
+		}
+
+		bool contains(char c) const {
+			return data && memchr(data, c, size) != nullptr;
+		}
+
+		std::string str() const {
+			return data ? std::string(data, size) : std::string();
+		}
+
+		const char *data;
+		size_t size;
+	};
+
+	// "bytes first-last/total"; total is -1 if the server sent "*".
+	bool parseContentRange(StringRef value, int64_t& first, int64_t& last, int64_t& total) {
+		char text[96];
+		if (value.size >= sizeof(text)) {
+			return false;
+		}
+		memcpy(text, value.data, value.size);
+		text[value.size] = 0;
+		long long a, b;
+		char rest[32];
+		if (sscanf(text, "bytes %lld-%lld/%31s", &a, &b, rest) != 3 || a < 0 || b < a) {
+			return false;
+		}
+		first = a;
+		last = b;
+		if (strcmp(rest, "*") == 0) {
+			total = -1;
+			return true;
+		}
+		char *end;
+		total = strtoll(rest, &end, 10);
+		return *end == 0 && total > b;
+	}
+
+	// The Cache-Control directives that matter to a private client cache.
+	struct CacheControl {
+		CacheControl()
+			: noStore(false), noCache(false), maxAge(-1) {
+		}
+
+		bool noStore;
+		bool noCache;
+		// -1 when there is no max-age.
+		int64_t maxAge;
+	};
+
+	// Adds one header value's directives to out, so repeated Cache-Control
+	//   headers combine as if comma-joined.
+	void parseCacheControl(const char *data, size_t len, CacheControl& out) {
+		const char *end = data + len;
+		while (data < end) {
+			const char *comma = (const char*)memchr(data, ',', end - data);
+			const char *tokenEnd = comma ? comma : end;
+			while (data < tokenEnd && (*data == ' ' || *data == '\t')) {
+				++data;
+			}
+			const char *nameEnd = data;
+			while (nameEnd < tokenEnd && *nameEnd != '=' && *nameEnd != ' ' && *nameEnd != '\t') {
+				++nameEnd;
+			}
+			if (equalsIgnoreCase(data, nameEnd - data, "no-store")) {
+				out.noStore = true;
+			} else if (equalsIgnoreCase(data, nameEnd - data, "no-cache")) {
+				out.noCache = true;
+			} else if (equalsIgnoreCase(data, nameEnd - data, "max-age") && nameEnd < tokenEnd && *nameEnd == '=') {
+				int64_t maxAge = 0;
+				const char *digit = nameEnd + 1;
+				if (digit < tokenEnd && *digit == '"') {
+					++digit;
+				}
+				for (; digit < tokenEnd && *digit >= '0' && *digit <= '9'; ++digit) {
+					maxAge = std::min<int64_t>(maxAge * 10 + (*digit - '0'), INT32_MAX);
+				}
+				out.maxAge = maxAge;
+			}
+			data = tokenEnd + 1;
+		}
+	}
+
+
+	enum class ContentEncoding : uint32_t {
+		Identity,
+		Gzip,
+		Deflate,
+		Other
+	};
+
+	// Header names and values live back to back in one buffer and are
+	//   looked up by offset, so parsing a header costs no allocation of
+	//   its own and the response stays valid when moved or copied.  The
+	//   headers the rest of the stack acts on are also parsed into typed
+	//   fields as they arrive.
 	struct Response {
+		friend class ResponseParser;
+
+		Response()
+			: statusCode(0), keepAlive(false), contentLength(-1), contentEncoding(ContentEncoding::Identity),
+			_etag(kNoHeader) {
+		}
+
+		size_t headerCount() const {
+			return _headers.size();
+		}
+
+		StringRef headerName(size_t index) const {
+			return StringRef(_headerData.data() + _headers[index].name, _headers[index].nameLength);
+		}
+
+		StringRef headerValue(size_t index) const {
+			return StringRef(_headerData.data() + _headers[index].value, _headers[index].valueLength);
+		}
+
+		// First header called name, ignoring case; invalid if there is none.
+		StringRef header(const char *name) const {
+			for (size_t i = 0; i < _headers.size(); ++i) {
+				if (headerName(i).equalsIgnoreCase(name)) {
+					return headerValue(i);
+				}
+			}
+			return StringRef();
+		}
+
+		StringRef etag() const {
+			return _etag == kNoHeader ? StringRef() : headerValue(_etag);
+		}
+
+		void addHeader(const std::string& name, const std::string& value) {
+			_HeaderSlice slice;
+			slice.name = (uint32_t)_headerData.size();
+			slice.nameLength = (uint32_t)name.size();
+			_headerData.append(name);
+			slice.value = (uint32_t)_headerData.size();
+			slice.valueLength = (uint32_t)value.size();
+			_headerData.append(value);
+			_headers.push_back(slice);
+			_classify(_headers.size() - 1);
+		}
+
+		// Empties the response but keeps its header buffers for the next
+		//   one.
+		void clear() {
+			statusCode = 0;
+			keepAlive = false;
+			contentLength = -1;
+			contentEncoding = ContentEncoding::Identity;
+			cacheControl = CacheControl();
+			std::vector<uint8_t>().swap(body);
+			_headerData.clear();
+			_headers.clear();
+			_etag = kNoHeader;
+		}
+
 		uint32_t statusCode;
-		std::vector<std::pair<std::string, std::string>> headers;
+		bool keepAlive;
+		// Length of the body as delivered; -1 when the server didn't send
+		//   one or when the body is being decompressed.
+		int64_t contentLength;
+		ContentEncoding contentEncoding;
+		CacheControl cacheControl;
 		std::vector<uint8_t> body;
+
+	private:
+		static const uint32_t kNoHeader = 0xFFFFFFFF;
+
+		struct _HeaderSlice {
+			uint32_t name;
+			uint32_t nameLength;
+			uint32_t value;
+			uint32_t valueLength;
+		};
+
+		void _classify(size_t index) {
+			StringRef name = headerName(index);
+			StringRef value = headerValue(index);
+			if (name.equalsIgnoreCase("Content-Encoding")) {
+				if (value.equalsIgnoreCase("gzip") || value.equalsIgnoreCase("x-gzip")) {
+					contentEncoding = ContentEncoding::Gzip;
+				} else if (value.equalsIgnoreCase("deflate")) {
+					contentEncoding = ContentEncoding::Deflate;
+				} else if (!value.equalsIgnoreCase("identity")) {
+					contentEncoding = ContentEncoding::Other;
+				}
+			} else if (name.equalsIgnoreCase("Cache-Control")) {
+				parseCacheControl(value.data, value.size, cacheControl);
+			} else if (name.equalsIgnoreCase("ETag") && _etag == kNoHeader) {
+				_etag = (uint32_t)index;
+			}
+		}
+
+		std::string _headerData;
+		std::vector<_HeaderSlice> _headers;
+		uint32_t _etag;
 	};
 
+	// Seconds since the epoch for an IMF-fixdate such as
+	//   "Sun, 06 Nov 1994 08:49:37 GMT", the one format servers still
+	//   send; -1 for anything else.
+	int64_t parseHttpDate(StringRef date) {
+		static const char *kMonths[] = {
+			"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+		};
+		char text[40];
+		if (!date.valid() || date.size >= sizeof(text)) {
+			return -1;
+		}
+		memcpy(text, date.data, date.size);
+		text[date.size] = 0;
+		char month[4];
+		int day, year, hour, minute, second;
+		if (sscanf(text, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &day, month, &year, &hour, &minute, &second) != 6) {
+			return -1;
+		}
+		struct tm fields;
+		memset(&fields, 0, sizeof(fields));
+		fields.tm_mon = -1;
+		for (int m = 0; m < 12; ++m) {
+			if (strcmp(month, kMonths[m]) == 0) {
+				fields.tm_mon = m;
+			}
+		}
+		if (fields.tm_mon < 0) {
+			return -1;
+		}
+		fields.tm_year = year - 1900;
+		fields.tm_mday = day;
+		fields.tm_hour = hour;
+		fields.tm_min = minute;
+		fields.tm_sec = second;
+#ifdef _WIN32
+		return (int64_t)_mkgmtime(&fields);
+#else
+		return (int64_t)timegm(&fields);
+#endif
+	}
+
+	// Seconds a response may be reused for without asking the server again:
+	//   0 for no-store or no-cache, otherwise max-age, otherwise Expires
+	//   counted from Date (or from now without one).  An Expires that
+	//   doesn't parse means already expired.  -1 when the response gives
+	//   no lifetime at all.
+	int64_t freshnessLifetime(const CacheControl& cacheControl, StringRef expiresHeader, StringRef dateHeader) {
+		if (cacheControl.noStore || cacheControl.noCache) {
+			return 0;
+		}
+		if (cacheControl.maxAge >= 0) {
+			return cacheControl.maxAge;
+		}
+		if (!expiresHeader.valid()) {
+			return -1;
+		}
+		int64_t expires = parseHttpDate(expiresHeader);
+		int64_t date = parseHttpDate(dateHeader);
+		if (date < 0) {
+			date = (int64_t)time(nullptr);
+		}
+		return expires > date ? expires - date : 0;
+	}
+
+	int64_t freshnessLifetime(const Response& response) {
+		return freshnessLifetime(response.cacheControl, response.header("Expires"), response.header("Date"));
+	}
+
 	class ResponseParser {
 	public:
-		ResponseParser() {
+		// Most a Content-Length alone gets preallocated; larger bodies grow
+		//   as they arrive, so a bogus header can't exhaust memory up front.
+		static const int64_t kMaxReserve = 256 * 1024 * 1024;
+
+		ResponseParser()
+			: _headerState(HeaderState::Done), _decoding(false), _inflateDone(false), _rawDeflate(false),
+			_appendDirect(false) {
+			memset(&_zstream, 0, sizeof(_zstream));
 			http_parser_init(&_parser, HTTP_RESPONSE);
 			_parser.data = this;
 			_settings.on_message_begin = &_parserCb < &ResponseParser::_onMessageBegin > ;
@@ -26,15 +379,34 @@ namespace http {
 			_settings.on_message_complete = &_parserCb < &ResponseParser::_onMessageComplete > ;
 		}
 
+		virtual ~ResponseParser() {
+			_endDecode();
+		}
+
 		void parse(const char *data, size_t len) {
-			http_parser_execute(&_parser, &_settings, data, len);
+			size_t parsed = http_parser_execute(&_parser, &_settings, data, len);
+			if (parsed != len || HTTP_PARSER_ERRNO(&_parser) != HPE_OK) {
+				this->onError((uint32_t)UV_EPROTO);
+			}
 		}
 
+		// The connection closed.  Completes a body delimited by the close
+		//   and fails one cut short, whether the framing or the compressed
+		//   stream ran out first.  An error already reported by parse()
+		//   isn't reported again.
 		void finish() {
+			if (HTTP_PARSER_ERRNO(&_parser) != HPE_OK) {
+				return;
+			}
 			http_parser_execute(&_parser, &_settings, nullptr, 0);
+			bool truncated = _decoding && !_inflateDone && _zstream.total_in > 0;
+			if (HTTP_PARSER_ERRNO(&_parser) != HPE_OK || truncated) {
+				this->onError((uint32_t)UV_EPROTO);
+			}
 		}
 
-		virtual void onComplete(const Response& response) {
+		// The response may be moved from; the parser resets it afterwards.
+		virtual void onComplete(Response& response) {
 			printf("HttpResponseParser::onComplete\n");
 		}
 
@@ -42,10 +414,21 @@ namespace http {
 			printf("HttpResponseParser::onError(%d)\n", code);
 		}
 
+		// Return true to consume a body chunk instead of having it appended
+		//   to Response::body.  Status and headers are already filled in.
+		virtual bool onBody(const Response& response, const char *data, size_t len) {
+			return false;
+		}
+
 	private:
+		static const size_t kInflateChunk = 64 * 1024;
+		static const size_t kHeaderReserve = 1024;
+		static const size_t kHeaderCountReserve = 16;
+
 		enum class HeaderState : uint32_t {
 			Name,
-			Value
+			Value,
+			Done
 		};
 
 		template<int(ResponseParser::*F)()>
@@ -58,6 +441,12 @@ namespace http {
 		}
 
 		int _onMessageBegin() {
+			_endDecode();
+			_headerState = HeaderState::Done;
+			if (_response._headerData.capacity() == 0) {
+				_response._headerData.reserve(kHeaderReserve);
+				_response._headers.reserve(kHeaderCountReserve);
+			}
 			return 0;
 		}
 		int _onUrl(const char *at, size_t len) {
@@ -67,63 +456,298 @@ namespace http {
 			_response.statusCode = _parser.status_code;
 			return 0;
 		}
+		// Names and values can arrive split across reads; each piece is
+		//   appended to the response's header buffer in place.
 		int _onHeaderField(const char *at, size_t len) {
-			if (_headerState == HeaderState::Value) {
-				_response.headers.emplace_back(_headerName, _headerValue);
-				_headerName.resize(0);
-				_headerValue.resize(0);
+			if (_headerState != HeaderState::Name) {
+				_endHeader();
+				Response::_HeaderSlice slice;
+				slice.name = (uint32_t)_response._headerData.size();
+				slice.nameLength = 0;
+				slice.value = 0;
+				slice.valueLength = 0;
+				_response._headers.push_back(slice);
+				_headerState = HeaderState::Name;
 			}
-			_headerName += std::string(at, len);
-			_headerState = HeaderState::Name;
+			_response._headerData.append(at, len);
+			_response._headers.back().nameLength += (uint32_t)len;
 			return 0;
 		}
 		int _onHeaderValue(const char *at, size_t len) {
-			_headerValue += std::string(at, len);
-			_headerState = HeaderState::Value;
+			if (_headerState != HeaderState::Value) {
+				_response._headers.back().value = (uint32_t)_response._headerData.size();
+				_headerState = HeaderState::Value;
+			}
+			_response._headerData.append(at, len);
+			_response._headers.back().valueLength += (uint32_t)len;
 			return 0;
 		}
+		void _endHeader() {
+			if (_headerState == HeaderState::Name) {
+				_response._headers.back().value = (uint32_t)_response._headerData.size();
+			}
+			if (_headerState != HeaderState::Done) {
+				_response._classify(_response._headers.size() - 1);
+			}
+		}
 		int _onHeadersComplete() {
-			if (_headerState == HeaderState::Value) {
-				_response.headers.emplace_back(_headerName, _headerValue);
-				_headerName.resize(0);
-				_headerValue.resize(0);
+			_endHeader();
+			_headerState = HeaderState::Done;
+			_response.keepAlive = http_should_keep_alive(&_parser) != 0;
+			if (_parser.content_length != ULLONG_MAX && _parser.content_length <= INT64_MAX) {
+				_response.contentLength = (int64_t)_parser.content_length;
+			}
+			// 1 tells http_parser no body follows, whatever Content-Length
+			//   says; a 304 may carry the length of the body it stands for.
+			//   Any other nonzero value fails the response.
+			uint32_t status = _response.statusCode;
+			if (status == 304 || status == 204 || (status >= 100 && status < 200)) {
+				return 1;
+			}
+			if (!_beginDecode(_response.contentEncoding)) {
+				return 2;
 			}
-
 			return 0;
 		}
 		int _onBody(const char *at, size_t len) {
+			if (_decoding) {
+				return _inflate(at, len);
+			}
+			return _deliver(at, len);
+		}
+		int _deliver(const char *at, size_t len) {
+			if (this->onBody(_response, at, len)) {
+				return 0;
+			}
+			// Nobody is streaming this body, so the rest of it inflates
+			//   straight into Response::body.
+			_appendDirect = _decoding;
+			// Size the body once up front rather than growing it per chunk.
+			//   The cap keeps a bogus header from reserving unbounded memory.
+			if (_response.body.empty() && _response.contentLength > 0) {
+				_response.body.reserve((size_t)std::min<int64_t>(_response.contentLength, (int64_t)kMaxReserve));
+			}
 			size_t offset = _response.body.size();
 			_response.body.resize(offset + len);
 			memcpy(&_response.body[offset], at, len);
 			return 0;
 		}
 		int _onMessageComplete() {
+			// A compressed body cut short is an error; no body at all (HEAD,
+			//   304) is fine.
+			if (_decoding && !_inflateDone && _zstream.total_in > 0) {
+				return 1;
+			}
 			this->onComplete(_response);
-			_response = Response();
+			_response.clear();
 			return 0;
 		}
 
+		// gzip and zlib-wrapped deflate are told apart by their headers.
+		//   Some servers send raw deflate streams for "deflate"; that only
+		//   shows up as an error on the first bytes, so retry those raw.
+		bool _beginDecode(ContentEncoding encoding) {
+			_rawDeflate = encoding == ContentEncoding::Deflate;
+			if (encoding == ContentEncoding::Identity) {
+				return true;
+			} else if (encoding == ContentEncoding::Other) {
+				return false;
+			}
+			if (inflateInit2(&_zstream, 15 + 32) != Z_OK) {
+				return false;
+			}
+			_decoding = true;
+			_inflateDone = false;
+			_appendDirect = false;
+			_response.contentLength = -1;
+			return true;
+		}
+
+		void _endDecode() {
+			if (_decoding) {
+				inflateEnd(&_zstream);
+				memset(&_zstream, 0, sizeof(_zstream));
+				_decoding = false;
+			}
+		}
+
+		// Inflates one body chunk without buffering the compressed bytes.
+		//   Output goes to the tail of Response::body once nobody streams
+		//   the body, otherwise through a scratch buffer to onBody.
+		int _inflate(const char *at, size_t len) {
+			if (_inflateDone) {
+				return 0;
+			}
+			bool first = _zstream.total_in == 0;
+			_zstream.next_in = (Bytef*)at;
+			_zstream.avail_in = (uInt)len;
+			while (true) {
+				std::vector<uint8_t>& body = _response.body;
+				size_t offset = body.size();
+				uint8_t *out;
+				size_t room;
+				if (_appendDirect) {
+					room = kInflateChunk;
+					body.resize(offset + room);
+					out = &body[offset];
+				} else {
+					_inflateScratch.resize(kInflateChunk);
+					room = kInflateChunk;
+					out = &_inflateScratch[0];
+				}
+				_zstream.next_out = out;
+				_zstream.avail_out = (uInt)room;
+				int rc = inflate(&_zstream, Z_NO_FLUSH);
+				size_t produced = room - _zstream.avail_out;
+				if (_appendDirect) {
+					body.resize(offset + produced);
+				}
+
+				if (rc == Z_DATA_ERROR && first && _rawDeflate) {
+					_rawDeflate = false;
+					if (inflateReset2(&_zstream, -15) != Z_OK) {
+						return 1;
+					}
+					_zstream.next_in = (Bytef*)at;
+					_zstream.avail_in = (uInt)len;
+					continue;
+				}
+				if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+					return 1;
+				}
+				if (produced > 0 && !_appendDirect && _deliver((const char*)out, produced) != 0) {
+					return 1;
+				}
+				if (rc == Z_STREAM_END) {
+					_inflateDone = true;
+					return 0;
+				}
+				// Stop once the input is used up and the output had room to
+				//   spare, meaning inflate has nothing more to give.
+				if (rc == Z_BUF_ERROR || (_zstream.avail_in == 0 && produced < room)) {
+					return 0;
+				}
+			}
+		}
+
 		http_parser _parser;
 		http_parser_settings _settings;
 		Response _response;
 		HeaderState _headerState;
-		std::string _headerName;
-		std::string _headerValue;
+		z_stream _zstream;
+		bool _decoding;
+		bool _inflateDone;
+		bool _rawDeflate;
+		bool _appendDirect;
+		std::vector<uint8_t> _inflateScratch;
+
+	};
+
+	typedef std::vector<std::pair<std::string, std::string>> Headers;
+
+	// Supplies a request body a slice at a time.  The next slice is pulled
+	//   only once the previous one has been written, and each slice must
+	//   stay valid until then.  A length of -1 sends the body chunked.
+	class BodySource {
+	public:
+		virtual ~BodySource() {
+		}
+
+		virtual int64_t length() const = 0;
+
+		// Returns false once the body is exhausted.
+		virtual bool next(const char *& data, size_t& len) = 0;
+
+	};
+
+	// Body already in memory, written straight from the blob in slices of
+	//   at most kSliceSize.
+	class BlobBody : public BodySource {
+	public:
+		static const size_t kSliceSize = 1024 * 1024;
+
+		BlobBody(std::shared_ptr<uvpp::Blob> blob)
+			: _blob(blob), _offset(0) {
+		}
+
+		int64_t length() const override {
+			return (int64_t)_blob->size();
+		}
+
+		bool next(const char *& data, size_t& len) override {
+			if (_offset >= _blob->size()) {
+				return false;
+			}
+			data = (const char*)_blob->data() + _offset;
+			len = std::min(_blob->size() - _offset, (size_t)kSliceSize);
+			_offset += len;
+			return true;
+		}
+
+	private:
+		std::shared_ptr<uvpp::Blob> _blob;
+		size_t _offset;
 
 	};
 
 	class Socket : public uvpp::TcpSocket {
 	public:
 		Socket(uvpp::EventLoop& loop)
-			: TcpSocket(loop), _parser(*this) {
+			: TcpSocket(loop), _parser(*this), _chunked(false) {
 		}
 
 		void request(const std::string& host, const std::string& path) {
-			std::string out;
-			out += "GET " + path + " HTTP/1.1\r\n";
-			out += "Host: " + host + "\r\n";
-			out += "\r\n";
-			send(out.c_str(), out.size());
+			request("GET", host, path, Headers(), nullptr);
+		}
+
+		// The head is built in one reserved string and written without a
+		//   further copy; the body streams after it.
+		void request(const std::string& method, const std::string& host, const std::string& path,
+			const Headers& headers, std::shared_ptr<BodySource> body) {
+			char lengthStr[32] = "";
+			_chunked = body && body->length() < 0;
+			if (body && !_chunked) {
+				sprintf(lengthStr, "%llu", (unsigned long long)body->length());
+			}
+
+			size_t size = method.size() + path.size() + host.size() + 64 + (body ? 48 : 0);
+			for (auto& i : headers) {
+				size += i.first.size() + i.second.size() + 4;
+			}
+			auto head = std::make_shared<std::string>();
+			head->reserve(size);
+			head->append(method).append(" ").append(path).append(" HTTP/1.1\r\n");
+			head->append("Host: ").append(host).append("\r\n");
+			bool acceptEncoding = false;
+			for (auto& i : headers) {
+				head->append(i.first).append(": ").append(i.second).append("\r\n");
+				acceptEncoding = acceptEncoding || equalsIgnoreCase(i.first, "Accept-Encoding");
+			}
+			if (!acceptEncoding) {
+				head->append("Accept-Encoding: gzip, deflate\r\n");
+			}
+			if (_chunked) {
+				head->append("Transfer-Encoding: chunked\r\n");
+			} else if (body) {
+				head->append("Content-Length: ").append(lengthStr).append("\r\n");
+			}
+			head->append("\r\n");
+
+			uv_buf_t buf = uv_buf_init(&(*head)[0], (unsigned int)head->size());
+			int32_t result = write(&buf, 1, [head](int32_t status) {});
+			if (result < 0) {
+				this->onError((uint32_t)result);
+				return;
+			}
+
+			_body = body;
+			if (_body) {
+				_pumpBody();
+			}
+		}
+
+		bool sendingBody() const {
+			return _body != nullptr;
 		}
 
 		virtual void onConnect() override {
@@ -135,15 +759,19 @@ namespace http {
 			_parser.finish();
 		}
 
-		virtual void onResponse(const Response& response) {
+		virtual void onResponse(Response& response) {
 			printf("HttpSocket::onResponse()\n");
 		}
 
+		virtual bool onResponseBody(const Response& response, const char *data, size_t len) {
+			return false;
+		}
+
 		virtual void onError(uint32_t code) override {
 			printf("HttpSocket::onError(%d)\n", code);
 		}
 
-	private:
+	protected:
 		virtual void onRecv(const char *data, size_t len) override {
 			printf("HttpSocket::onRecv(%p, %d)\n", data, len);
 			_parser.parse(data, len);
@@ -154,18 +782,598 @@ namespace http {
 			_ResponseParser(Socket& owner)
 				: _owner(owner) {
 			}
-			void onComplete(const Response& response) override {
+			void onComplete(Response& response) override {
 				_owner.onResponse(response);
 			}
 			void onError(uint32_t code) override {
 				_owner.onError(code);
 			}
+			bool onBody(const Response& response, const char *data, size_t len) override {
+				return _owner.onResponseBody(response, data, len);
+			}
 		private:
 			Socket& _owner;
 		};
 
+	private:
+
+		// One slice in flight at a time, so a large body never sits in the
+		//   write queue all at once.
+		void _pumpBody() {
+			const char *data;
+			size_t len = 0;
+			while (_body->next(data, len) && len == 0) {
+			}
+			if (len == 0) {
+				if (_chunked) {
+					send("0\r\n\r\n", 5);
+				}
+				_body = nullptr;
+				return;
+			}
+
+			if (_chunked) {
+				char line[24];
+				int lineLen = sprintf(line, "%llx\r\n", (unsigned long long)len);
+				send(line, lineLen);
+			}
+			std::shared_ptr<BodySource> body = _body;
+			uv_buf_t buf = uv_buf_init((char*)data, (unsigned int)len);
+			int32_t result = write(&buf, 1, [this, body](int32_t status) {
+				if (status < 0 || _body != body) {
+					return;
+				}
+				if (_chunked) {
+					send("\r\n", 2);
+				}
+				_pumpBody();
+			});
+			if (result < 0) {
+				_body = nullptr;
+				this->onError((uint32_t)result);
+			}
+		}
+
 		std::string _uri;
 		_ResponseParser _parser;
+		std::shared_ptr<BodySource> _body;
+		bool _chunked;
+
+	};
+
+	// Receives the outcome of a pooled request.  Exactly one of
+	//   onResponse/onError fires; onBody may fire before either.
+	class RequestHandler {
+	public:
+		virtual void onResponse(Response& response) = 0;
+		virtual void onError(int32_t code) = 0;
+		virtual bool onBody(const Response& response, const char *data, size_t len) {
+			return false;
+		}
+	};
+
+	// Keep-alive connection pool for one loop.  Connections are keyed by
+	//   authority; at most maxPerHost are open to any one key and requests
+	//   beyond that queue until a connection frees up.  Connections idle for
+	//   idleTimeoutMs are closed.  Loop-thread only.
+	class Pool {
+	public:
+		Pool(uvpp::EventLoop& loop, size_t maxPerHost = 6, uint64_t idleTimeoutMs = 30000)
+			: _loop(loop), _maxPerHost(maxPerHost), _idleTimeoutMs(idleTimeoutMs), _sweepTimer(*this) {
+		}
+
+		~Pool() {
+			for (auto& i : _hosts) {
+				for (auto& c : i.second.connections) {
+					delete c;
+				}
+			}
+		}
+
+		// host is the request authority and doubles as the pool key; addr is
+		//   only used if a new connection has to be opened.
+		void request(const struct sockaddr *addr, const std::string& host, const std::string& path, RequestHandler *handler) {
+			request(addr, host, "GET", path, Headers(), nullptr, handler);
+		}
+
+		// Requests with a body are never retried on a fresh connection;
+		//   the body may already be partly consumed and the method may not
+		//   be idempotent.
+		void request(const struct sockaddr *addr, const std::string& host, const std::string& method, const std::string& path,
+			const Headers& headers, std::shared_ptr<BodySource> body, RequestHandler *handler) {
+			Pending pending;
+			memcpy(&pending.addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+			pending.method = method;
+			pending.path = path;
+			pending.headers = headers;
+			pending.body = body;
+			pending.handler = handler;
+			pending.retried = body != nullptr;
+			_hosts[host].queue.push_back(pending);
+			_dispatch(host);
+		}
+
+		// Drops handler's request without calling it back.  A request that
+		//   already has a connection costs that connection; it's closed
+		//   rather than drained, since the rest of the response could be
+		//   arbitrarily large.
+		bool cancel(RequestHandler *handler) {
+			for (auto& i : _hosts) {
+				std::deque<Pending>& queue = i.second.queue;
+				for (auto p = queue.begin(); p != queue.end(); ++p) {
+					if (p->handler == handler) {
+						queue.erase(p);
+						return true;
+					}
+				}
+				for (auto& c : i.second.connections) {
+					if (c->handler() == handler) {
+						c->abandon();
+						_discard(c);
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+
+	private:
+		struct Pending {
+			struct sockaddr_storage addr;
+			std::string method;
+			std::string path;
+			Headers headers;
+			std::shared_ptr<BodySource> body;
+			RequestHandler *handler;
+			bool retried;
+		};
+
+		class Connection : public Socket {
+		public:
+			enum class State : uint32_t {
+				Connecting,
+				Active,
+				Idle,
+				Closing
+			};
+
+			Connection(Pool& pool, const std::string& host)
+				: Socket(pool._loop), _pool(pool), _host(host), _state(State::Connecting),
+				_reused(false), _received(false), _idleSince(0) {
+			}
+
+			void start(const Pending& pending) {
+				_pending = pending;
+				if (!connect(reinterpret_cast<const struct sockaddr*>(&_pending.addr))) {
+					_fail(UV_EINVAL);
+				}
+			}
+
+			void reuse(const Pending& pending) {
+				_pending = pending;
+				_reused = true;
+				_send();
+			}
+
+			const std::string& host() const { return _host; }
+			State state() const { return _state; }
+			RequestHandler *handler() const {
+				return _state == State::Connecting || _state == State::Active ? _pending.handler : nullptr;
+			}
+			uint64_t idleSince() const { return _idleSince; }
+
+			void markIdle(uint64_t now) {
+				_state = State::Idle;
+				_idleSince = now;
+			}
+
+			void shutdown() {
+				_state = State::Closing;
+				close();
+			}
+
+			void abandon() {
+				_pending.handler = nullptr;
+				_pending.body = nullptr;
+			}
+
+		private:
+			void _send() {
+				_state = State::Active;
+				_received = false;
+				request(_pending.method, _host, _pending.path, _pending.headers, _pending.body);
+				_pending.body = nullptr;
+			}
+
+			// A reused connection the server dropped while it sat idle fails
+			//   before any response bytes arrive; that request gets one more
+			//   try on a fresh connection.
+			void _fail(int32_t code) {
+				if (_state == State::Closing) {
+					return;
+				}
+				RequestHandler *handler = _state == State::Idle ? nullptr : _pending.handler;
+				bool retry = handler && _reused && !_received && !_pending.retried;
+				Pending pending = _pending;
+				_pool._discard(this);
+				if (retry) {
+					pending.retried = true;
+					_pool._retry(_host, pending);
+				} else if (handler) {
+					handler->onError(code);
+				}
+			}
+
+			virtual void onConnect() override {
+				_send();
+			}
+			virtual void onRecv(const char *data, size_t len) override {
+				_received = true;
+				Socket::onRecv(data, len);
+			}
+			virtual void onResponse(Response& response) override {
+				if (_state != State::Active) {
+					return;
+				}
+				RequestHandler *handler = _pending.handler;
+				_pending.handler = nullptr;
+				bool keepAlive = response.keepAlive;
+				handler->onResponse(response);
+				_pool._release(this, keepAlive);
+			}
+			virtual bool onResponseBody(const Response& response, const char *data, size_t len) override {
+				if (_state != State::Active) {
+					return false;
+				}
+				return _pending.handler->onBody(response, data, len);
+			}
+			virtual void onClose() override {
+				// Lets the parser finish a body delimited by connection close.
+				Socket::onClose();
+				_fail(UV_ECONNRESET);
+			}
+			virtual void onError(uint32_t code) override {
+				_fail((int32_t)code);
+			}
+			virtual void onDisposed() override {
+				delete this;
+			}
+
+			Pool& _pool;
+			std::string _host;
+			State _state;
+			Pending _pending;
+			bool _reused;
+			bool _received;
+			uint64_t _idleSince;
+		};
+
+		struct Host {
+			std::vector<Connection*> connections;
+			std::vector<Connection*> idle;
+			std::deque<Pending> queue;
+		};
+
+		class _SweepTimer : public uvpp::Timer {
+		public:
+			_SweepTimer(Pool& owner)
+				: uvpp::Timer(owner._loop), _owner(owner) {
+			}
+			virtual void onTimer() override {
+				_owner._sweep();
+			}
+		private:
+			Pool& _owner;
+		};
+
+		// Most recently used idle connections go first; they are the least
+		//   likely to have been timed out by the server.  Retries always get
+		//   a fresh connection.
+		void _dispatch(const std::string& key) {
+			Host& host = _hosts[key];
+			while (!host.queue.empty()) {
+				if (!host.idle.empty() && !host.queue.front().retried) {
+					Connection *conn = host.idle.back();
+					host.idle.pop_back();
+					Pending pending = host.queue.front();
+					host.queue.pop_front();
+					conn->reuse(pending);
+				} else if (host.connections.size() < _maxPerHost) {
+					Connection *conn = new Connection(*this, key);
+					host.connections.push_back(conn);
+					Pending pending = host.queue.front();
+					host.queue.pop_front();
+					conn->start(pending);
+				} else {
+					break;
+				}
+			}
+		}
+
+		void _retry(const std::string& key, const Pending& pending) {
+			_hosts[key].queue.push_front(pending);
+			_dispatch(key);
+		}
+
+		void _release(Connection *conn, bool keepAlive) {
+			if (conn->state() != Connection::State::Active) {
+				return;
+			}
+			// An early response can arrive while the body is still going out.
+			if (!keepAlive || conn->sendingBody()) {
+				return _discard(conn);
+			}
+			conn->markIdle(_loop.now());
+			_hosts[conn->host()].idle.push_back(conn);
+			if (!_sweepTimer.active()) {
+				_sweepTimer.start(_idleTimeoutMs / 2 + 1, _idleTimeoutMs / 2 + 1);
+			}
+			_dispatch(conn->host());
+		}
+
+		// The connection deletes itself once its handle has closed.
+		void _discard(Connection *conn) {
+			Host& host = _hosts[conn->host()];
+			host.idle.erase(std::remove(host.idle.begin(), host.idle.end(), conn), host.idle.end());
+			host.connections.erase(std::remove(host.connections.begin(), host.connections.end(), conn), host.connections.end());
+			conn->shutdown();
+			_dispatch(conn->host());
+		}
+
+		void _sweep() {
+			uint64_t now = _loop.now();
+			std::vector<Connection*> expired;
+			bool anyIdle = false;
+			for (auto& i : _hosts) {
+				for (auto& c : i.second.idle) {
+					if (now - c->idleSince() >= _idleTimeoutMs) {
+						expired.push_back(c);
+					} else {
+						anyIdle = true;
+					}
+				}
+			}
+			for (auto& c : expired) {
+				_discard(c);
+			}
+			if (!anyIdle) {
+				_sweepTimer.stop();
+			}
+		}
+
+		uvpp::EventLoop& _loop;
+		size_t _maxPerHost;
+		uint64_t _idleTimeoutMs;
+		_SweepTimer _sweepTimer;
+		std::map<std::string, Host> _hosts;
+
+	};
+
+	// Small HTTP/1.1 server for local tooling.  Each connection carries
+	//   one request, answered in full by the handler and then closed;
+	//   request bodies are read past and ignored.  Loop-thread only.
+	class Server {
+	public:
+		struct Request {
+			std::string method;
+			std::string path;
+			std::string query;
+		};
+
+		struct Reply {
+			Reply()
+				: statusCode(200), contentType("text/plain; charset=utf-8") {
+			}
+
+			uint32_t statusCode;
+			std::string contentType;
+			std::string body;
+		};
+
+		typedef std::function<void(const Request& request, Reply& reply)> Handler;
+
+		Server(uvpp::EventLoop& loop, Handler handler)
+			: _loop(loop), _handler(handler), _listener(nullptr) {
+		}
+
+		~Server() {
+			close();
+		}
+
+		// host is a numeric address; 127.0.0.1 keeps the server local.
+		bool listen(const std::string& host, uint16_t port) {
+			struct sockaddr_in addr;
+			if (_listener || uv_ip4_addr(host.c_str(), port, &addr) != 0) {
+				return false;
+			}
+			_listener = new Listener(*this, _loop);
+			if (!_listener->listen(reinterpret_cast<const struct sockaddr*>(&addr))) {
+				_listener->close();
+				_listener = nullptr;
+				return false;
+			}
+			return true;
+		}
+
+		// Stops listening and drops every open connection.
+		void close() {
+			if (_listener) {
+				_listener->close();
+				_listener = nullptr;
+			}
+			std::vector<Connection*> connections;
+			connections.swap(_connections);
+			for (auto& i : connections) {
+				i->detach();
+			}
+		}
+
+	private:
+		static const size_t kMaxUrl = 8192;
+
+		class Listener : public uvpp::TcpListener {
+		public:
+			Listener(Server& owner, uvpp::EventLoop& loop)
+				: uvpp::TcpListener(loop), _owner(owner) {
+			}
+			virtual void onConnection() override {
+				_owner._accept();
+			}
+			virtual void onError(int32_t code) override {
+				printf("http::Server accept failed (%d)\n", code);
+			}
+			virtual void onDisposed() override {
+				delete this;
+			}
+		private:
+			Server& _owner;
+		};
+
+		class Connection : public uvpp::TcpSocket {
+		public:
+			Connection(Server& owner, uvpp::EventLoop& loop)
+				: uvpp::TcpSocket(loop), _owner(&owner), _responded(false), _writing(false), _closed(false) {
+				http_parser_init(&_parser, HTTP_REQUEST);
+				_parser.data = this;
+				memset(&_settings, 0, sizeof(_settings));
+				_settings.on_url = &_parserCb < &Connection::_onUrl > ;
+				_settings.on_message_complete = &_parserCb < &Connection::_onMessageComplete > ;
+			}
+
+			// The server is going away; nothing may call back into it.
+			void detach() {
+				_owner = nullptr;
+				_close();
+			}
+
+		private:
+			template<int(Connection::*F)()>
+			static int _parserCb(http_parser *parser) {
+				return (((Connection*)parser->data)->*F)();
+			}
+			template<int(Connection::*F)(const char*, size_t)>
+			static int _parserCb(http_parser *parser, const char *at, size_t length) {
+				return (((Connection*)parser->data)->*F)(at, length);
+			}
+
+			int _onUrl(const char *at, size_t length) {
+				if (_url.size() + length > kMaxUrl) {
+					return 1;
+				}
+				_url.append(at, length);
+				return 0;
+			}
+
+			// Pauses the parser so anything pipelined behind the request
+			//   is left alone.
+			int _onMessageComplete() {
+				Request request;
+				request.method = http_method_str((enum http_method)_parser.method);
+				size_t query = _url.find('?');
+				request.path = _url.substr(0, query);
+				if (query != std::string::npos) {
+					request.query = _url.substr(query + 1);
+				}
+				Reply reply;
+				if (_owner) {
+					_owner->_handler(request, reply);
+				}
+				_respond(reply);
+				http_parser_pause(&_parser, 1);
+				return 0;
+			}
+
+			void _respond(const Reply& reply) {
+				if (_responded) {
+					return;
+				}
+				_responded = true;
+				char head[256];
+				int headLen = snprintf(head, sizeof(head),
+					"HTTP/1.1 %u %s\r\nContent-Type: %s\r\nContent-Length: %llu\r\nCache-Control: no-store\r\nConnection: close\r\n\r\n",
+					reply.statusCode, _reason(reply.statusCode), reply.contentType.c_str(), (unsigned long long)reply.body.size());
+				auto out = std::make_shared<std::string>(head, std::min<size_t>(headLen, sizeof(head) - 1));
+				out->append(reply.body);
+				uv_buf_t buf = uv_buf_init(&(*out)[0], (unsigned int)out->size());
+				_writing = true;
+				write(&buf, 1, [this, out](int32_t status) {
+					_writing = false;
+					_close();
+				});
+			}
+
+			static const char * _reason(uint32_t statusCode) {
+				switch (statusCode) {
+				case 200: return "OK";
+				case 400: return "Bad Request";
+				case 404: return "Not Found";
+				case 405: return "Method Not Allowed";
+				case 503: return "Service Unavailable";
+				default: return "Error";
+				}
+			}
+
+			// A write still going out closes the connection when it's done.
+			void _close() {
+				if (_closed || _writing) {
+					return;
+				}
+				_closed = true;
+				close();
+			}
+
+			virtual void onRecv(const char *data, size_t len) override {
+				if (_responded || _closed) {
+					return;
+				}
+				http_parser_execute(&_parser, &_settings, data, len);
+				enum http_errno err = HTTP_PARSER_ERRNO(&_parser);
+				if (err != HPE_OK && err != HPE_PAUSED) {
+					Reply reply;
+					reply.statusCode = 400;
+					reply.body = "bad request\n";
+					_respond(reply);
+				}
+			}
+			virtual void onClose() override {
+				_close();
+			}
+			virtual void onError(uint32_t code) override {
+				_close();
+			}
+			virtual void onDisposed() override {
+				if (_owner) {
+					_owner->_forget(this);
+				}
+				delete this;
+			}
+
+			Server *_owner;
+			http_parser _parser;
+			http_parser_settings _settings;
+			std::string _url;
+			bool _responded;
+			bool _writing;
+			bool _closed;
+		};
+
+		void _accept() {
+			Connection *connection = new Connection(*this, _loop);
+			if (!_listener->accept(*connection)) {
+				connection->detach();
+				return;
+			}
+			_connections.push_back(connection);
+		}
+
+		void _forget(Connection *connection) {
+			_connections.erase(std::remove(_connections.begin(), _connections.end(), connection), _connections.end());
+		}
+
+		uvpp::EventLoop& _loop;
+		Handler _handler;
+		Listener *_listener;
+		std::vector<Connection*> _connections;
 
 	};
 }
\ No newline at end of file
@@ -1,31 +1,39 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
 #include <string>
+#include <vector>
+#include <memory>
 #include <functional>
+#include <fcntl.h>
 #include <uv.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
 
 namespace uvpp {
+	typedef std::function<void(int32_t status)> WriteCallback;
+
 	namespace internal {
+		// buf is a pooled buffer from send() or sendPooled(); writes of
+		//   caller-owned slices leave it empty and hand ownership back
+		//   through done.
 		struct uvpp_write_t {
 			uv_write_t req;
 			uv_buf_t buf;
+			size_t capacity;
+			WriteCallback done;
 		};
-
-		char * alloc(size_t size) {
-			return new char[size];
-		}
-
-		void dealloc(char *ptr) {
-			delete[] ptr;
-		}
-
-		void uvAllocCb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-			buf->base = alloc(suggested_size);
-			buf->len = suggested_size;
-		}
 	}
 	namespace i = uvpp::internal;
 
 	class Mutex {
+		friend class Condition;
+
 	public:
 		Mutex() {
 			uv_mutex_init(&_mutex);
@@ -60,6 +68,134 @@ namespace uvpp {
 
 	};
 
+	class Condition {
+	public:
+		Condition() {
+			uv_cond_init(&_cond);
+		}
+
+		~Condition() {
+			uv_cond_destroy(&_cond);
+		}
+
+		// mutex must be held.
+		void wait(Mutex& mutex) {
+			uv_cond_wait(&_cond, &mutex._mutex);
+		}
+
+		void signal() {
+			uv_cond_signal(&_cond);
+		}
+
+		void broadcast() {
+			uv_cond_broadcast(&_cond);
+		}
+
+	private:
+		uv_cond_t _cond;
+
+	};
+
+	// Link embedded in anything that travels through an MpscQueue.
+	struct MpscNode {
+		std::atomic<MpscNode*> next;
+	};
+
+	// Bounded intrusive multi-producer/single-consumer queue (Vyukov's
+	//   node-based design).  push is wait-free and never allocates; it fails
+	//   once capacity nodes are queued, leaving the producer to back off.
+	//   A node may only be in one queue at a time.  pop can briefly report
+	//   empty while a push is half done; the producer's wakeup that follows
+	//   every push covers that.
+	class MpscQueue {
+	public:
+		MpscQueue(size_t capacity)
+			: _head(&_stub), _tail(&_stub), _capacity(capacity), _size(0), _highWater(0), _fullCount(0) {
+			_stub.next.store(nullptr, std::memory_order_relaxed);
+		}
+
+		// Any thread.
+		bool push(MpscNode *node) {
+			size_t size = _size.fetch_add(1, std::memory_order_relaxed) + 1;
+			if (size > _capacity) {
+				_size.fetch_sub(1, std::memory_order_relaxed);
+				_fullCount.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			size_t highWater = _highWater.load(std::memory_order_relaxed);
+			while (size > highWater && !_highWater.compare_exchange_weak(highWater, size, std::memory_order_relaxed)) {
+			}
+			_enqueue(node);
+			return true;
+		}
+
+		// Consumer thread only.
+		MpscNode * pop() {
+			MpscNode *tail = _tail;
+			MpscNode *next = tail->next.load(std::memory_order_acquire);
+			if (tail == &_stub) {
+				if (!next) {
+					return nullptr;
+				}
+				_tail = next;
+				tail = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+			if (next) {
+				_tail = next;
+				_size.fetch_sub(1, std::memory_order_relaxed);
+				return tail;
+			}
+			if (tail != _head.load(std::memory_order_acquire)) {
+				return nullptr;
+			}
+			_enqueue(&_stub);
+			next = tail->next.load(std::memory_order_acquire);
+			if (next) {
+				_tail = next;
+				_size.fetch_sub(1, std::memory_order_relaxed);
+				return tail;
+			}
+			return nullptr;
+		}
+
+		size_t capacity() const {
+			return _capacity;
+		}
+
+		size_t depth() const {
+			return _size.load(std::memory_order_relaxed);
+		}
+
+		size_t highWater() const {
+			return _highWater.load(std::memory_order_relaxed);
+		}
+
+		// Pushes turned away because the queue was full.
+		uint64_t fullCount() const {
+			return _fullCount.load(std::memory_order_relaxed);
+		}
+
+	private:
+		MpscQueue(const MpscQueue&);
+		MpscQueue& operator=(const MpscQueue&);
+
+		void _enqueue(MpscNode *node) {
+			node->next.store(nullptr, std::memory_order_relaxed);
+			MpscNode *prev = _head.exchange(node, std::memory_order_acq_rel);
+			prev->next.store(node, std::memory_order_release);
+		}
+
+		std::atomic<MpscNode*> _head;
+		MpscNode *_tail;
+		MpscNode _stub;
+		size_t _capacity;
+		std::atomic<size_t> _size;
+		std::atomic<size_t> _highWater;
+		std::atomic<uint64_t> _fullCount;
+
+	};
+
 	class Thread {
 	public:
 		Thread() {
@@ -86,13 +222,361 @@ namespace uvpp {
 
 	};
 
+	// Immutable-size byte buffer handed between threads.  Bodies may live on
+	//   the heap or in a file mapping; consumers don't need to care which.
+	class Blob {
+	public:
+		virtual ~Blob() {
+		}
+
+		virtual uint8_t * data() = 0;
+		virtual size_t size() const = 0;
+
+	};
+
+	class HeapBlob : public Blob {
+	public:
+		HeapBlob() {
+		}
+
+		HeapBlob(std::vector<uint8_t>& data) {
+			_data.swap(data);
+		}
+
+		uint8_t * data() override {
+			return _data.empty() ? nullptr : &_data[0];
+		}
+
+		size_t size() const override {
+			return _data.size();
+		}
+
+		std::vector<uint8_t>& storage() {
+			return _data;
+		}
+
+	private:
+		std::vector<uint8_t> _data;
+
+	};
+
+	// Raw buffer memory for blobs.  Bodies headed for JS are allocated here
+	//   so the engine can supply its own allocator and take them over
+	//   without a copy.  Must be safe to call from any thread.
+	class BufferAllocator {
+	public:
+		virtual ~BufferAllocator() {
+		}
+
+		virtual void * allocate(size_t len) {
+			return malloc(len);
+		}
+
+		virtual void release(void *data, size_t len) {
+			free(data);
+		}
+
+	};
+
+	namespace internal {
+		BufferAllocator *& bufferAllocator() {
+			static BufferAllocator defaultAllocator;
+			static BufferAllocator *allocator = &defaultAllocator;
+			return allocator;
+		}
+	}
+
+	// Install before any IO starts; blobs keep the allocator they were
+	//   created with.
+	void setBufferAllocator(BufferAllocator *allocator) {
+		i::bufferAllocator() = allocator;
+	}
+
+	// Growable blob backed by the buffer allocator.
+	class BufferBlob : public Blob {
+	public:
+		BufferBlob()
+			: _allocator(i::bufferAllocator()), _data(nullptr), _size(0), _capacity(0) {
+		}
+
+		~BufferBlob() {
+			if (_data) {
+				_allocator->release(_data, _capacity);
+			}
+		}
+
+		uint8_t * data() override {
+			return _data;
+		}
+
+		size_t size() const override {
+			return _size;
+		}
+
+		bool reserve(size_t capacity) {
+			if (capacity <= _capacity) {
+				return true;
+			}
+			uint8_t *data = (uint8_t*)_allocator->allocate(capacity);
+			if (!data) {
+				return false;
+			}
+			if (_data) {
+				memcpy(data, _data, _size);
+				_allocator->release(_data, _capacity);
+			}
+			_data = data;
+			_capacity = capacity;
+			return true;
+		}
+
+		// Bytes past the old size are left uninitialised, for callers that
+		//   fill the buffer out of order.
+		bool resize(size_t size) {
+			if (!reserve(size)) {
+				return false;
+			}
+			_size = size;
+			return true;
+		}
+
+		bool append(const void *data, size_t len) {
+			if (len > _capacity - _size) {
+				size_t capacity = std::max(_size + len, std::max<size_t>(_capacity * 2, 4096));
+				if (!reserve(capacity)) {
+					return false;
+				}
+			}
+			memcpy(_data + _size, data, len);
+			_size += len;
+			return true;
+		}
+
+	private:
+		BufferBlob(const BufferBlob&);
+		BufferBlob& operator=(const BufferBlob&);
+
+		BufferAllocator *_allocator;
+		uint8_t *_data;
+		size_t _size;
+		size_t _capacity;
+
+	};
+
+	// Copy-on-write file mapping, so writes through data() stay private and
+	//   never reach the file.
+	class MappedBlob : public Blob {
+	public:
+		~MappedBlob() {
+#ifdef _WIN32
+			if (_view) {
+				UnmapViewOfFile(_view);
+			}
+			if (_mapping) {
+				CloseHandle(_mapping);
+			}
+#else
+			if (_view) {
+				munmap(_view, _size);
+			}
+#endif
+		}
+
+		// sequential asks the OS to start reading the whole file in now;
+		//   Windows has no such hint before 8 and goes without.
+		static std::shared_ptr<MappedBlob> map(uv_file file, size_t size, bool sequential = false) {
+			std::shared_ptr<MappedBlob> blob(new MappedBlob());
+			blob->_size = size;
+#ifdef _WIN32
+			HANDLE fileHandle = (HANDLE)_get_osfhandle(file);
+			if (fileHandle == INVALID_HANDLE_VALUE) {
+				return nullptr;
+			}
+			blob->_mapping = CreateFileMapping(fileHandle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+			if (!blob->_mapping) {
+				return nullptr;
+			}
+			blob->_view = MapViewOfFile(blob->_mapping, FILE_MAP_COPY, 0, 0, size);
+#else
+			void *view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+			blob->_view = view != MAP_FAILED ? view : nullptr;
+			if (blob->_view && sequential) {
+				madvise(blob->_view, size, MADV_WILLNEED);
+			}
+#endif
+			if (!blob->_view) {
+				return nullptr;
+			}
+			return blob;
+		}
+
+		uint8_t * data() override {
+			return (uint8_t*)_view;
+		}
+
+		size_t size() const override {
+			return _size;
+		}
+
+	private:
+		MappedBlob()
+			: _view(nullptr), _size(0) {
+#ifdef _WIN32
+			_mapping = NULL;
+#endif
+		}
+
+		void *_view;
+		size_t _size;
+#ifdef _WIN32
+		HANDLE _mapping;
+#endif
+
+	};
+
+	// Window onto part of another blob, which it keeps alive.
+	class SliceBlob : public Blob {
+	public:
+		SliceBlob(std::shared_ptr<Blob> source, size_t offset, size_t len)
+			: _source(source), _offset(std::min(offset, source->size())) {
+			_size = std::min(len, source->size() - _offset);
+		}
+
+		uint8_t * data() override {
+			return _source->data() + _offset;
+		}
+
+		size_t size() const override {
+			return _size;
+		}
+
+	private:
+		std::shared_ptr<Blob> _source;
+		size_t _offset;
+		size_t _size;
+
+	};
+
+	// Recycles socket buffers and write requests for one loop.  Buffers come
+	//   in power-of-two classes from 256 bytes to 64KB, the size libuv asks
+	//   for on every read; anything larger goes straight to the heap.  Each
+	//   class keeps at most kMaxFreePerClass spares.  Loop-thread only.
+	class BufferPool {
+	public:
+		struct Stats {
+			Stats()
+				: hits(0), misses(0), writeHits(0), writeMisses(0), bytesInFlight(0), peakBytesInFlight(0) {
+			}
+
+			uint64_t hits;
+			uint64_t misses;
+			uint64_t writeHits;
+			uint64_t writeMisses;
+			size_t bytesInFlight;
+			size_t peakBytesInFlight;
+		};
+
+		BufferPool() {
+		}
+
+		~BufferPool() {
+			for (auto& freeList : _free) {
+				for (auto& i : freeList) {
+					delete[] i;
+				}
+			}
+			for (auto& i : _freeWrites) {
+				delete i;
+			}
+		}
+
+		// Returns at least size bytes; capacity receives the real size,
+		//   which must be passed back to release.
+		char * alloc(size_t size, size_t& capacity) {
+			size_t cls = _classFor(size);
+			capacity = cls < kNumClasses ? kMinSize << cls : size;
+			_stats.bytesInFlight += capacity;
+			_stats.peakBytesInFlight = std::max(_stats.peakBytesInFlight, _stats.bytesInFlight);
+			if (cls < kNumClasses && !_free[cls].empty()) {
+				++_stats.hits;
+				char *ptr = _free[cls].back();
+				_free[cls].pop_back();
+				return ptr;
+			}
+			++_stats.misses;
+			return new char[capacity];
+		}
+
+		void release(char *ptr, size_t capacity) {
+			size_t cls = _classFor(capacity);
+			_stats.bytesInFlight -= cls < kNumClasses ? kMinSize << cls : capacity;
+			if (cls < kNumClasses && _free[cls].size() < kMaxFreePerClass) {
+				_free[cls].push_back(ptr);
+			} else {
+				delete[] ptr;
+			}
+		}
+
+		i::uvpp_write_t * acquireWrite() {
+			if (!_freeWrites.empty()) {
+				++_stats.writeHits;
+				i::uvpp_write_t *wreq = _freeWrites.back();
+				_freeWrites.pop_back();
+				return wreq;
+			}
+			++_stats.writeMisses;
+			return new i::uvpp_write_t;
+		}
+
+		void releaseWrite(i::uvpp_write_t *wreq) {
+			if (_freeWrites.size() < kMaxFreeWrites) {
+				_freeWrites.push_back(wreq);
+			} else {
+				delete wreq;
+			}
+		}
+
+		const Stats& stats() const {
+			return _stats;
+		}
+
+	private:
+		static const size_t kMinSize = 256;
+		static const size_t kNumClasses = 9;
+		static const size_t kMaxFreePerClass = 32;
+		static const size_t kMaxFreeWrites = 256;
+
+		static size_t _classFor(size_t size) {
+			size_t cls = 0;
+			while (cls < kNumClasses && (kMinSize << cls) < size) {
+				++cls;
+			}
+			return cls;
+		}
+
+		BufferPool(const BufferPool&);
+		BufferPool& operator=(const BufferPool&);
+
+		std::vector<char*> _free[kNumClasses];
+		std::vector<i::uvpp_write_t*> _freeWrites;
+		Stats _stats;
+
+	};
+
 	class EventLoop {
 		friend class TcpSocket; 
+		friend class TcpListener;
 		friend class Event;
+		friend class Timer;
+		friend class FileReader;
+		friend class FileWriter;
+		friend class FileOp;
+		friend class Resolver;
 
 	public:
 		EventLoop() {
 			uv_loop_init(&_loop);
+			_loop.data = this;
 		}
 
 		~EventLoop() {
@@ -111,8 +595,17 @@ namespace uvpp {
 			uv_stop(&_loop);
 		}
 
+		uint64_t now() {
+			return uv_now(&_loop);
+		}
+
+		BufferPool& bufferPool() {
+			return _bufferPool;
+		}
+
 	protected:
 		uv_loop_t _loop;
+		BufferPool _bufferPool;
 
 	};
 
@@ -144,7 +637,105 @@ namespace uvpp {
 
 	};
 
+	class Timer {
+	public:
+		Timer(EventLoop& loop) {
+			uv_timer_init(&loop._loop, &_timer);
+			_timer.data = this;
+		}
+
+		void start(uint64_t timeoutMs, uint64_t repeatMs = 0) {
+			uv_timer_start(&_timer, &_uvOnTimer, timeoutMs, repeatMs);
+		}
+
+		void stop() {
+			uv_timer_stop(&_timer);
+		}
+
+		bool active() const {
+			return uv_is_active(reinterpret_cast<const uv_handle_t*>(&_timer)) != 0;
+		}
+
+		virtual void onTimer() {
+			printf("Timer::onTimer\n");
+		}
+
+	private:
+		static void _uvOnTimer(uv_timer_t* handle) {
+			((Timer*)handle->data)->onTimer();
+		}
+
+		uv_timer_t _timer;
+
+	};
+
+	// Single async getaddrinfo lookup on the loop's threadpool.
+	class Resolver {
+	public:
+		Resolver(EventLoop& loop)
+			: _loop(loop) {
+			_req.data = this;
+		}
+
+		bool resolve(const std::string& host) {
+			struct addrinfo hints;
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_protocol = IPPROTO_TCP;
+			int result = uv_getaddrinfo(&_loop._loop, &_req, _uvOnResolve, host.c_str(), nullptr, &hints);
+			return result == 0;
+		}
+
+		virtual void onResolve(const struct sockaddr *addr) {
+			printf("Resolver::onResolve\n");
+		}
+		virtual void onError(int32_t code) {
+			printf("Resolver::onError(%d)\n", code);
+		}
+
+	private:
+		static void _uvOnResolve(uv_getaddrinfo_t *req, int status, struct addrinfo *res) {
+			((Resolver*)req->data)->_onResolve(status, res);
+		}
+
+		void _onResolve(int status, struct addrinfo *res) {
+			if (status < 0) {
+				return this->onError(status);
+			}
+
+			// Prefer IPv4; plenty of asset hosts advertise AAAA records
+			//   they don't actually serve on.
+			struct addrinfo *best = res;
+			for (struct addrinfo *i = res; i; i = i->ai_next) {
+				if (i->ai_family == AF_INET) {
+					best = i;
+					break;
+				}
+			}
+
+			struct sockaddr_storage addr;
+			memset(&addr, 0, sizeof(addr));
+			bool found = best && best->ai_addrlen <= sizeof(addr);
+			if (found) {
+				memcpy(&addr, best->ai_addr, best->ai_addrlen);
+			}
+			uv_freeaddrinfo(res);
+
+			if (!found) {
+				return this->onError(UV_EAI_NODATA);
+			}
+			this->onResolve(reinterpret_cast<const struct sockaddr*>(&addr));
+		}
+
+		EventLoop& _loop;
+		uv_getaddrinfo_t _req;
+
+	};
+
 	class TcpSocket {
+		friend class TcpListener;
+
 	public:
 		TcpSocket(EventLoop& loop) {
 			uv_tcp_init(&loop._loop, &_socket);
@@ -165,16 +756,76 @@ namespace uvpp {
 			return true;
 		}
 
+		bool connect(const struct sockaddr *addr) {
+			uv_connect_t *conn = new uv_connect_t;
+			conn->data = this;
+
+			int result = uv_tcp_connect(conn, &_socket, addr, _uvOnConnect);
+			if (result < 0) {
+				delete conn;
+				return false;
+			}
+			return true;
+		}
+
+		// Closes the handle.  Pending writes fail with UV_ECANCELED first;
+		//   onDisposed fires once libuv is done with the socket, and is the
+		//   earliest point it may be deleted.
+		void close() {
+			uv_read_stop(reinterpret_cast<uv_stream_t*>(&_socket));
+			uv_close(reinterpret_cast<uv_handle_t*>(&_socket), _uvOnClose);
+		}
+
 		void send(const char *data, size_t len) {
-			char * newmem = internal::alloc(len);
+			size_t capacity;
+			char * newmem = _pool().alloc(len, capacity);
 			memcpy(newmem, data, len);
+			sendPooled(newmem, len, capacity);
+		}
 
-			i::uvpp_write_t *wreq = new i::uvpp_write_t;
+		// Writes len bytes of a buffer from the loop's BufferPool, which
+		//   goes back to the pool once written.  For callers that build the
+		//   bytes in place instead of copying them through send().
+		void sendPooled(char *data, size_t len, size_t capacity) {
+			BufferPool& pool = _pool();
+			i::uvpp_write_t *wreq = pool.acquireWrite();
 			wreq->req.data = this;
-			wreq->buf.base = newmem;
+			wreq->buf.base = data;
 			wreq->buf.len = len;
+			wreq->capacity = capacity;
+
+			int result = uv_write(&wreq->req, reinterpret_cast<uv_stream_t*>(&_socket), &wreq->buf, 1, _uvOnWrite);
+			if (result < 0) {
+				pool.release(data, capacity);
+				pool.releaseWrite(wreq);
+				this->onError(result);
+			}
+		}
+
+		// Scatter-gather write without copying.  The slices must stay valid
+		//   until done runs; it always runs, with a negative status if the
+		//   write failed or was cancelled by close().  Returns 0, or the
+		//   libuv error if the write could not even be queued, in which
+		//   case done has already run.
+		int32_t write(const uv_buf_t *bufs, size_t count, WriteCallback done) {
+			BufferPool& pool = _pool();
+			i::uvpp_write_t *wreq = pool.acquireWrite();
+			wreq->req.data = this;
+			wreq->buf = uv_buf_init(nullptr, 0);
+			wreq->capacity = 0;
+			wreq->done = std::move(done);
 
-			uv_write(&wreq->req, reinterpret_cast<uv_stream_t*>(&_socket), &wreq->buf, 1, _uvOnWrite);
+			int result = uv_write(&wreq->req, reinterpret_cast<uv_stream_t*>(&_socket), bufs, (unsigned int)count, _uvOnWrite);
+			if (result < 0) {
+				WriteCallback callback;
+				callback.swap(wreq->done);
+				pool.releaseWrite(wreq);
+				if (callback) {
+					callback(result);
+				}
+				return result;
+			}
+			return 0;
 		}
 
 		virtual void onConnect() {
@@ -189,49 +840,456 @@ namespace uvpp {
 		virtual void onError(uint32_t code) {
 			printf("TcpSocket::onError(%d)\n", code);
 		}
+		virtual void onDisposed() {
+		}
 
 	private:
 		static void _uvOnConnect(uv_connect_t *req, int status) {
 			((TcpSocket*)req->data)->_onConnect(req, status);
 		}
+		static void _uvOnClose(uv_handle_t *handle) {
+			((TcpSocket*)handle->data)->onDisposed();
+		}
 		static void _uvOnWrite(uv_write_t *req, int status) {
 			((TcpSocket*)req->data)->_onWrite(req, status);
 		}
 		static void _uvOnRead(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
 			((TcpSocket*)stream->data)->_onRead(stream, nread, buf);
 		}
+		static void _uvOnAlloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+			size_t capacity;
+			buf->base = ((TcpSocket*)handle->data)->_pool().alloc(suggested_size, capacity);
+			buf->len = capacity;
+		}
+
+		BufferPool& _pool() {
+			return reinterpret_cast<EventLoop*>(_socket.loop->data)->_bufferPool;
+		}
 
 		void _onConnect(uv_connect_t *req, int status) {
+			delete req;
 			if (status < 0) {
 				return this->onError(status);
 			}
+			_startReading();
 			this->onConnect();
-			delete req;
+		}
 
-			uv_read_start(reinterpret_cast<uv_stream_t*>(&_socket), i::uvAllocCb, _uvOnRead);
+		void _startReading() {
+			// Requests are small and latency bound.
+			uv_tcp_nodelay(&_socket, 1);
+			uv_read_start(reinterpret_cast<uv_stream_t*>(&_socket), _uvOnAlloc, _uvOnRead);
 		}
 
 		void _onWrite(uv_write_t *req, int status) {
 			i::uvpp_write_t *wreq = reinterpret_cast<i::uvpp_write_t*>(req);
+			WriteCallback callback;
+			callback.swap(wreq->done);
+			if (wreq->buf.base) {
+				_pool().release(wreq->buf.base, wreq->capacity);
+			}
+			_pool().releaseWrite(wreq);
 			if (status < 0) {
 				this->onError(status);
 			}
-			i::dealloc(wreq->buf.base);
-			delete wreq;
+			if (callback) {
+				callback(status);
+			}
 		}
 
 		void _onRead(uv_stream_t *stream, ssize_t nread, const uv_buf_t* buf) {
-			if (nread < 0) {
-				return this->onError(nread);
-			} else if (nread == 0) {
-				return this->onClose();
+			if (nread <= 0) {
+				// 0 is EAGAIN, not end of stream.
+				if (buf->base) {
+					_pool().release(buf->base, buf->len);
+				}
+				if (nread == UV_EOF) {
+					return this->onClose();
+				} else if (nread < 0) {
+					return this->onError(nread);
+				}
+				return;
 			}
 			this->onRecv(buf->base, nread);
-			i::dealloc(buf->base);
+			_pool().release(buf->base, buf->len);
 		}
 
 
 		uv_tcp_t _socket;
 
 	};
+
+	// Listening socket.  onConnection fires for each pending client, which
+	//   is taken with accept() into a fresh TcpSocket on the same loop.
+	class TcpListener {
+	public:
+		TcpListener(EventLoop& loop) {
+			uv_tcp_init(&loop._loop, &_socket);
+			_socket.data = this;
+		}
+
+		bool listen(const struct sockaddr *addr, int backlog = 16) {
+			if (uv_tcp_bind(&_socket, addr, 0) < 0) {
+				return false;
+			}
+			return uv_listen(reinterpret_cast<uv_stream_t*>(&_socket), backlog, _uvOnConnection) == 0;
+		}
+
+		// Starts reading on client; false if there was nobody to accept.
+		bool accept(TcpSocket& client) {
+			if (uv_accept(reinterpret_cast<uv_stream_t*>(&_socket), reinterpret_cast<uv_stream_t*>(&client._socket)) < 0) {
+				return false;
+			}
+			client._startReading();
+			return true;
+		}
+
+		// onDisposed fires once libuv is done with the handle.
+		void close() {
+			uv_close(reinterpret_cast<uv_handle_t*>(&_socket), _uvOnClose);
+		}
+
+		virtual void onConnection() {
+			printf("TcpListener::onConnection\n");
+		}
+		virtual void onError(int32_t code) {
+			printf("TcpListener::onError(%d)\n", code);
+		}
+		virtual void onDisposed() {
+		}
+
+	private:
+		static void _uvOnConnection(uv_stream_t *server, int status) {
+			TcpListener *self = (TcpListener*)server->data;
+			if (status < 0) {
+				return self->onError(status);
+			}
+			self->onConnection();
+		}
+		static void _uvOnClose(uv_handle_t *handle) {
+			((TcpListener*)handle->data)->onDisposed();
+		}
+
+		uv_tcp_t _socket;
+
+	};
+
+	// Reads a whole file asynchronously on the loop.  Files of at least
+	//   mapThreshold bytes are memory-mapped instead of read.  A reader can
+	//   start another read once it has reported the last one.
+	class FileReader {
+	public:
+		FileReader(EventLoop& loop)
+			: _loop(loop), _file(-1), _offset(0), _mapThreshold(0), _sequential(false), _error(0) {
+			_req.data = this;
+		}
+
+		// sequential hints that the file is read front to back in one go,
+		//   so the OS can read ahead more aggressively.
+		void read(const std::string& path, size_t mapThreshold, bool sequential = false) {
+			_offset = 0;
+			_error = 0;
+			_mapThreshold = mapThreshold;
+			_sequential = sequential;
+			int flags = O_RDONLY;
+#ifdef _WIN32
+			if (sequential) {
+				flags |= _O_SEQUENTIAL;
+			}
+#endif
+			uv_fs_open(&_loop._loop, &_req, path.c_str(), flags, 0, _uvOnOpen);
+		}
+
+		virtual void onRead(std::shared_ptr<Blob> data) {
+			printf("FileReader::onRead(%d)\n", (int)data->size());
+		}
+		virtual void onError(int32_t code) {
+			printf("FileReader::onError(%d)\n", code);
+		}
+
+	private:
+		static void _uvOnOpen(uv_fs_t *req) {
+			((FileReader*)req->data)->_onOpen(req);
+		}
+		static void _uvOnStat(uv_fs_t *req) {
+			((FileReader*)req->data)->_onStat(req);
+		}
+		static void _uvOnRead(uv_fs_t *req) {
+			((FileReader*)req->data)->_onRead(req);
+		}
+		static void _uvOnClose(uv_fs_t *req) {
+			((FileReader*)req->data)->_onClose(req);
+		}
+
+		void _onOpen(uv_fs_t *req) {
+			int32_t result = (int32_t)req->result;
+			uv_fs_req_cleanup(req);
+			if (result < 0) {
+				return this->onError(result);
+			}
+			_file = result;
+#if !defined(_WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+			if (_sequential) {
+				posix_fadvise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+			}
+#endif
+			uv_fs_fstat(&_loop._loop, &_req, _file, _uvOnStat);
+		}
+
+		void _onStat(uv_fs_t *req) {
+			int32_t result = (int32_t)req->result;
+			size_t size = (size_t)req->statbuf.st_size;
+			uv_fs_req_cleanup(req);
+			if (result < 0) {
+				return _finish(result);
+			}
+
+			if (_mapThreshold > 0 && size >= _mapThreshold) {
+				_data = MappedBlob::map(_file, size, _sequential);
+				if (_data) {
+					return _finish(0);
+				}
+			}
+
+			_heap = std::make_shared<HeapBlob>();
+			_heap->storage().resize(size);
+			_data = _heap;
+			if (size == 0) {
+				return _finish(0);
+			}
+			_readNext();
+		}
+
+		void _readNext() {
+			uv_buf_t buf = uv_buf_init((char*)_heap->data() + _offset, (unsigned int)(_heap->size() - _offset));
+			uv_fs_read(&_loop._loop, &_req, _file, &buf, 1, _offset, _uvOnRead);
+		}
+
+		void _onRead(uv_fs_t *req) {
+			ssize_t result = req->result;
+			uv_fs_req_cleanup(req);
+			if (result < 0) {
+				return _finish((int32_t)result);
+			}
+			_offset += result;
+			if (result == 0) {
+				// File shrank since we stat'd it.
+				_heap->storage().resize(_offset);
+				return _finish(0);
+			}
+			if (_offset < _heap->size()) {
+				return _readNext();
+			}
+			_finish(0);
+		}
+
+		void _finish(int32_t error) {
+			_error = error;
+			uv_fs_close(&_loop._loop, &_req, _file, _uvOnClose);
+		}
+
+		void _onClose(uv_fs_t *req) {
+			uv_fs_req_cleanup(req);
+			_heap = nullptr;
+			if (_error < 0) {
+				_data = nullptr;
+				return this->onError(_error);
+			}
+			std::shared_ptr<Blob> data;
+			data.swap(_data);
+			this->onRead(data);
+		}
+
+		EventLoop& _loop;
+		uv_fs_t _req;
+		uv_file _file;
+		size_t _offset;
+		size_t _mapThreshold;
+		bool _sequential;
+		int32_t _error;
+		std::shared_ptr<Blob> _data;
+		std::shared_ptr<HeapBlob> _heap;
+
+	};
+
+	// Writes a file from a stream of chunks without blocking the loop.  Each
+	//   chunk is copied into a pool buffer and written at its own offset, so
+	//   writes may land in any order.  finish() closes the file once they
+	//   are all done and reports through onFinish.  Loop-thread only, and
+	//   must outlive its writes.
+	class FileWriter {
+	public:
+		FileWriter(EventLoop& loop)
+			: _loop(loop), _file(-1), _offset(0), _pending(0), _finishing(false), _closing(false), _error(0) {
+			_closeReq.data = this;
+		}
+
+		virtual ~FileWriter() {
+		}
+
+		// Creates or truncates path.  Opening is synchronous; it's cheap
+		//   next to the writes that follow.
+		bool open(const std::string& path) {
+			uv_fs_t req;
+			int32_t result = uv_fs_open(&_loop._loop, &req, path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644, nullptr);
+			uv_fs_req_cleanup(&req);
+			if (result < 0) {
+				_error = result;
+				return false;
+			}
+			_file = result;
+			return true;
+		}
+
+		void write(const void *data, size_t len) {
+			if (_file < 0 || _finishing || _error < 0 || len == 0) {
+				return;
+			}
+			_Write *wreq = new _Write();
+			wreq->owner = this;
+			wreq->data = _loop.bufferPool().alloc(len, wreq->capacity);
+			memcpy(wreq->data, data, len);
+			wreq->req.data = wreq;
+			uv_buf_t buf = uv_buf_init(wreq->data, (unsigned int)len);
+			++_pending;
+			int32_t result = uv_fs_write(&_loop._loop, &wreq->req, _file, &buf, 1, (int64_t)_offset, _uvOnWrite);
+			_offset += len;
+			if (result < 0) {
+				_error = result;
+				--_pending;
+				_loop.bufferPool().release(wreq->data, wreq->capacity);
+				delete wreq;
+			}
+		}
+
+		void finish() {
+			_finishing = true;
+			_maybeClose();
+		}
+
+		uint64_t size() const {
+			return _offset;
+		}
+
+		EventLoop& loop() {
+			return _loop;
+		}
+
+		virtual void onFinish(int32_t status) {
+			printf("FileWriter::onFinish(%d)\n", status);
+		}
+
+	private:
+		struct _Write {
+			uv_fs_t req;
+			char *data;
+			size_t capacity;
+			FileWriter *owner;
+		};
+
+		static void _uvOnWrite(uv_fs_t *req) {
+			_Write *wreq = (_Write*)req->data;
+			wreq->owner->_onWrite(wreq);
+		}
+		static void _uvOnClose(uv_fs_t *req) {
+			((FileWriter*)req->data)->_onClose(req);
+		}
+
+		void _onWrite(_Write *wreq) {
+			if (wreq->req.result < 0 && _error == 0) {
+				_error = (int32_t)wreq->req.result;
+			}
+			uv_fs_req_cleanup(&wreq->req);
+			_loop.bufferPool().release(wreq->data, wreq->capacity);
+			delete wreq;
+			--_pending;
+			_maybeClose();
+		}
+
+		void _maybeClose() {
+			if (!_finishing || _pending > 0 || _closing) {
+				return;
+			}
+			_closing = true;
+			if (_file < 0) {
+				return this->onFinish(_error < 0 ? _error : UV_EBADF);
+			}
+			uv_file file = _file;
+			_file = -1;
+			uv_fs_close(&_loop._loop, &_closeReq, file, _uvOnClose);
+		}
+
+		void _onClose(uv_fs_t *req) {
+			if (req->result < 0 && _error == 0) {
+				_error = (int32_t)req->result;
+			}
+			uv_fs_req_cleanup(req);
+			this->onFinish(_error);
+		}
+
+		EventLoop& _loop;
+		uv_fs_t _closeReq;
+		uv_file _file;
+		uint64_t _offset;
+		size_t _pending;
+		bool _finishing;
+		bool _closing;
+		int32_t _error;
+
+	};
+
+	// One-off filesystem calls run on the loop's thread pool, for
+	//   bookkeeping that mustn't stall the loop.  done, if given, runs on
+	//   the loop with the libuv result.
+	class FileOp {
+	public:
+		typedef std::function<void(int32_t)> Callback;
+
+		static void unlink(EventLoop& loop, const std::string& path, Callback done = nullptr) {
+			_Op *op = new _Op(done);
+			_started(op, uv_fs_unlink(&loop._loop, &op->req, path.c_str(), _uvOnDone));
+		}
+
+		static void rename(EventLoop& loop, const std::string& from, const std::string& to, Callback done = nullptr) {
+			_Op *op = new _Op(done);
+			_started(op, uv_fs_rename(&loop._loop, &op->req, from.c_str(), to.c_str(), _uvOnDone));
+		}
+
+		static void utime(EventLoop& loop, const std::string& path, double atime, double mtime, Callback done = nullptr) {
+			_Op *op = new _Op(done);
+			_started(op, uv_fs_utime(&loop._loop, &op->req, path.c_str(), atime, mtime, _uvOnDone));
+		}
+
+	private:
+		struct _Op {
+			_Op(Callback done)
+				: done(done) {
+				req.data = this;
+			}
+
+			uv_fs_t req;
+			Callback done;
+		};
+
+		static void _started(_Op *op, int result) {
+			if (result < 0) {
+				uv_fs_req_cleanup(&op->req);
+				if (op->done) {
+					op->done(result);
+				}
+				delete op;
+			}
+		}
+
+		static void _uvOnDone(uv_fs_t *req) {
+			_Op *op = (_Op*)req->data;
+			int32_t result = (int32_t)req->result;
+			uv_fs_req_cleanup(req);
+			if (op->done) {
+				op->done(result);
+			}
+			delete op;
+		}
+
+	};
 }
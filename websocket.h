@@ -0,0 +1,660 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include "http_parser.h"
+#include "uvpp.h"
+#include "uvhttp.h"
+
+// RFC 6455 client on top of uvpp::TcpSocket.  Plain ws:// only, and no
+//   extensions are offered, so compressed or otherwise extended frames
+//   are a protocol error.
+namespace ws {
+	enum class Opcode : uint8_t {
+		Continuation = 0x0,
+		Text = 0x1,
+		Binary = 0x2,
+		Close = 0x8,
+		Ping = 0x9,
+		Pong = 0xA
+	};
+
+	namespace internal {
+		const char *kAcceptGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+		uint32_t rotl(uint32_t x, int n) {
+			return (x << n) | (x >> (32 - n));
+		}
+
+		// Only used on the handshake key, so kept short rather than fast.
+		void sha1(const uint8_t *data, size_t len, uint8_t out[20]) {
+			uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+			uint64_t bits = (uint64_t)len * 8;
+			// Message, 0x80, zero padding and the 64-bit length, in whole blocks.
+			size_t total = (len + 9 + 63) & ~(size_t)63;
+			for (size_t offset = 0; offset < total; offset += 64) {
+				uint8_t block[64];
+				for (size_t k = 0; k < 64; ++k) {
+					size_t pos = offset + k;
+					if (pos < len) {
+						block[k] = data[pos];
+					} else if (pos == len) {
+						block[k] = 0x80;
+					} else if (pos >= total - 8) {
+						block[k] = (uint8_t)(bits >> ((total - 1 - pos) * 8));
+					} else {
+						block[k] = 0;
+					}
+				}
+
+				uint32_t w[80];
+				for (int t = 0; t < 16; ++t) {
+					w[t] = (uint32_t)block[t * 4] << 24 | (uint32_t)block[t * 4 + 1] << 16 |
+						(uint32_t)block[t * 4 + 2] << 8 | (uint32_t)block[t * 4 + 3];
+				}
+				for (int t = 16; t < 80; ++t) {
+					w[t] = rotl(w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16], 1);
+				}
+
+				uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+				for (int t = 0; t < 80; ++t) {
+					uint32_t f, k;
+					if (t < 20) {
+						f = (b & c) | (~b & d);
+						k = 0x5A827999;
+					} else if (t < 40) {
+						f = b ^ c ^ d;
+						k = 0x6ED9EBA1;
+					} else if (t < 60) {
+						f = (b & c) | (b & d) | (c & d);
+						k = 0x8F1BBCDC;
+					} else {
+						f = b ^ c ^ d;
+						k = 0xCA62C1D6;
+					}
+					uint32_t temp = rotl(a, 5) + f + e + k + w[t];
+					e = d;
+					d = c;
+					c = rotl(b, 30);
+					b = a;
+					a = temp;
+				}
+				h[0] += a;
+				h[1] += b;
+				h[2] += c;
+				h[3] += d;
+				h[4] += e;
+			}
+			for (int k = 0; k < 5; ++k) {
+				out[k * 4] = (uint8_t)(h[k] >> 24);
+				out[k * 4 + 1] = (uint8_t)(h[k] >> 16);
+				out[k * 4 + 2] = (uint8_t)(h[k] >> 8);
+				out[k * 4 + 3] = (uint8_t)h[k];
+			}
+		}
+
+		std::string base64(const uint8_t *data, size_t len) {
+			static const char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+			std::string out;
+			out.reserve((len + 2) / 3 * 4);
+			for (size_t k = 0; k < len; k += 3) {
+				uint32_t v = (uint32_t)data[k] << 16;
+				if (k + 1 < len) {
+					v |= (uint32_t)data[k + 1] << 8;
+				}
+				if (k + 2 < len) {
+					v |= data[k + 2];
+				}
+				out += kAlphabet[(v >> 18) & 63];
+				out += kAlphabet[(v >> 12) & 63];
+				out += k + 1 < len ? kAlphabet[(v >> 6) & 63] : '=';
+				out += k + 2 < len ? kAlphabet[v & 63] : '=';
+			}
+			return out;
+		}
+
+		// dst = src XOR the repeating 4-byte key, eight bytes at a time.
+		//   The key pattern is the same in memory whatever the byte order.
+		void maskCopy(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t key[4]) {
+			uint32_t key32;
+			memcpy(&key32, key, 4);
+			uint64_t key64 = (uint64_t)key32 << 32 | key32;
+			size_t k = 0;
+			for (; k + 8 <= len; k += 8) {
+				uint64_t word;
+				memcpy(&word, src + k, 8);
+				word ^= key64;
+				memcpy(dst + k, &word, 8);
+			}
+			for (; k < len; ++k) {
+				dst[k] = src[k] ^ key[k & 3];
+			}
+		}
+
+		// Case-insensitive search for a token in a comma-separated list.
+		bool hasToken(const std::string& list, const char *token) {
+			size_t start = 0;
+			while (start <= list.size()) {
+				size_t end = list.find(',', start);
+				if (end == std::string::npos) {
+					end = list.size();
+				}
+				size_t first = start, last = end;
+				while (first < last && (list[first] == ' ' || list[first] == '\t')) {
+					++first;
+				}
+				while (last > first && (list[last - 1] == ' ' || list[last - 1] == '\t')) {
+					--last;
+				}
+				if (http::equalsIgnoreCase(list.c_str() + first, last - first, token)) {
+					return true;
+				}
+				start = end + 1;
+			}
+			return false;
+		}
+	}
+	namespace i = ws::internal;
+
+	// Header plus mask key can take up to this much on top of the payload.
+	const size_t kMaxFrameOverhead = 14;
+
+	// Writes one final client frame, masked with maskKey, into out, which
+	//   must have room for len + kMaxFrameOverhead bytes.  Masking happens
+	//   during the copy, so the payload is read once and written once.
+	//   Returns the frame size.
+	size_t writeFrame(uint8_t *out, Opcode opcode, const uint8_t *data, size_t len, uint32_t maskKey) {
+		size_t pos = 0;
+		out[pos++] = 0x80 | (uint8_t)opcode;
+		if (len < 126) {
+			out[pos++] = 0x80 | (uint8_t)len;
+		} else if (len <= 0xFFFF) {
+			out[pos++] = 0x80 | 126;
+			out[pos++] = (uint8_t)(len >> 8);
+			out[pos++] = (uint8_t)len;
+		} else {
+			out[pos++] = 0x80 | 127;
+			for (int k = 7; k >= 0; --k) {
+				out[pos++] = (uint8_t)((uint64_t)len >> (k * 8));
+			}
+		}
+		memcpy(out + pos, &maskKey, 4);
+		i::maskCopy(out + pos + 4, data, len, out + pos);
+		return pos + 4 + len;
+	}
+
+	// One client connection.  open() connects and sends the upgrade; bytes
+	//   that arrive in the same read as the 101 response are parsed as
+	//   frames straight away.  Each message is reassembled in a BufferBlob
+	//   reserved from its first frame's length, so incoming payload is
+	//   copied once, out of the read buffer, and can be handed on as is.
+	//   Outgoing payload is masked while being copied into a pool buffer
+	//   and written from there.  Pings are answered and a peer's close is
+	//   echoed without involving the owner.  Loop-thread only.
+	class Socket : public uvpp::TcpSocket {
+	public:
+		static const size_t kMaxMessageBytes = 64 * 1024 * 1024;
+
+		enum class State : uint32_t {
+			Idle,
+			Connecting,
+			Handshake,
+			Open,
+			Closing,
+			Closed
+		};
+
+		Socket(uvpp::EventLoop& loop, size_t maxMessageBytes = kMaxMessageBytes)
+			: TcpSocket(loop), _loop(loop), _state(State::Idle), _maxMessageBytes(maxMessageBytes),
+			_headersDone(false), _inValue(false), _headerLen(0), _inPayload(false),
+			_remaining(0), _opcode(0), _fin(false), _fragmented(false), _binary(false), _closeSent(false),
+			_closeReceived(false), _dropping(false), _error(0), _closeCode(1006) {
+			http_parser_init(&_parser, HTTP_RESPONSE);
+			_parser.data = this;
+			memset(&_settings, 0, sizeof(_settings));
+			_settings.on_header_field = &_parserCb < &Socket::_onHeaderField > ;
+			_settings.on_header_value = &_parserCb < &Socket::_onHeaderValue > ;
+			_settings.on_headers_complete = &_parserCb < &Socket::_onHeadersComplete > ;
+		}
+
+		// host is the Host header value and path the request target.  Every
+		//   outcome, including a failed connect, ends in one onClosed.
+		void open(const struct sockaddr *addr, const std::string& host, const std::string& path,
+			const http::Headers& headers = http::Headers()) {
+			_host = host;
+			_path = path;
+			_extraHeaders = headers;
+			_state = State::Connecting;
+			if (!connect(addr)) {
+				_drop(UV_EINVAL, 1006);
+			}
+		}
+
+		State state() const {
+			return _state;
+		}
+
+		// Returns false unless the connection is open.
+		bool sendMessage(const uint8_t *data, size_t len, bool binary) {
+			if (_state != State::Open) {
+				return false;
+			}
+			_sendFrame(binary ? Opcode::Binary : Opcode::Text, data, len);
+			return true;
+		}
+
+		// Writes a frame built elsewhere with writeFrame, typically on
+		//   another thread, without copying it again.  Returns false unless
+		//   the connection is open and the frame could be queued.
+		bool sendFrame(std::shared_ptr<uvpp::Blob> frame) {
+			if (_state != State::Open) {
+				return false;
+			}
+			uv_buf_t buf = uv_buf_init((char*)frame->data(), (unsigned int)frame->size());
+			return write(&buf, 1, [frame](int32_t status) {}) == 0;
+		}
+
+		// Starts the closing handshake; the connection is dropped as soon as
+		//   the close frame is written.  Before the connection is open it is
+		//   simply dropped, with UV_ECANCELED.
+		void shutdown(uint16_t code = 1000) {
+			if (_state == State::Open) {
+				_sendClose(code, 0, code);
+			} else if (_state != State::Closing && _state != State::Closed) {
+				_drop(UV_ECANCELED, 1006);
+			}
+		}
+
+		virtual void onOpen() {
+			printf("ws::Socket::onOpen\n");
+		}
+
+		// data holds the whole message and is the callee's to keep.
+		virtual void onMessage(std::shared_ptr<uvpp::BufferBlob> data, bool binary) {
+			printf("ws::Socket::onMessage(%d, %d)\n", (int)data->size(), binary);
+		}
+
+		// Last call, once libuv has let go of the handle; the socket may be
+		//   deleted here.  error is 0 after a closing handshake, and code is
+		//   the status the peer sent: 1005 if it sent none, 1006 if there
+		//   was no handshake.
+		virtual void onClosed(int32_t error, uint16_t code) {
+			printf("ws::Socket::onClosed(%d, %d)\n", error, code);
+		}
+
+	private:
+		template<int(Socket::*F)()>
+		static int _parserCb(http_parser *parser) {
+			return (((Socket*)parser->data)->*F)();
+		}
+		template<int(Socket::*F)(const char*, size_t)>
+		static int _parserCb(http_parser *parser, const char *at, size_t length) {
+			return (((Socket*)parser->data)->*F)(at, length);
+		}
+
+		int _onHeaderField(const char *at, size_t length) {
+			if (_inValue) {
+				_endHeader();
+			}
+			_field.append(at, length);
+			return 0;
+		}
+
+		int _onHeaderValue(const char *at, size_t length) {
+			_inValue = true;
+			_value.append(at, length);
+			return 0;
+		}
+
+		int _onHeadersComplete() {
+			if (_inValue) {
+				_endHeader();
+			}
+			_headersDone = true;
+			return 0;
+		}
+
+		// The handshake only needs a few headers; the rest are dropped.
+		void _endHeader() {
+			if (http::equalsIgnoreCase(_field, "Upgrade") || http::equalsIgnoreCase(_field, "Connection") ||
+				http::equalsIgnoreCase(_field, "Sec-WebSocket-Accept") || http::equalsIgnoreCase(_field, "Sec-WebSocket-Extensions")) {
+				for (auto& i : _handshakeHeaders) {
+					if (http::equalsIgnoreCase(i.first, _field.c_str())) {
+						i.second.append(",").append(_value);
+						_field.clear();
+					}
+				}
+				if (!_field.empty()) {
+					_handshakeHeaders.emplace_back(_field, _value);
+				}
+			}
+			_field.clear();
+			_value.clear();
+			_inValue = false;
+		}
+
+		std::string _handshakeHeader(const char *name) {
+			for (auto& i : _handshakeHeaders) {
+				if (http::equalsIgnoreCase(i.first, name)) {
+					return i.second;
+				}
+			}
+			return std::string();
+		}
+
+		void _sendHandshake() {
+			uint8_t nonce[16];
+			for (size_t k = 0; k < sizeof(nonce); k += 4) {
+				uint32_t r = (uint32_t)_rng();
+				memcpy(nonce + k, &r, 4);
+			}
+			std::string key = i::base64(nonce, sizeof(nonce));
+			std::string accept = key + i::kAcceptGuid;
+			uint8_t digest[20];
+			i::sha1((const uint8_t*)accept.data(), accept.size(), digest);
+			_expectedAccept = i::base64(digest, sizeof(digest));
+
+			std::string head;
+			head.reserve(_path.size() + _host.size() + 160);
+			head.append("GET ").append(_path).append(" HTTP/1.1\r\n");
+			head.append("Host: ").append(_host).append("\r\n");
+			head.append("Upgrade: websocket\r\nConnection: Upgrade\r\n");
+			head.append("Sec-WebSocket-Key: ").append(key).append("\r\n");
+			head.append("Sec-WebSocket-Version: 13\r\n");
+			for (auto& i : _extraHeaders) {
+				head.append(i.first).append(": ").append(i.second).append("\r\n");
+			}
+			head.append("\r\n");
+			send(head.data(), head.size());
+		}
+
+		void _parseHandshake(const char *data, size_t len) {
+			size_t parsed = http_parser_execute(&_parser, &_settings, data, len);
+			if (HTTP_PARSER_ERRNO(&_parser) != HPE_OK) {
+				return _drop(UV_EPROTO, 1006);
+			}
+			if (!_headersDone) {
+				return;
+			}
+			std::string accept = _handshakeHeader("Sec-WebSocket-Accept");
+			accept.erase(0, accept.find_first_not_of(" \t"));
+			accept.erase(accept.find_last_not_of(" \t") + 1);
+			if (!_parser.upgrade || _parser.status_code != 101 || !i::hasToken(_handshakeHeader("Upgrade"), "websocket") ||
+				!i::hasToken(_handshakeHeader("Connection"), "upgrade") || accept != _expectedAccept ||
+				!_handshakeHeader("Sec-WebSocket-Extensions").empty()) {
+				printf("ws::Socket handshake rejected (%d)\n", _parser.status_code);
+				return _drop(UV_EPROTO, 1006);
+			}
+
+			_handshakeHeaders.clear();
+			_extraHeaders.clear();
+			_state = State::Open;
+			onOpen();
+			if (parsed < len) {
+				_parseFrames(data + parsed, len - parsed);
+			}
+		}
+
+		size_t _headerSize() const {
+			if (_headerLen < 2) {
+				return 2;
+			}
+			uint8_t len7 = _header[1] & 0x7F;
+			return 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + ((_header[1] & 0x80) ? 4 : 0);
+		}
+
+		// Frames can split anywhere across reads, headers included.
+		void _parseFrames(const char *data, size_t len) {
+			const uint8_t *p = (const uint8_t*)data;
+			const uint8_t *end = p + len;
+			while (p < end && !_dropping && !_closeReceived) {
+				if (!_inPayload) {
+					while (_headerLen < _headerSize() && p < end) {
+						_header[_headerLen++] = *p++;
+					}
+					if (_headerLen < _headerSize() || !_beginFrame()) {
+						return;
+					}
+				}
+				size_t take = (size_t)std::min<uint64_t>(_remaining, (uint64_t)(end - p));
+				if (take > 0 && !_payload(p, take)) {
+					return;
+				}
+				p += take;
+				_remaining -= take;
+				if (_remaining == 0) {
+					_inPayload = false;
+					_headerLen = 0;
+					_endFrame();
+				}
+			}
+		}
+
+		bool _beginFrame() {
+			_fin = (_header[0] & 0x80) != 0;
+			_opcode = _header[0] & 0x0F;
+			uint64_t length = _header[1] & 0x7F;
+			if (length == 126) {
+				length = (uint64_t)_header[2] << 8 | _header[3];
+			} else if (length == 127) {
+				length = 0;
+				for (int k = 2; k < 10; ++k) {
+					length = length << 8 | _header[k];
+				}
+			}
+			// Servers never mask, and no extension was agreed to use the
+			//   reserved bits.
+			if ((_header[0] & 0x70) || (_header[1] & 0x80)) {
+				return _protocolError();
+			}
+
+			if (_opcode & 0x8) {
+				if (!_fin || length > 125 || _opcode > (uint8_t)Opcode::Pong) {
+					return _protocolError();
+				}
+				_control.clear();
+			} else {
+				if (_opcode == (uint8_t)Opcode::Continuation) {
+					if (!_fragmented) {
+						return _protocolError();
+					}
+				} else if (_opcode == (uint8_t)Opcode::Text || _opcode == (uint8_t)Opcode::Binary) {
+					if (_fragmented) {
+						return _protocolError();
+					}
+					_binary = _opcode == (uint8_t)Opcode::Binary;
+					_message = std::make_shared<uvpp::BufferBlob>();
+				} else {
+					return _protocolError();
+				}
+				if (length > _maxMessageBytes - _message->size()) {
+					_sendClose(1009, UV_ENOBUFS, 1009);
+					return false;
+				}
+				// Unfragmented messages, the usual case, land in one
+				//   exactly sized allocation.
+				if (_message->size() == 0 && !_message->reserve((size_t)length)) {
+					_sendClose(1009, UV_ENOMEM, 1009);
+					return false;
+				}
+				_fragmented = !_fin;
+			}
+			_remaining = length;
+			_inPayload = true;
+			return true;
+		}
+
+		bool _payload(const uint8_t *data, size_t len) {
+			if (_opcode & 0x8) {
+				_control.append((const char*)data, len);
+			} else if (!_message->append(data, len)) {
+				_sendClose(1009, UV_ENOMEM, 1009);
+				return false;
+			}
+			return true;
+		}
+
+		void _endFrame() {
+			switch ((Opcode)_opcode) {
+			case Opcode::Ping:
+				if (_state == State::Open) {
+					_sendFrame(Opcode::Pong, (const uint8_t*)_control.data(), _control.size());
+				}
+				break;
+			case Opcode::Pong:
+				break;
+			case Opcode::Close: {
+				if (_control.size() == 1) {
+					_protocolError();
+					break;
+				}
+				_closeReceived = true;
+				uint16_t code = _control.size() >= 2 ? (uint16_t)((uint8_t)_control[0] << 8 | (uint8_t)_control[1]) : 1005;
+				if (_closeSent) {
+					_drop(0, code);
+				} else {
+					_sendClose(code == 1005 ? 1000 : code, 0, code);
+				}
+				break;
+			}
+			default:
+				// Data that arrives after our close frame is discarded.
+				if (_fin) {
+					_fragmented = false;
+					std::shared_ptr<uvpp::BufferBlob> message;
+					message.swap(_message);
+					if (_state == State::Open) {
+						onMessage(message, _binary);
+					}
+				}
+				break;
+			}
+		}
+
+		bool _protocolError() {
+			_sendClose(1002, UV_EPROTO, 1006);
+			return false;
+		}
+
+		// Header and masked payload go into one pool buffer.
+		char * _frame(Opcode opcode, const uint8_t *data, size_t len, size_t& size, size_t& capacity) {
+			char *buf = _loop.bufferPool().alloc(len + kMaxFrameOverhead, capacity);
+			size = writeFrame((uint8_t*)buf, opcode, data, len, (uint32_t)_rng());
+			return buf;
+		}
+
+		void _sendFrame(Opcode opcode, const uint8_t *data, size_t len) {
+			size_t size, capacity;
+			char *buf = _frame(opcode, data, len, size, capacity);
+			sendPooled(buf, size, capacity);
+		}
+
+		// Closing the handle would cancel the write, so the connection is
+		//   only dropped once the close frame is out.
+		void _sendClose(uint16_t status, int32_t error, uint16_t code) {
+			if (_closeSent || _dropping) {
+				return;
+			}
+			_state = State::Closing;
+			_closeSent = true;
+			uint8_t payload[2] = { (uint8_t)(status >> 8), (uint8_t)status };
+			size_t size, capacity;
+			char *buf = _frame(Opcode::Close, payload, sizeof(payload), size, capacity);
+			uvpp::BufferPool& pool = _loop.bufferPool();
+			uv_buf_t out = uv_buf_init(buf, (unsigned int)size);
+			write(&out, 1, [this, &pool, buf, capacity, error, code](int32_t status) {
+				pool.release(buf, capacity);
+				_drop(error, code);
+			});
+		}
+
+		void _drop(int32_t error, uint16_t code) {
+			if (_dropping) {
+				return;
+			}
+			_dropping = true;
+			_error = error;
+			_closeCode = code;
+			if (_state != State::Closed) {
+				_state = State::Closing;
+			}
+			close();
+		}
+
+		virtual void onConnect() override {
+			_state = State::Handshake;
+			_sendHandshake();
+		}
+
+		virtual void onRecv(const char *data, size_t len) override {
+			if (_dropping) {
+				return;
+			}
+			if (_state == State::Handshake) {
+				_parseHandshake(data, len);
+			} else {
+				_parseFrames(data, len);
+			}
+		}
+
+		virtual void onClose() override {
+			if (_closeReceived) {
+				_drop(0, _closeCode);
+			} else {
+				_drop(UV_ECONNRESET, 1006);
+			}
+		}
+
+		// Writes cancelled by our own close land here too.
+		virtual void onError(uint32_t code) override {
+			_drop((int32_t)code, 1006);
+		}
+
+		virtual void onDisposed() override {
+			_state = State::Closed;
+			onClosed(_error, _closeCode);
+		}
+
+		uvpp::EventLoop& _loop;
+		State _state;
+		size_t _maxMessageBytes;
+		// Handshake nonce and mask keys, drawn from the OS source each time;
+		//   a seeded PRNG would let its output be predicted from earlier keys.
+		std::random_device _rng;
+
+		// Handshake.
+		std::string _host;
+		std::string _path;
+		http::Headers _extraHeaders;
+		std::string _expectedAccept;
+		http_parser _parser;
+		http_parser_settings _settings;
+		bool _headersDone;
+		bool _inValue;
+		std::string _field;
+		std::string _value;
+		http::Headers _handshakeHeaders;
+
+		// Incoming frames.
+		uint8_t _header[14];
+		size_t _headerLen;
+		bool _inPayload;
+		uint64_t _remaining;
+		uint8_t _opcode;
+		bool _fin;
+		bool _fragmented;
+		bool _binary;
+		std::shared_ptr<uvpp::BufferBlob> _message;
+		std::string _control;
+
+		bool _closeSent;
+		bool _closeReceived;
+		bool _dropping;
+		int32_t _error;
+		uint16_t _closeCode;
+
+	};
+}